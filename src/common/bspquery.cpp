@@ -0,0 +1,1079 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bspquery.h"
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// traversal stack entries kept on the calling thread's stack. A tree that
+// needs more has its stacks allocated by each query
+#define QUERY_STACK_SIZE	512
+
+// ________________________________________________________________________________
+// loading
+
+static bool ReadInts(FILE *fp, int *i, int count)
+{
+	return fread(i, sizeof(int), count, fp) == (size_t)count;
+}
+
+static bool ReadFloats(FILE *fp, float *f, int count)
+{
+	return fread(f, sizeof(float), count, fp) == (size_t)count;
+}
+
+static bool Skip(FILE *fp, long numbytes)
+{
+	return fseek(fp, numbytes, SEEK_CUR) == 0;
+}
+
+static bool SkipAreas(FILE *fp)
+{
+	int numareas;
+	if (!ReadInts(fp, &numareas, 1))
+		return false;
+
+	for (int i = 0; i < numareas; i++)
+	{
+		int numleafs;
+		if (!ReadInts(fp, &numleafs, 1) || !Skip(fp, numleafs * sizeof(int)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool SkipPortals(FILE *fp)
+{
+	int numportals;
+	if (!ReadInts(fp, &numportals, 1))
+		return false;
+
+	for (int i = 0; i < numportals; i++)
+	{
+		int data[3];
+		if (!ReadInts(fp, data, 3) || !Skip(fp, data[2] * 3 * sizeof(float)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool SkipRenderModel(FILE *fp)
+{
+	int count;
+
+	// name, vertices with normals and indicies
+	if (!ReadInts(fp, &count, 1) || !Skip(fp, count))
+		return false;
+	if (!ReadInts(fp, &count, 1) || !Skip(fp, count * 6 * sizeof(float)))
+		return false;
+	if (!ReadInts(fp, &count, 1) || !Skip(fp, count * sizeof(int)))
+		return false;
+
+	return true;
+}
+
+static bool IsLeafChild(int child)
+{
+	return (child & QUERY_LEAF_BIT) != 0;
+}
+
+static int LeafNum(int child)
+{
+	return child & ~QUERY_LEAF_BIT;
+}
+
+// the full node block, only kept while loading
+typedef struct filenode_s
+{
+	int		children[2];
+	float		plane[4];
+	qbox_t		box;
+	int		empty;
+
+} filenode_t;
+
+typedef struct loadstate_s
+{
+	int		numfilenodes;
+	filenode_t	*filenodes;
+
+	bool		compact;
+
+	// the shared planes of a packed file
+	int		numfileplanes;
+	float		(*fileplanes)[4];
+
+	// end of the model's section in a packed file, 0 for the end of the file
+	long		sectionend;
+
+} loadstate_t;
+
+// the nodes of a packed model have a plane number instead of the plane
+static bool LoadNodes(loadstate_t *ls, FILE *fp, bool planenums)
+{
+	int counts[2];
+	if (!ReadInts(fp, counts, 2) || counts[0] <= 0)
+		return false;
+
+	ls->numfilenodes = counts[0];
+	ls->filenodes = (filenode_t*)malloc(ls->numfilenodes * sizeof(filenode_t));
+	if (!ls->filenodes)
+		return false;
+
+	for (int i = 0; i < ls->numfilenodes; i++)
+	{
+		filenode_t *n = ls->filenodes + i;
+
+		if (!ReadInts(fp, n->children, 2))
+			return false;
+		if (planenums)
+		{
+			int planenum;
+			if (!ReadInts(fp, &planenum, 1) || planenum < -1 || planenum >= ls->numfileplanes)
+				return false;
+
+			if (planenum == -1)
+				memset(n->plane, 0, sizeof(n->plane));
+			else
+				memcpy(n->plane, ls->fileplanes[planenum], sizeof(n->plane));
+		}
+		else if (!ReadFloats(fp, n->plane, 4))
+			return false;
+		if (!ReadFloats(fp, n->box.mins, 3) || !ReadFloats(fp, n->box.maxs, 3))
+			return false;
+		if (!ReadInts(fp, &n->empty, 1))
+			return false;
+
+		// nodes have two children or none, and children are numbered after their parent
+		if ((n->children[0] == -1) != (n->children[1] == -1))
+			return false;
+		for (int j = 0; j < 2; j++)
+		{
+			if (n->children[j] != -1 && (n->children[j] <= i || n->children[j] >= ls->numfilenodes))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool ReadString(FILE *fp, char *s, int size)
+{
+	int len;
+	if (!ReadInts(fp, &len, 1) || len < 0 || len >= size)
+		return false;
+
+	s[len] = '\0';
+	return fread(s, 1, len, fp) == (size_t)len;
+}
+
+// read the directory of a packed file and find the entry of the model, by
+// name if one is given. Returns the number of the model, -1 if there's no such
+// model or the directory can't be read
+static int ReadModelEntry(FILE *fp, int model, const char *name, int *offset, int *numbytes)
+{
+	int nummodels;
+	if (!ReadInts(fp, &nummodels, 1) || nummodels < 0)
+		return -1;
+
+	int found = -1;
+	for (int i = 0; i < nummodels; i++)
+	{
+		char entryname[256];
+		float bounds[6];
+		int data[7];
+		if (!ReadString(fp, entryname, sizeof(entryname)) || !ReadFloats(fp, bounds, 6) || !ReadInts(fp, data, 7))
+			return -1;
+
+		if (found == -1 && (name ? !strcmp(name, entryname) : i == model))
+		{
+			*offset = data[5];
+			*numbytes = data[6];
+			found = i;
+		}
+	}
+
+	return found;
+}
+
+// the shared planes follow the directory. Then go to the model's section
+static bool SeekModel(loadstate_t *ls, FILE *fp, int model)
+{
+	int offset, numbytes;
+	if (ReadModelEntry(fp, model, NULL, &offset, &numbytes) == -1)
+		return false;
+
+	char header[8];
+	if (fread(header, 8, 1, fp) != 1 || strncmp(header, "planes", 8))
+		return false;
+
+	if (!ReadInts(fp, &ls->numfileplanes, 1) || ls->numfileplanes < 0)
+		return false;
+
+	ls->fileplanes = (float(*)[4])malloc(ls->numfileplanes * sizeof(float[4]) + 1);
+	if (!ls->fileplanes || !ReadFloats(fp, (float*)ls->fileplanes, ls->numfileplanes * 4))
+		return false;
+
+	ls->sectionend = (long)offset + numbytes;
+
+	return offset > 0 && numbytes > 0 && fseek(fp, offset, SEEK_SET) == 0;
+}
+
+static bool LoadPlanes(qtree_t *tree, FILE *fp)
+{
+	if (!ReadInts(fp, &tree->numplanes, 1) || tree->numplanes < 0)
+		return false;
+
+	tree->planes = (float(*)[4])malloc(tree->numplanes * sizeof(float[4]) + 1);
+	return tree->planes && ReadFloats(fp, (float*)tree->planes, tree->numplanes * 4);
+}
+
+static bool LoadCompactNodes(qtree_t *tree, FILE *fp)
+{
+	if (!ReadInts(fp, &tree->numnodes, 1) || tree->numnodes < 0)
+		return false;
+	if (!ReadInts(fp, &tree->headnode, 1))
+		return false;
+
+	tree->nodes = (qnode_t*)malloc(tree->numnodes * sizeof(qnode_t) + 1);
+	return tree->nodes && ReadInts(fp, (int*)tree->nodes, tree->numnodes * 4);
+}
+
+static bool LoadCompactLeafs(qtree_t *tree, FILE *fp)
+{
+	if (!ReadInts(fp, &tree->numleafs, 1) || tree->numleafs <= 0)
+		return false;
+
+	tree->leafs = (qleaf_t*)malloc(tree->numleafs * sizeof(qleaf_t));
+	return tree->leafs && ReadInts(fp, (int*)tree->leafs, tree->numleafs * 2);
+}
+
+static bool LoadCompactBoxes(qtree_t *tree, FILE *fp)
+{
+	// the node and leaf lumps come first
+	int numboxes;
+	if (!ReadInts(fp, &numboxes, 1) || numboxes != tree->numnodes + tree->numleafs)
+		return false;
+
+	tree->boxes = (qbox_t*)malloc(numboxes * sizeof(qbox_t));
+	return tree->boxes && ReadFloats(fp, (float*)tree->boxes, numboxes * 6);
+}
+
+// the implicit records are written instead of the node block, with the root box
+static bool LoadImplicitNodes(qtree_t *tree, FILE *fp)
+{
+	if (!ReadInts(fp, &tree->numinodes, 1) || tree->numinodes <= 0)
+		return false;
+	if (!ReadFloats(fp, tree->mins, 3) || !ReadFloats(fp, tree->maxs, 3))
+		return false;
+
+	tree->headnode = 0;
+
+	tree->inodes = (qinode_t*)malloc(tree->numinodes * sizeof(qinode_t));
+	return tree->inodes && ReadInts(fp, (int*)tree->inodes, tree->numinodes * 2);
+}
+
+// a child's box is its parent's cut down by the parent's plane where the plane
+// is along an axis, the same as the compiler makes them. side is 1 for the
+// back child, which is cut by the flipped plane
+static void ClipBox(const qbox_t *box, const float plane[4], int side, qbox_t *clipped)
+{
+	*clipped = *box;
+
+	for (int i = 0; i < 3; i++)
+	{
+		float normal = (side ? -plane[i] : plane[i]);
+		float dist = (side ? -plane[3] : plane[3]);
+
+		if (normal == 1)
+			clipped->mins[i] = -dist;
+		else if (normal == -1)
+			clipped->maxs[i] = dist;
+	}
+}
+
+// the records are in pre-order, so a node's box is made before its children's
+static bool ImplicitBoxes(qtree_t *tree)
+{
+	tree->boxes = (qbox_t*)malloc(tree->numinodes * sizeof(qbox_t));
+	if (!tree->boxes)
+		return false;
+
+	memcpy(tree->boxes[0].mins, tree->mins, sizeof(tree->mins));
+	memcpy(tree->boxes[0].maxs, tree->maxs, sizeof(tree->maxs));
+
+	for (int i = 0; i < tree->numinodes; i++)
+	{
+		const qinode_t *n = tree->inodes + i;
+		if (n->planenum & QUERY_LEAF_BIT)
+			continue;
+
+		const float *plane = tree->planes[n->planenum];
+		ClipBox(tree->boxes + i, plane, 0, tree->boxes + i + 1);
+		ClipBox(tree->boxes + i, plane, 1, tree->boxes + i + n->back);
+	}
+
+	return true;
+}
+
+// build the compact tree from the node block. The node block is in pre-order,
+// so numbering the nodes and leafs in file order gives a depth first layout
+static bool CompactFileNodes(qtree_t *tree, loadstate_t *ls)
+{
+	int *index = (int*)malloc(ls->numfilenodes * sizeof(int));
+	if (!index)
+		return false;
+
+	tree->numnodes = 0;
+	tree->numleafs = 0;
+	for (int i = 0; i < ls->numfilenodes; i++)
+	{
+		if (ls->filenodes[i].children[0] == -1)
+			index[i] = tree->numleafs++ | QUERY_LEAF_BIT;
+		else
+			index[i] = tree->numnodes++;
+	}
+
+	tree->planes = (float(*)[4])malloc(tree->numnodes * sizeof(float[4]) + 1);
+	tree->nodes = (qnode_t*)malloc(tree->numnodes * sizeof(qnode_t) + 1);
+	tree->leafs = (qleaf_t*)malloc(tree->numleafs * sizeof(qleaf_t));
+	tree->boxes = (qbox_t*)malloc(ls->numfilenodes * sizeof(qbox_t));
+	if (!tree->planes || !tree->nodes || !tree->leafs || !tree->boxes)
+	{
+		free(index);
+		return false;
+	}
+
+	tree->numplanes = tree->numnodes;
+	tree->headnode = index[0];
+
+	for (int i = 0; i < ls->numfilenodes; i++)
+	{
+		filenode_t *f = ls->filenodes + i;
+
+		if (IsLeafChild(index[i]))
+		{
+			qleaf_t *l = tree->leafs + LeafNum(index[i]);
+			l->nodenum = i;
+			l->empty = f->empty;
+			tree->boxes[tree->numnodes + LeafNum(index[i])] = f->box;
+			continue;
+		}
+
+		qnode_t *n = tree->nodes + index[i];
+		n->planenum = index[i];
+		n->children[0] = index[f->children[0]];
+		n->children[1] = index[f->children[1]];
+		n->nodenum = i;
+		memcpy(tree->planes[index[i]], f->plane, sizeof(f->plane));
+		tree->boxes[index[i]] = f->box;
+	}
+
+	free(index);
+
+	return true;
+}
+
+static bool ValidChild(const qtree_t *tree, int child)
+{
+	if (IsLeafChild(child))
+		return LeafNum(child) < tree->numleafs;
+
+	return child >= 0 && child < tree->numnodes;
+}
+
+static int MaxDepth(int front, int back)
+{
+	if (front < 0 || back < 0)
+		return -1;
+
+	return (front > back ? front : back);
+}
+
+// check the indices and return the depth of the deepest leaf, -1 if the
+// subtree is bad. A path through more nodes than there are has a cycle, which
+// stops a bad file from recursing forever
+static int ValidSubtree(const qtree_t *tree, int child, int depth)
+{
+	if (!ValidChild(tree, child) || depth > tree->numnodes)
+		return -1;
+
+	if (IsLeafChild(child))
+		return depth;
+
+	const qnode_t *n = tree->nodes + child;
+	if (n->planenum < 0 || n->planenum >= tree->numplanes)
+		return -1;
+
+	int front = ValidSubtree(tree, n->children[0], depth + 1);
+	if (front < 0)
+		return -1;
+
+	return MaxDepth(front, ValidSubtree(tree, n->children[1], depth + 1));
+}
+
+// the same checks for the implicit records. A back child has to come after the
+// front child's records, so offsets can't loop back
+static int ValidImplicitSubtree(const qtree_t *tree, int index, int depth)
+{
+	if (index < 0 || index >= tree->numinodes)
+		return -1;
+
+	const qinode_t *n = tree->inodes + index;
+	if (n->planenum & QUERY_LEAF_BIT)
+		return depth;
+
+	if (n->planenum >= tree->numplanes || n->back < 2 || n->back >= tree->numinodes - index)
+		return -1;
+
+	int front = ValidImplicitSubtree(tree, index + 1, depth + 1);
+	if (front < 0)
+		return -1;
+
+	return MaxDepth(front, ValidImplicitSubtree(tree, index + n->back, depth + 1));
+}
+
+qtree_t *Query_LoadTree(const char *filename)
+{
+	return Query_LoadModel(filename, 0);
+}
+
+int Query_FindModel(const char *filename, const char *name)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return -1;
+
+	int model = -1;
+	int offset, numbytes;
+	char header[8];
+	if (fread(header, 8, 1, fp) == 1 && !strncmp(header, "models", 8))
+		model = ReadModelEntry(fp, 0, name, &offset, &numbytes);
+
+	fclose(fp);
+
+	return model;
+}
+
+qtree_t *Query_LoadModel(const char *filename, int model)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return NULL;
+
+	qtree_t *tree = (qtree_t*)calloc(1, sizeof(qtree_t));
+	loadstate_t ls;
+	memset(&ls, 0, sizeof(ls));
+
+	// a packed file starts with its model directory. Anything else is a file
+	// of one model
+	char header[8];
+	bool ok = true;
+	if (fread(header, 8, 1, fp) == 1 && !strncmp(header, "models", 8))
+		ok = SeekModel(&ls, fp, model);
+	else
+		ok = (model == 0 && fseek(fp, 0, SEEK_SET) == 0);
+
+	// read the node blocks, skipping over everything else
+	while (ok && (!ls.sectionend || ftell(fp) < ls.sectionend) && fread(header, 8, 1, fp) == 1)
+	{
+		if (!strncmp(header, "nodes", 8))
+			ok = LoadNodes(&ls, fp, false);
+		else if (!strncmp(header, "mnodes", 8))
+			ok = LoadNodes(&ls, fp, true);
+		else if (!strncmp(header, "planes", 8))
+			ok = LoadPlanes(tree, fp);
+		else if (!strncmp(header, "tnodes", 8))
+			ok = ls.compact = LoadCompactNodes(tree, fp);
+		else if (!strncmp(header, "tleafs", 8))
+			ok = LoadCompactLeafs(tree, fp);
+		else if (!strncmp(header, "tboxes", 8))
+			ok = LoadCompactBoxes(tree, fp);
+		else if (!strncmp(header, "inodes", 8))
+			ok = LoadImplicitNodes(tree, fp);
+		else if (!strncmp(header, "areas", 8))
+			ok = SkipAreas(fp);
+		else if (!strncmp(header, "portals", 8))
+			ok = SkipPortals(fp);
+		else if (!strncmp(header, "rmodel", 8))
+			ok = SkipRenderModel(fp);
+		else
+			ok = false;
+	}
+
+	fclose(fp);
+
+	if (ok && !tree->inodes && !ls.compact)
+		ok = ls.filenodes && CompactFileNodes(tree, &ls);
+
+	// the boxes are made once the records are known to be good. A depth
+	// first walk never holds more than one entry per level below the root
+	int depth = -1;
+	if (tree->inodes)
+	{
+		ok = ok && tree->planes;
+		ok = ok && (depth = ValidImplicitSubtree(tree, 0, 0)) >= 0;
+		ok = ok && ImplicitBoxes(tree);
+	}
+	else
+	{
+		ok = ok && tree->planes && tree->nodes && tree->leafs && tree->boxes;
+		ok = ok && (depth = ValidSubtree(tree, tree->headnode, 0)) >= 0;
+	}
+	tree->stacksize = depth + 1;
+
+	free(ls.filenodes);
+	free(ls.fileplanes);
+
+	if (!ok)
+	{
+		Query_FreeTree(tree);
+		return NULL;
+	}
+
+	// the root box bounds everything, the implicit records carry it
+	if (!tree->inodes)
+	{
+		const qbox_t *root = tree->boxes + (IsLeafChild(tree->headnode) ? tree->numnodes + LeafNum(tree->headnode) : tree->headnode);
+		memcpy(tree->mins, root->mins, sizeof(tree->mins));
+		memcpy(tree->maxs, root->maxs, sizeof(tree->maxs));
+	}
+
+	return tree;
+}
+
+void Query_FreeTree(qtree_t *tree)
+{
+	if (!tree)
+		return;
+
+	free(tree->planes);
+	free(tree->nodes);
+	free(tree->leafs);
+	free(tree->inodes);
+	free(tree->boxes);
+	free(tree);
+}
+
+// ________________________________________________________________________________
+// queries
+
+static float PlaneDistance(const float plane[4], const float p[3])
+{
+	return plane[0] * p[0] + plane[1] * p[1] + plane[2] * p[2] + plane[3];
+}
+
+// the queries walk child codes through these so they work on either form. In
+// the compact form a code is a node index or a leaf index with QUERY_LEAF_BIT
+// set, in the implicit form it's a record index
+static inline bool IsLeaf(const qtree_t *tree, int child)
+{
+	if (tree->inodes)
+		return (tree->inodes[child].planenum & QUERY_LEAF_BIT) != 0;
+
+	return IsLeafChild(child);
+}
+
+static inline int Child(const qtree_t *tree, int child, int side)
+{
+	if (tree->inodes)
+		return (side == 0 ? child + 1 : child + tree->inodes[child].back);
+
+	return tree->nodes[child].children[side];
+}
+
+static inline const float *NodePlane(const qtree_t *tree, int child)
+{
+	if (tree->inodes)
+		return tree->planes[tree->inodes[child].planenum];
+
+	return tree->planes[tree->nodes[child].planenum];
+}
+
+static inline bool LeafEmpty(const qtree_t *tree, int child)
+{
+	if (tree->inodes)
+		return (tree->inodes[child].planenum & QUERY_LEAF_EMPTY) != 0;
+
+	return tree->leafs[LeafNum(child)].empty != 0;
+}
+
+// number of the leaf in the node block
+static inline int LeafNode(const qtree_t *tree, int child)
+{
+	if (tree->inodes)
+		return child;
+
+	return tree->leafs[LeafNum(child)].nodenum;
+}
+
+// points on the plane go down the front side, the same as the compiler
+int Query_PointLeaf(const qtree_t *tree, const float p[3])
+{
+	int child = tree->headnode;
+
+	while (!IsLeaf(tree, child))
+	{
+		int side = (PlaneDistance(NodePlane(tree, child), p) >= 0.0f ? 0 : 1);
+
+		child = Child(tree, child, side);
+	}
+
+	return LeafNode(tree, child);
+}
+
+static void SetTraceHit(const qtree_t *tree, qtrace_t *trace, int leaf, float fraction, int planenode, int planeside)
+{
+	trace->hit = true;
+	trace->fraction = fraction;
+	trace->leaf = leaf;
+
+	if (planenode == -1)
+	{
+		trace->startsolid = true;
+		return;
+	}
+
+	const float *plane = NodePlane(tree, planenode);
+	float sign = (planeside == 0 ? 1.0f : -1.0f);
+	for (int i = 0; i < 4; i++)
+		trace->plane[i] = sign * plane[i];
+}
+
+// the fixed stack if the tree fits it, otherwise one allocated for the query
+static void *TraversalStack(const qtree_t *tree, void *fixedstack, int entrysize)
+{
+	if (tree->stacksize <= QUERY_STACK_SIZE)
+		return fixedstack;
+
+	return malloc(tree->stacksize * entrysize);
+}
+
+static void SetTraceEnd(qtrace_t *trace, const float start[3], const float end[3])
+{
+	for (int i = 0; i < 3; i++)
+		trace->endpos[i] = start[i] + trace->fraction * (end[i] - start[i]);
+}
+
+typedef struct tracestack_s
+{
+	int		child;
+	float		t0, t1;
+
+	// the node whose plane was crossed to get here, -1 for none
+	int		planenode;
+	int		planeside;
+
+} tracestack_t;
+
+// walk the segment through the tree front to back. The near side of each split
+// is pushed last so it's popped first, which means the first solid leaf reached
+// is the closest one along the segment
+void Query_TraceSegment(const qtree_t *tree, const float start[3], const float end[3], qtrace_t *trace)
+{
+	tracestack_t fixedstack[QUERY_STACK_SIZE];
+	tracestack_t *stack = (tracestack_t*)TraversalStack(tree, fixedstack, sizeof(tracestack_t));
+	int sp = 0;
+
+	float delta[3] = { end[0] - start[0], end[1] - start[1], end[2] - start[2] };
+
+	memset(trace, 0, sizeof(*trace));
+	trace->fraction = 1.0f;
+	trace->leaf = -1;
+
+	stack[sp].child = tree->headnode;
+	stack[sp].t0 = 0.0f;
+	stack[sp].t1 = 1.0f;
+	stack[sp].planenode = -1;
+	stack[sp].planeside = 0;
+	sp++;
+
+	while (sp)
+	{
+		tracestack_t s = stack[--sp];
+
+		if (IsLeaf(tree, s.child))
+		{
+			if (LeafEmpty(tree, s.child))
+				continue;
+
+			SetTraceHit(tree, trace, LeafNode(tree, s.child), s.t0, s.planenode, s.planeside);
+			break;
+		}
+
+		const float *plane = NodePlane(tree, s.child);
+
+		// distances of the segment ends from the plane
+		float p0[3], p1[3];
+		for (int i = 0; i < 3; i++)
+		{
+			p0[i] = start[i] + s.t0 * delta[i];
+			p1[i] = start[i] + s.t1 * delta[i];
+		}
+
+		float d0 = PlaneDistance(plane, p0);
+		float d1 = PlaneDistance(plane, p1);
+
+		if (d0 >= 0.0f && d1 >= 0.0f)
+		{
+			stack[sp] = s;
+			stack[sp].child = Child(tree, s.child, 0);
+			sp++;
+			continue;
+		}
+
+		if (d0 < 0.0f && d1 < 0.0f)
+		{
+			stack[sp] = s;
+			stack[sp].child = Child(tree, s.child, 1);
+			sp++;
+			continue;
+		}
+
+		// the segment crosses the plane
+		float t = s.t0 + (s.t1 - s.t0) * (d0 / (d0 - d1));
+		int nearside = (d0 >= 0.0f ? 0 : 1);
+
+		stack[sp].child = Child(tree, s.child, nearside ^ 1);
+		stack[sp].t0 = t;
+		stack[sp].t1 = s.t1;
+		stack[sp].planenode = s.child;
+		stack[sp].planeside = nearside;
+		sp++;
+
+		stack[sp] = s;
+		stack[sp].child = Child(tree, s.child, nearside);
+		stack[sp].t1 = t;
+		sp++;
+	}
+
+	if (stack != fixedstack)
+		free(stack);
+
+	SetTraceEnd(trace, start, end);
+}
+
+// ________________________________________________________________________________
+// packet traces
+//
+// the lanes of a packet walk the tree together. Each stack entry carries a mask
+// of the lanes still going and their own t0/t1 range, so lanes that diverge
+// split the packet into the subsets that go down each side. The packet can only
+// visit one side first, so a lane may reach a far solid leaf before a nearer
+// one. Each lane keeps its closest hit and drops out of any entry that starts
+// beyond it, which gives the same result as the front to back scalar walk
+
+#define PACKET_ALL_LANES	((1 << QUERY_PACKET_SIZE) - 1)
+
+#if defined(__AVX__)
+
+typedef __m256 qvec_t;
+
+static inline qvec_t VecLoad(const float *f) { return _mm256_loadu_ps(f); }
+static inline void VecStore(float *f, qvec_t v) { _mm256_storeu_ps(f, v); }
+static inline qvec_t VecSet(float f) { return _mm256_set1_ps(f); }
+static inline qvec_t VecAdd(qvec_t a, qvec_t b) { return _mm256_add_ps(a, b); }
+static inline qvec_t VecSub(qvec_t a, qvec_t b) { return _mm256_sub_ps(a, b); }
+static inline qvec_t VecMul(qvec_t a, qvec_t b) { return _mm256_mul_ps(a, b); }
+static inline qvec_t VecDiv(qvec_t a, qvec_t b) { return _mm256_div_ps(a, b); }
+static inline int VecGreaterEqualZero(qvec_t a) { return _mm256_movemask_ps(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GE_OQ)); }
+static inline int VecLess(qvec_t a, qvec_t b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+
+#elif defined(__SSE__)
+
+typedef __m128 qvec_t;
+
+static inline qvec_t VecLoad(const float *f) { return _mm_loadu_ps(f); }
+static inline void VecStore(float *f, qvec_t v) { _mm_storeu_ps(f, v); }
+static inline qvec_t VecSet(float f) { return _mm_set1_ps(f); }
+static inline qvec_t VecAdd(qvec_t a, qvec_t b) { return _mm_add_ps(a, b); }
+static inline qvec_t VecSub(qvec_t a, qvec_t b) { return _mm_sub_ps(a, b); }
+static inline qvec_t VecMul(qvec_t a, qvec_t b) { return _mm_mul_ps(a, b); }
+static inline qvec_t VecDiv(qvec_t a, qvec_t b) { return _mm_div_ps(a, b); }
+static inline int VecGreaterEqualZero(qvec_t a) { return _mm_movemask_ps(_mm_cmpge_ps(a, _mm_setzero_ps())); }
+static inline int VecLess(qvec_t a, qvec_t b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+
+#else
+
+// scalar fallback with the same interface
+typedef struct qvec_s
+{
+	float	v[QUERY_PACKET_SIZE];
+
+} qvec_t;
+
+static inline qvec_t VecLoad(const float *f) { qvec_t r; for (int i = 0; i < QUERY_PACKET_SIZE; i++) r.v[i] = f[i]; return r; }
+static inline void VecStore(float *f, qvec_t v) { for (int i = 0; i < QUERY_PACKET_SIZE; i++) f[i] = v.v[i]; }
+static inline qvec_t VecSet(float f) { qvec_t r; for (int i = 0; i < QUERY_PACKET_SIZE; i++) r.v[i] = f; return r; }
+static inline qvec_t VecAdd(qvec_t a, qvec_t b) { for (int i = 0; i < QUERY_PACKET_SIZE; i++) a.v[i] += b.v[i]; return a; }
+static inline qvec_t VecSub(qvec_t a, qvec_t b) { for (int i = 0; i < QUERY_PACKET_SIZE; i++) a.v[i] -= b.v[i]; return a; }
+static inline qvec_t VecMul(qvec_t a, qvec_t b) { for (int i = 0; i < QUERY_PACKET_SIZE; i++) a.v[i] *= b.v[i]; return a; }
+static inline qvec_t VecDiv(qvec_t a, qvec_t b) { for (int i = 0; i < QUERY_PACKET_SIZE; i++) a.v[i] /= b.v[i]; return a; }
+static inline int VecGreaterEqualZero(qvec_t a) { int m = 0; for (int i = 0; i < QUERY_PACKET_SIZE; i++) m |= (a.v[i] >= 0.0f ? 1 << i : 0); return m; }
+static inline int VecLess(qvec_t a, qvec_t b) { int m = 0; for (int i = 0; i < QUERY_PACKET_SIZE; i++) m |= (a.v[i] < b.v[i] ? 1 << i : 0); return m; }
+
+#endif
+
+typedef struct packetstack_s
+{
+	int		child;
+	int		mask;
+	float		t0[QUERY_PACKET_SIZE];
+	float		t1[QUERY_PACKET_SIZE];
+
+	// node and side of the plane each lane last crossed, -1 for none
+	int		planenode[QUERY_PACKET_SIZE];
+	int		planeside[QUERY_PACKET_SIZE];
+
+} packetstack_t;
+
+// the segments in structure of arrays form
+typedef struct packet_s
+{
+	float		start[3][QUERY_PACKET_SIZE];
+	float		delta[3][QUERY_PACKET_SIZE];
+	float		best[QUERY_PACKET_SIZE];
+
+} packet_t;
+
+// build the child entry for the lanes in mask. Lanes in enter came across the
+// plane and take their range from the split point
+static void PushPacketChild(packetstack_t *dst, const packetstack_t *src, int child, int mask, int enter, int leave,
+	const float *tsplit, int planenode, int planeside)
+{
+	dst->child = child;
+	dst->mask = mask;
+
+	for (int i = 0; i < QUERY_PACKET_SIZE; i++)
+	{
+		int bit = 1 << i;
+
+		dst->t0[i] = ((enter & bit) ? tsplit[i] : src->t0[i]);
+		dst->t1[i] = ((leave & bit) ? tsplit[i] : src->t1[i]);
+		dst->planenode[i] = ((enter & bit) ? planenode : src->planenode[i]);
+		dst->planeside[i] = ((enter & bit) ? planeside : src->planeside[i]);
+	}
+}
+
+static void TracePacket(const qtree_t *tree, packet_t *p, int lanes, qtrace_t *traces)
+{
+	packetstack_t fixedstack[QUERY_STACK_SIZE];
+	packetstack_t *stack = (packetstack_t*)TraversalStack(tree, fixedstack, sizeof(packetstack_t));
+	int sp = 0;
+
+	packetstack_t *root = stack + sp++;
+	root->child = tree->headnode;
+	root->mask = lanes;
+	for (int i = 0; i < QUERY_PACKET_SIZE; i++)
+	{
+		root->t0[i] = 0.0f;
+		root->t1[i] = 1.0f;
+		root->planenode[i] = -1;
+		root->planeside[i] = 0;
+	}
+
+	qvec_t sx = VecLoad(p->start[0]);
+	qvec_t sy = VecLoad(p->start[1]);
+	qvec_t sz = VecLoad(p->start[2]);
+	qvec_t dx = VecLoad(p->delta[0]);
+	qvec_t dy = VecLoad(p->delta[1]);
+	qvec_t dz = VecLoad(p->delta[2]);
+
+	while (sp)
+	{
+		packetstack_t *s = stack + --sp;
+		qvec_t t0 = VecLoad(s->t0);
+		qvec_t t1 = VecLoad(s->t1);
+
+		// drop lanes that already have a hit closer than this entry
+		int mask = s->mask & VecLess(t0, VecLoad(p->best));
+		if (!mask)
+			continue;
+
+		if (IsLeaf(tree, s->child))
+		{
+			if (LeafEmpty(tree, s->child))
+				continue;
+
+			int leafnum = LeafNode(tree, s->child);
+
+			for (int i = 0; i < QUERY_PACKET_SIZE; i++)
+			{
+				if (!(mask & (1 << i)))
+					continue;
+
+				// replaces any further hit found earlier
+				p->best[i] = s->t0[i];
+				traces[i].startsolid = false;
+				memset(traces[i].plane, 0, sizeof(traces[i].plane));
+				SetTraceHit(tree, traces + i, leafnum, s->t0[i], s->planenode[i], s->planeside[i]);
+			}
+			continue;
+		}
+
+		// plane distances of each lane's end points, in the same order of
+		// operations as the scalar trace so the results match exactly
+		const float *plane = NodePlane(tree, s->child);
+
+		qvec_t a = VecSet(plane[0]);
+		qvec_t b = VecSet(plane[1]);
+		qvec_t c = VecSet(plane[2]);
+		qvec_t d = VecSet(plane[3]);
+
+		qvec_t d0 = VecMul(a, VecAdd(sx, VecMul(t0, dx)));
+		d0 = VecAdd(d0, VecMul(b, VecAdd(sy, VecMul(t0, dy))));
+		d0 = VecAdd(d0, VecMul(c, VecAdd(sz, VecMul(t0, dz))));
+		d0 = VecAdd(d0, d);
+
+		qvec_t d1 = VecMul(a, VecAdd(sx, VecMul(t1, dx)));
+		d1 = VecAdd(d1, VecMul(b, VecAdd(sy, VecMul(t1, dy))));
+		d1 = VecAdd(d1, VecMul(c, VecAdd(sz, VecMul(t1, dz))));
+		d1 = VecAdd(d1, d);
+
+		int front0 = VecGreaterEqualZero(d0) & mask;
+		int front1 = VecGreaterEqualZero(d1) & mask;
+
+		int cross = front0 ^ front1;
+		int nearfront = cross & front0;
+		int nearback = cross & ~front0;
+
+		int frontmask = (front0 & front1) | cross;
+		int backmask = (mask & ~(front0 | front1)) | cross;
+
+		float tsplit[QUERY_PACKET_SIZE];
+		if (cross)
+			VecStore(tsplit, VecAdd(t0, VecMul(VecSub(t1, t0), VecDiv(d0, VecSub(d0, d1)))));
+
+		// visit the side most of the crossing lanes start on first
+		int numnearfront = __builtin_popcount(nearfront);
+		int numnearback = __builtin_popcount(nearback);
+		int first = (numnearfront >= numnearback ? 0 : 1);
+		if (!cross)
+			first = (frontmask ? 0 : 1);
+
+		int nodenum = s->child;
+		packetstack_t entry = *s;
+
+		// the entry has been copied so the children can overwrite its slot
+		for (int side = first ^ 1, i = 0; i < 2; side ^= 1, i++)
+		{
+			int child = Child(tree, nodenum, side);
+			int childmask = (side == 0 ? frontmask : backmask);
+			if (!childmask)
+				continue;
+
+			// lanes whose near side is this side leave at the split, the others enter there
+			int enter = (side == 0 ? nearback : nearfront);
+			int leave = (side == 0 ? nearfront : nearback);
+
+			PushPacketChild(stack + sp++, &entry, child, childmask, enter, leave, tsplit, nodenum, side ^ 1);
+		}
+	}
+
+	if (stack != fixedstack)
+		free(stack);
+}
+
+void Query_TraceSegments(const qtree_t *tree, const float (*starts)[3], const float (*ends)[3], int count, qtrace_t *traces)
+{
+	for (int base = 0; base < count; base += QUERY_PACKET_SIZE)
+	{
+		packet_t p;
+		int numlanes = count - base;
+		if (numlanes > QUERY_PACKET_SIZE)
+			numlanes = QUERY_PACKET_SIZE;
+
+		// unused lanes copy the last segment and are masked off
+		for (int i = 0; i < QUERY_PACKET_SIZE; i++)
+		{
+			int j = base + (i < numlanes ? i : numlanes - 1);
+			for (int k = 0; k < 3; k++)
+			{
+				p.start[k][i] = starts[j][k];
+				p.delta[k][i] = ends[j][k] - starts[j][k];
+			}
+			p.best[i] = 1.0f;
+		}
+
+		qtrace_t packettraces[QUERY_PACKET_SIZE];
+		memset(packettraces, 0, sizeof(packettraces));
+		for (int i = 0; i < QUERY_PACKET_SIZE; i++)
+		{
+			packettraces[i].fraction = 1.0f;
+			packettraces[i].leaf = -1;
+		}
+
+		TracePacket(tree, &p, (1 << numlanes) - 1, packettraces);
+
+		for (int i = 0; i < numlanes; i++)
+		{
+			traces[base + i] = packettraces[i];
+			SetTraceEnd(traces + base + i, starts[base + i], ends[base + i]);
+		}
+	}
+}
+
+bool Query_LineOfSight(const qtree_t *tree, const float start[3], const float end[3])
+{
+	qtrace_t trace;
+	Query_TraceSegment(tree, start, end, &trace);
+
+	return !trace.hit;
+}
+
+int Query_BoxLeafs(const qtree_t *tree, const float mins[3], const float maxs[3], int *leafs, int maxleafs)
+{
+	int fixedstack[QUERY_STACK_SIZE];
+	int *stack = (int*)TraversalStack(tree, fixedstack, sizeof(int));
+	int sp = 0;
+	int numleafs = 0;
+
+	stack[sp++] = tree->headnode;
+
+	while (sp)
+	{
+		int child = stack[--sp];
+
+		if (IsLeaf(tree, child))
+		{
+			if (numleafs < maxleafs)
+				leafs[numleafs] = LeafNode(tree, child);
+			numleafs++;
+			continue;
+		}
+
+		const float *plane = NodePlane(tree, child);
+
+		// distances of the box corners nearest and furthest along the plane normal
+		float dmin = plane[3];
+		float dmax = plane[3];
+		for (int i = 0; i < 3; i++)
+		{
+			if (plane[i] >= 0.0f)
+			{
+				dmin += plane[i] * mins[i];
+				dmax += plane[i] * maxs[i];
+			}
+			else
+			{
+				dmin += plane[i] * maxs[i];
+				dmax += plane[i] * mins[i];
+			}
+		}
+
+		if (dmin < 0.0f)
+			stack[sp++] = Child(tree, child, 1);
+		if (dmax >= 0.0f)
+			stack[sp++] = Child(tree, child, 0);
+	}
+
+	if (stack != fixedstack)
+		free(stack);
+
+	return (numleafs < maxleafs ? numleafs : maxleafs);
+}
@@ -0,0 +1,156 @@
+#ifndef __BSPQUERY_H__
+#define __BSPQUERY_H__
+
+// runtime spatial queries over a compiled bsp file
+//
+// the tree is held in one of the two forms the compiler writes with
+// --compact-nodes. The compact form has small nodes that index a shared plane
+// array, child indices with QUERY_LEAF_BIT set for leafs, and the boxes in a
+// separate array. The implicit form is a single array of pre-order records
+// where the front child is the next record, so a node only stores its plane
+// and the offset to its back child, and a leaf is a record of flags. The
+// implicit records are written instead of the node block, and the boxes are
+// made from the root box on load. Files with neither are converted from the
+// node block on load, in depth first order. None of the queries recurse, and
+// they only allocate for a tree too deep for their fixed size stacks, so they
+// can be run from any number of threads against the same tree
+//
+// leafs are identified by the node number the file's areas and portals use
+// whichever form is loaded. The implicit records are numbered the same
+//
+// a packed file holds several models. One model is loaded at a time, by seeking
+// to its section, and its leafs are numbered within the model
+
+// number of segments traced together by Query_TraceSegments
+#if defined(__AVX__)
+#define QUERY_PACKET_SIZE	8
+#else
+#define QUERY_PACKET_SIZE	4
+#endif
+
+#define QUERY_LEAF_BIT		0x80000000
+
+// flags of an implicit leaf record
+#define QUERY_LEAF_EMPTY	0x1
+
+typedef struct qnode_s
+{
+	int		planenum;
+	int		children[2];
+
+	// number of the node in the file's node block
+	int		nodenum;
+
+} qnode_t;
+
+typedef struct qleaf_s
+{
+	int		nodenum;
+	int		empty;
+
+} qleaf_t;
+
+// the records of the implicit form. For leafs planenum holds QUERY_LEAF_BIT
+// and the leaf flags, and back holds the area number
+typedef struct qinode_s
+{
+	int		planenum;
+
+	// offset from this record to the back child
+	int		back;
+
+} qinode_t;
+
+typedef struct qbox_s
+{
+	float		mins[3];
+	float		maxs[3];
+
+} qbox_t;
+
+typedef struct qtree_s
+{
+	// child index of the root, a leaf if the tree has no nodes
+	int		headnode;
+
+	int		numplanes;
+	float		(*planes)[4];
+
+	int		numnodes;
+	qnode_t		*nodes;
+
+	int		numleafs;
+	qleaf_t		*leafs;
+
+	// the implicit form, NULL if the tree is in the compact form. The
+	// headnode is record 0 and the nodes and leafs are NULL
+	int		numinodes;
+	qinode_t	*inodes;
+
+	// node boxes followed by leaf boxes, or one box per record for the
+	// implicit form, made from the root box. Not touched during descent
+	qbox_t		*boxes;
+
+	// bounds of the whole tree
+	float		mins[3];
+	float		maxs[3];
+
+	// entries a traversal stack needs, one more than the depth of the
+	// deepest leaf
+	int		stacksize;
+
+} qtree_t;
+
+typedef struct qtrace_s
+{
+	// true if the segment entered a solid leaf
+	bool		hit;
+
+	// true if the start point is in a solid leaf
+	bool		startsolid;
+
+	// fraction of the segment before the hit, 1 if nothing was hit
+	float		fraction;
+	float		endpos[3];
+
+	// the plane that was crossed into the solid leaf, facing back along the
+	// segment. Zero if the segment starts in solid
+	float		plane[4];
+
+	// the solid leaf that was hit, -1 if nothing was hit
+	int		leaf;
+
+} qtrace_t;
+
+// returns NULL if the file can't be read or has no nodes. For a packed
+// file this loads the first model
+qtree_t *Query_LoadTree(const char *filename);
+
+// load the model with the given number from a packed file. Model 0 of a file
+// that isn't packed is the file's tree
+qtree_t *Query_LoadModel(const char *filename, int model);
+
+// number of the named model of a packed file, -1 if there isn't one
+int Query_FindModel(const char *filename, const char *name);
+
+void Query_FreeTree(qtree_t *tree);
+
+// node number of the leaf containing the point
+int Query_PointLeaf(const qtree_t *tree, const float p[3]);
+
+// find the first solid leaf along the segment from start to end
+void Query_TraceSegment(const qtree_t *tree, const float start[3], const float end[3], qtrace_t *trace);
+
+// trace a batch of segments in packets of QUERY_PACKET_SIZE lanes. This gives
+// the same results as tracing each segment on its own, but nearby segments
+// share the walk down the tree
+void Query_TraceSegments(const qtree_t *tree, const float (*starts)[3], const float (*ends)[3], int count, qtrace_t *traces);
+
+// true if the segment doesn't pass through any solid leaf
+bool Query_LineOfSight(const qtree_t *tree, const float start[3], const float end[3]);
+
+// write the node numbers of the leafs touching the box into leafs, returns the
+// number written. At most maxleafs are written
+int Query_BoxLeafs(const qtree_t *tree, const float mins[3], const float maxs[3], int *leafs, int maxleafs);
+
+#endif
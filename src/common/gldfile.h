@@ -0,0 +1,48 @@
+#ifndef __GLDFILE_H__
+#define __GLDFILE_H__
+
+// binary encoding of the glvis command stream
+//
+// a stream starts with a header, followed by a sequence of packets. Each packet
+// is a command and the size of its payload in bytes, followed by the payload.
+// The payload layout matches the glvis command buffer
+//
+// GLD_CMD_COLOR	float r, g, b, a
+// GLD_CMD_CULL		int mode
+// GLD_CMD_FILL		int mode
+// GLD_CMD_LINES	int numvertices, float xyz[numvertices][3]
+// GLD_CMD_TRIANGLES	int numvertices, float xyz[numvertices][3]
+//
+// the first byte of the magic isn't printable so a reader can tell a binary
+// stream apart from the text format by peeking at a single character
+
+#define GLD_MAGIC	"\x7fGLD"
+#define GLD_VERSION	1
+
+enum gldcmd_t
+{
+	GLD_CMD_FLUSH,
+	GLD_CMD_END,
+	GLD_CMD_COLOR,
+	GLD_CMD_CULL,
+	GLD_CMD_FILL,
+	GLD_CMD_LINES,
+	GLD_CMD_TRIANGLES,
+	GLD_CMD_NUM_COMMANDS
+};
+
+typedef struct gldheader_s
+{
+	char	magic[4];
+	int	version;
+
+} gldheader_t;
+
+typedef struct gldpacket_s
+{
+	int	cmd;
+	int	numbytes;
+
+} gldpacket_t;
+
+#endif
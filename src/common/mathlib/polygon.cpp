@@ -240,27 +240,19 @@ plane_t Polygon_Plane(polygon_t *p)
 
 void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon_t **front, polygon_t **back)
 {
-	int		sides[32+4];
-	int		counts[3];		// FRONT, BACK, ON
-	int		i, j;
-	polygon_t	*f, *b;
-	int		maxpts;
-	
-	counts[0] = counts[1] = counts[2] = 0;
+	polygonsides_t s;
 
-	// classify each point
-	{
-		for (i = 0; i < in->numvertices; i++)
-		{
-			sides[i] = PointOnPlaneSide(in->vertices[i], plane, epsilon);
-			counts[sides[i]]++;
-		}
+	Polygon_ClassifyWithPlane(in, plane, epsilon, &s);
+	Polygon_SplitWithSides(in, plane, &s, front, back);
+}
 
-		sides[i] = sides[0];
-	}
-	
+static int ClassifyVertices(polygon_t *p, plane_t plane, float epsilon, int *sides, float *distances, int *counts);
+static void SplitWithVertexSides(polygon_t *in, plane_t plane, const int *sides, const float *distances, polygon_t **front, polygon_t **back);
+
+void Polygon_SplitWithSides(polygon_t *in, plane_t plane, const polygonsides_t *s, polygon_t **front, polygon_t **back)
+{
 	// all points are on the plane
-	if (!counts[PLANE_SIDE_FRONT] && !counts[PLANE_SIDE_BACK])
+	if (s->side == PLANE_SIDE_ON)
 	{
 		*front = NULL;
 		*back = NULL;
@@ -268,7 +260,7 @@ void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon
 	}
 
 	// all points are front side
-	if (!counts[PLANE_SIDE_BACK])
+	if (s->side == PLANE_SIDE_FRONT)
 	{
 		*front = Polygon_Copy(in);
 		*back = NULL;
@@ -276,13 +268,40 @@ void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon
 	}
 
 	// all points are back side
-	if (!counts[PLANE_SIDE_FRONT])
+	if (s->side == PLANE_SIDE_BACK)
 	{
 		*front = NULL;
 		*back = Polygon_Copy(in);
 		return;
 	}
 
+	if (s->numvertices == in->numvertices)
+	{
+		SplitWithVertexSides(in, plane, s->sides, s->distances, front, back);
+		return;
+	}
+
+	// too many vertices to have been kept, measure them again into a buffer
+	// sized for this polygon
+	int n = in->numvertices + 1;
+	int *sides = (int*)Polygon_MemAlloc(n * (sizeof(int) + sizeof(float)));
+	float *distances = (float*)(sides + n);
+	int counts[3];
+
+	ClassifyVertices(in, plane, s->epsilon, sides, distances, counts);
+	SplitWithVertexSides(in, plane, sides, distances, front, back);
+
+	Polygon_MemFree(sides);
+}
+
+// split a polygon that crosses the plane, given the side and distance of each
+// vertex with the first repeated after the last
+static void SplitWithVertexSides(polygon_t *in, plane_t plane, const int *sides, const float *distances, polygon_t **front, polygon_t **back)
+{
+	int		i, j;
+	polygon_t	*f, *b;
+	int		maxpts;
+
 	// split the polygon
 	maxpts = in->numvertices+4;	// cant use counts[0]+2 because
 								// of fp grouping errors
@@ -346,8 +365,9 @@ void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon
 			{
 				float dist1, dist2, dot;
 				
-				dist1 = Distance(plane, p1);
-				dist2 = Distance(plane, p2);
+				// the distances the vertices were classified by
+				dist1 = distances[i];
+				dist2 = distances[i + 1];
 				dot = dist1 / (dist1 - dist2);
 				mid[j] = ((1.0f - dot) * p1[j]) + (dot * p2[j]);
 			}
@@ -363,11 +383,6 @@ void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon
 	{
 		assert(0);
 	}
-
-	if (f->numvertices > 32 || b->numvertices > 32)
-	{
-		assert(0);
-	}
 }
 
 polygon_t *Polygon_ClipWithPlane(polygon_t *p, plane_t plane, float epsilon)
@@ -425,5 +440,107 @@ int Polygon_OnPlaneSide(polygon_t *p, plane_t plane, float epsilon)
 	return PLANE_SIDE_ON;
 }
 
+// Classify a polygon inside a box with respect to a plane. If the whole box is
+// further than epsilon from the plane every vertex is too, and the side is
+// known without looking at them. The slack covers the rounding of the
+// distances, which grows with the size of the terms summed
+#define BOX_SIDE_SLACK	0.00001f
+
+// FRONT or BACK if the box is clear of that side, CROSS if it's near the plane
+static int BoxSide(const box3 &box, plane_t plane, float epsilon)
+{
+	// the terms of the distance at the least and most corners on each axis
+	float x0 = plane.a * box.min.x, x1 = plane.a * box.max.x;
+	float y0 = plane.b * box.min.y, y1 = plane.b * box.max.y;
+	float z0 = plane.c * box.min.z, z1 = plane.c * box.max.z;
+
+	float nearest = plane.d + (x0 < x1 ? x0 : x1) + (y0 < y1 ? y0 : y1) + (z0 < z1 ? z0 : z1);
+	float furthest = plane.d + (x0 < x1 ? x1 : x0) + (y0 < y1 ? y1 : y0) + (z0 < z1 ? z1 : z0);
+
+	float magnitude = fabsf(plane.d) + fabsf(x0) + fabsf(x1) + fabsf(y0) + fabsf(y1) + fabsf(z0) + fabsf(z1);
+	float clear = epsilon + BOX_SIDE_SLACK * magnitude;
+
+	if (nearest > clear)
+		return PLANE_SIDE_FRONT;
+	if (furthest < -clear)
+		return PLANE_SIDE_BACK;
+
+	return PLANE_SIDE_CROSS;
+}
+
+int Polygon_OnPlaneSideInBox(polygon_t *p, const box3 &box, plane_t plane, float epsilon)
+{
+	int side = BoxSide(box, plane, epsilon);
+	if (side != PLANE_SIDE_CROSS)
+		return side;
+
+	return Polygon_OnPlaneSide(p, plane, epsilon);
+}
+
+// Classify each vertex of a polygon with respect to a plane, the same way as
+// Polygon_OnPlaneSide, keeping the distances for a split
+static int ClassifyVertices(polygon_t *p, plane_t plane, float epsilon, int *sides, float *distances, int *counts)
+{
+	counts[0] = counts[1] = counts[2] = 0;
+
+	int i;
+	for (i = 0; i < p->numvertices; i++)
+	{
+		float d = plane.Distance(p->vertices[i]);
+
+		int side = PLANE_SIDE_ON;
+		if (d > epsilon)
+			side = PLANE_SIDE_FRONT;
+		else if (d < -epsilon)
+			side = PLANE_SIDE_BACK;
+
+		distances[i] = d;
+		sides[i] = side;
+		counts[side]++;
+	}
+
+	distances[i] = distances[0];
+	sides[i] = sides[0];
+
+	if (counts[PLANE_SIDE_FRONT] && counts[PLANE_SIDE_BACK])
+		return PLANE_SIDE_CROSS;
+	if (counts[PLANE_SIDE_BACK])
+		return PLANE_SIDE_BACK;
+	if (counts[PLANE_SIDE_FRONT])
+		return PLANE_SIDE_FRONT;
+
+	return PLANE_SIDE_ON;
+}
+
+// A polygon with more vertices than fit in the sides only has its side kept,
+// and a split measures it again
+int Polygon_ClassifyWithPlane(polygon_t *p, plane_t plane, float epsilon, polygonsides_t *s)
+{
+	s->epsilon = epsilon;
 
+	if (p->numvertices > POLYGON_MAX_SPLIT_VERTICES)
+	{
+		s->side = Polygon_OnPlaneSide(p, plane, epsilon);
+		s->counts[0] = s->counts[1] = s->counts[2] = 0;
+		s->numvertices = 0;
+		return s->side;
+	}
+
+	s->numvertices = p->numvertices;
+	s->side = ClassifyVertices(p, plane, epsilon, s->sides, s->distances, s->counts);
+
+	return s->side;
+}
 
+int Polygon_ClassifyWithPlaneInBox(polygon_t *p, const box3 &box, plane_t plane, float epsilon, polygonsides_t *s)
+{
+	int side = BoxSide(box, plane, epsilon);
+	if (side == PLANE_SIDE_CROSS)
+		return Polygon_ClassifyWithPlane(p, plane, epsilon, s);
+
+	s->side = side;
+	s->epsilon = epsilon;
+	s->numvertices = 0;
+
+	return side;
+}
@@ -16,6 +16,23 @@ typedef struct polygon_s
 
 } polygon_t;
 
+// most vertices a polygon can have and keep its classified vertices, a bigger
+// one is measured again when it's split
+#define POLYGON_MAX_SPLIT_VERTICES	(32 + 4)
+
+// where the vertices of a polygon are with respect to a plane, kept so a split
+// doesn't measure them again. The first vertex is repeated after the last
+typedef struct polygonsides_s
+{
+	int	side;		// of the whole polygon
+	int	counts[3];	// FRONT, BACK, ON
+	float	epsilon;	// the vertices were classified with
+	int	numvertices;	// 0 if the side was known without the vertices
+	int	sides[POLYGON_MAX_SPLIT_VERTICES + 1];
+	float	distances[POLYGON_MAX_SPLIT_VERTICES + 1];
+
+} polygonsides_t;
+
 void Polygon_SetMemCallbacks(void *(*alloccallback)(int numbytes), void (*freecallback)(void *p));
 
 // allocates a new polygon with numvertices
@@ -55,11 +72,23 @@ plane_t Polygon_Plane(polygon_t *p);
 // split the polygon with plane returning the front and back pieces if they exist
 void Polygon_SplitWithPlane(polygon_t *in, plane_t plane, float epsilon, polygon_t **front, polygon_t **back);
 
+// split the polygon with the plane it was classified against
+void Polygon_SplitWithSides(polygon_t *in, plane_t plane, const polygonsides_t *s, polygon_t **front, polygon_t **back);
+
 // clip the polygon with the plane returning the front piece if it exists
 polygon_t *Polygon_ClipWithPlane(polygon_t *p, plane_t plane, float epsilon);
 
 // return which side of the plane the polygon is on
 int Polygon_OnPlaneSide(polygon_t *p, plane_t plane, float epsilon);
 
+// return which side of the plane the polygon is on, given a box the polygon is
+// inside. Only tests the vertices if the box is near the plane
+int Polygon_OnPlaneSideInBox(polygon_t *p, const box3 &box, plane_t plane, float epsilon);
+
+// classify every vertex of the polygon against the plane, returning the side
+// of the polygon. The InBox version leaves the vertices if the box decides it
+int Polygon_ClassifyWithPlane(polygon_t *p, plane_t plane, float epsilon, polygonsides_t *s);
+int Polygon_ClassifyWithPlaneInBox(polygon_t *p, const box3 &box, plane_t plane, float epsilon, polygonsides_t *s);
+
 #endif
 
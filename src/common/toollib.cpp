@@ -5,14 +5,26 @@
 // ==============================================
 // errors and warnings
 
+// called with the message before Error exits. A hook that doesn't return can
+// take over error handling, eg by jumping back out of a library call
+static void (*errorhook)(const char *message);
+
+void SetErrorHook(void (*hook)(const char *message))
+{
+	errorhook = hook;
+}
+
 void Error(const char *error, ...)
 {
 	va_list valist;
 	char buffer[2048];
 	
 	va_start(valist, error);
-	vsprintf(buffer, error, valist);
+	vsnprintf(buffer, sizeof(buffer), error, valist);
 	va_end(valist);
+
+	if (errorhook)
+		errorhook(buffer);
 	
 	fprintf(stderr, "\x1b[31m");
 	fprintf(stderr, "Error: %s", buffer);
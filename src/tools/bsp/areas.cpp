@@ -3,7 +3,7 @@
 // fixme: should the mark empty functionality be somewhere else?
 // if the polygon sits on the plane then send the plane down the front or back side depending on whether
 // the polygon normal faces the same direction as the plane
-static void FilterPolygonIntoLeaf(bspnode_t *n, polygon_t *p)
+static void FilterPolygonIntoLeaf(bspnode_t *n, walkpolygon_t *p)
 {
 	if (!n->children[0] && !n->children[1])
 	{
@@ -14,7 +14,8 @@ static void FilterPolygonIntoLeaf(bspnode_t *n, polygon_t *p)
 		return;
 	}
 
-	int side = Polygon_OnPlaneSide(p, n->plane, CLIP_EPSILON);
+	polygonsides_t sides;
+	int side = WalkPolygonSide(p, n->plane, &sides);
 
 	if (side == PLANE_SIDE_FRONT)
 		FilterPolygonIntoLeaf(n->children[0], p);
@@ -22,7 +23,7 @@ static void FilterPolygonIntoLeaf(bspnode_t *n, polygon_t *p)
 		FilterPolygonIntoLeaf(n->children[1], p);
 	else if (side == PLANE_SIDE_ON)
 	{
-		float dot = Dot(n->plane.GetNormal(), Polygon_Normal(p));
+		float dot = Dot(n->plane.GetNormal(), Polygon_Normal(p->polygon));
 
 		// map 0 to the front child and 1 to the back child
 		int facing = (dot > 0.0f ? 0 : 1);
@@ -31,26 +32,28 @@ static void FilterPolygonIntoLeaf(bspnode_t *n, polygon_t *p)
 	}
 	else if (side == PLANE_SIDE_CROSS)
 	{
-		polygon_t *f, *b;
-		Polygon_SplitWithPlane(p, n->plane, CLIP_EPSILON, &f, &b);
+		walkpolygon_t f, b;
+		WalkSplitPolygon(p, n->plane, &sides, &f, &b);
 
-		FilterPolygonIntoLeaf(n->children[0], f);
-		FilterPolygonIntoLeaf(n->children[1], b);
+		FilterPolygonIntoLeaf(n->children[0], &f);
+		FilterPolygonIntoLeaf(n->children[1], &b);
 	}
 }
 
 void MarkEmptyLeafs(bsptree_t *tree)
 {
 	// iterate all map faces, filter them into the tree
-	for (mapface_t *f = mapdata->faces; f; f = f->next)
+	for (mapface_t *f = ctx->mapdata.faces; f; f = f->next)
 	{
-		// fixme: need a method to filter only structural polygons
-		if (f->areahint)
+		// only structural faces decide which leafs are empty
+		if (f->areahint || f->detail)
 			continue;
 
-		polygon_t *polygon = Polygon_Copy(f->polygon);
+		walkpolygon_t polygon;
+		polygon.polygon = Polygon_Copy(f->polygon);
+		polygon.box = f->box;
 
-		FilterPolygonIntoLeaf(tree->root, polygon);
+		FilterPolygonIntoLeaf(tree->root, &polygon);
 	}
 }
 
@@ -64,7 +67,7 @@ void MarkEmptyLeafs(bsptree_t *tree)
 // don't fill across areahints
 // dont' recurse from empty into solid
 
-static area_t *AllocArea(bsptree_t *tree)
+area_t *AllocArea(bsptree_t *tree)
 {
 	area_t *a = (area_t*)MallocZeroed(sizeof(area_t));
 
@@ -106,10 +109,10 @@ static void FindAreas(bsptree_t *tree)
 {
 	bspnode_t *leaf;
 
-	// process all that aren't empty
+	// process all that aren't empty, the void isn't in an area
 	for (leaf = tree->leafs; leaf; leaf = leaf->leafnext)
 	{
-		if (leaf->area)
+		if (leaf->area || leaf->outside)
 			continue;
 		if (leaf->empty)
 			continue;
@@ -126,7 +129,7 @@ static void FindAreas(bsptree_t *tree)
 	// process all empty leafs
 	for (leaf = tree->leafs; leaf; leaf = leaf->leafnext)
 	{
-		if (leaf->area)
+		if (leaf->area || leaf->outside)
 			continue;
 
 		//Message("processing leaf %#p\n", leaf);
@@ -139,7 +142,7 @@ static void FindAreas(bsptree_t *tree)
 	}
 }
 
-static void AddPortalsToAreas(bsptree_t *tree)
+void AddPortalsToAreas(bsptree_t *tree)
 {
 	for (portal_t *portal = tree->portals; portal; portal = portal->treenext)
 	{
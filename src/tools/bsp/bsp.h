@@ -5,11 +5,13 @@
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <setjmp.h>
 
 #include "vec3.h"
 #include "box3.h"
 #include "plane.h"
 #include "polygon.h"
+#include "libbsp.h"
 
 extern const float CLIP_EPSILON;
 extern const float AREA_EPSILON;
@@ -43,6 +45,7 @@ int Length(trilist_t *l);
 
 trilist_t *FixTJunctions(trilist_t *trilist);
 trilist_t *CalculateNormals(trilist_t *trilist);
+trilist_t *CalculateFlatNormals(trilist_t *trilist);
 
 // ________________________________________________________________________________ 
 // trimesh
@@ -72,6 +75,10 @@ typedef struct mapface_s
 	plane_t			plane;
 	box3			box;
 	bool			areahint;
+
+	// detail faces are only drawn, they don't split the tree or make leafs
+	// empty, so they don't add nodes or portals
+	bool			detail;
 	
 } mapface_t;
 
@@ -80,9 +87,25 @@ typedef struct mapdata_s
 	struct mapface_s	*faces;
 	int			numfaces;
 	int			numareahints;
+	int			numdetailfaces;
 	
 } mapdata_t;
 
+// the faces of a map outside its model blocks, or the faces of one model block.
+// The tree of a packed model is built in a context of its own, which holds the
+// tree's memory until the output is written
+typedef struct mapmodel_s
+{
+	struct mapmodel_s	*next;
+	char			name[64];
+	mapdata_t		data;
+
+	bspcontext_t		*context;
+	struct bsptree_s	*tree;
+	bsperror_t		result;
+
+} mapmodel_t;
+
 typedef struct leafface_s
 {
 	struct leafface_s	*areanext;
@@ -159,6 +182,7 @@ typedef struct bspnode_s
 
 	// flags
 	bool			empty;
+	bool			outside;
 
 	// output number
 	int			nodenumber;
@@ -184,10 +208,17 @@ typedef struct bsptree_s
 	int		numemptyareas;
 	int		numareas;
 
-} bsptree_t;
+	// the void around the map, or the path into the map if it leaks
+	int		numoutsideleafs;
+	bool		leaked;
+	vec3		*leakpoints;
+	int		numleakpoints;
 
-extern const char	*outputfilename;
-extern mapdata_t	*mapdata;
+	// nodes folded into leafs and portals dropped or joined by the pruning
+	int		numprunednodes;
+	int		numprunedportals;
+
+} bsptree_t;
 
 // ________________________________________________________________________________ 
 // new static model stuff
@@ -203,14 +234,131 @@ typedef struct smodel_s
 
 } smodel_t;
 
+// ________________________________________________________________________________ 
+// incremental build cache
+
+typedef unsigned long long cachekey_t;
+
+#define CACHE_KEY_SEED	0xcbf29ce484222325ull
+
+// the split of a tree node, with its children by their keys. Leaf children
+// have key 0
+typedef struct cachenode_s
+{
+	float		plane[4];
+	int		areahint;
+	cachekey_t	children[2];
+
+} cachenode_t;
+
+// the stages of a model compile saved to the stage cache, in the order they
+// run. A compile resumes after the last stage it finds
+enum
+{
+	STAGE_NONE,
+	STAGE_TREE,
+	STAGE_EMPTY,
+	STAGE_PORTALS,
+	STAGE_OUTSIDE,
+	STAGE_AREAS,
+	NUM_STAGES
+};
+
+// the stages that fall back to what a preview does when the compile runs over
+// its time budget
+enum
+{
+	BUDGET_TREE,		// splits chosen from a sample of the faces
+	BUDGET_OPTIONAL,	// no tree optimisation or pruning
+	BUDGET_SURFACES,	// no t-junction fixing or smoothed normals
+	NUM_BUDGET_STAGES
+};
+
+// ________________________________________________________________________________ 
+// compile context
+// everything a compile changes lives in its context. The context of the compile
+// running on the current thread is in ctx
+
+typedef struct meshbuilder_s
+{
+	int		numvertices;
+	int		maxvertices;
+	meshvertex_t	*vertices;
+
+	int		numindicies;
+	int		maxindicies;
+	int		*indicies;
 
-extern smodel_t		*smodels;
+} meshbuilder_t;
+
+struct bspcontext_s
+{
+	bspoptions_t		options;
+
+	// map
+	mapdata_t		mapdata;
+	mapmodel_t		*models;
+	int			nummodels;
+	bool			modelblocks;
+	smodel_t		*smodels;
+	int			linenum;
+	int			polygonlinenum;
+	char			token[1024];
+	char			polygonstring[2048];
+
+	// tree
+	bspnode_t		*bspnodes;
+
+	// incremental build cache, shared with the compiles of packed models.
+	// Entries the compile makes are kept on its own list
+	struct cache_s		*cache;
+	struct cacheentry_s	*newcacheentries;
+
+	// the cache of the last compile, kept between compiles
+	struct cache_s		*keptcache;
+	char			keptcachefilename[1024];
+
+	// stage cache keys of the model being compiled
+	cachekey_t		stagekeys[NUM_STAGES];
+
+	// output
+	const char		*outputfilename;
+	char			leakfilename[1040];
+	meshbuilder_t		mesh;
+	FILE			*mapfp;
+	FILE			*outputfp;
+
+	// debug streams
+	struct debugfile_s	*debugfile;
+	struct debugfile_s	*portalsrcfile;
+	int			debugleafnum;
+
+	// when the compile started, and the stages that have gone over their
+	// share of the time budget as bits
+	double			compilestart;
+	int			cheapstages;
+
+	// compile memory, released when the compile ends
+	struct memblock_s	*memblocks;
+	long			memorysize;
+
+	bspstats_t		stats;
+
+	// the compile being run returns here on an error
+	jmp_buf			errorjmp;
+	bool			compiling;
+	bsperror_t		stage;
+	char			errorstring[2048];
+};
+
+extern __thread bspcontext_t	*ctx;
 
 // ________________________________________________________________________________ 
 
 
 // toolib imports
 void Error(const char *error, ...);
+void SetErrorHook(void (*hook)(const char *message));
 void Warning(const char *warning, ...);
 void Message(const char *format, ...);
 
@@ -227,38 +375,101 @@ void WriteBytes(void *data, int numbytes, FILE *fp);
 int ReadBytes(void *buf, int numbytes, FILE *fp);
 
 // debug.cpp
-extern FILE *debugfp;
-void DebugPrintfPolygon(FILE *fp, polygon_t *p);
-void DebugWriteColor(FILE *fp, float *rgb);
-void DebugWritePolygon(FILE *fp, polygon_t *p);
-void DebugWriteWireFillPolygon(FILE *fp, polygon_t *p);
+typedef struct debugfile_s debugfile_t;
+debugfile_t *DebugOpenFile(const char *filename);
+debugfile_t *DebugConnect(const char *address);
+void DebugCloseFile(debugfile_t *f);
+void DebugWriteFlush(debugfile_t *f);
+void DebugWriteColor(debugfile_t *f, float *rgb);
+void DebugWritePolygon(debugfile_t *f, polygon_t *p);
+void DebugWriteWireFillPolygon(debugfile_t *f, polygon_t *p);
 void DebugInit();
+void DebugCloseFiles();
 void DebugShutdown();
 void DebugWritePortalFile(bsptree_t *tree);
 void DebugWritePortalPolygon(bsptree_t *tree, polygon_t *p);
 void DebugEndLeafPolygons();
 void DebugDumpAreaSurfaces(bsptree_t *tree);
 
-// main
+// libbsp
 void *Malloc(int numbytes);
 void *MallocZeroed(int numbytes);
+void Free(void *mem);
 void PrintPolygon(polygon_t *p);
 void PrintNode(bspnode_t *n);
 
+// cache
+cachekey_t HashBytes(cachekey_t key, const void *data, int numbytes);
+cachekey_t HashPolygon(cachekey_t key, polygon_t *p);
+const cachenode_t *CacheFindNode(cachekey_t key);
+void CacheAddNode(cachekey_t key, const cachenode_t *node);
+trilist_t *CacheFindArea(cachekey_t key);
+void CacheAddArea(cachekey_t key, trilist_t *trilist);
+void CacheLoad();
+void CacheWrite();
+void CacheKeep();
+void CacheFreeKept(bspcontext_t *c);
+
+// true if a stage should be built the preview way
+bool CheapStage(int stage);
+
+// stage cache
+int LoadStages(bsptree_t **tree);
+void SaveStage(bsptree_t *tree, int stage);
+
 // map file
-void ReadMap(char *filename);
+void ReadMap(const char *filename);
+
+// polygon walks
+// a polygon pushed down the tree with its bounds, so the nodes it's clear of
+// are decided without looking at its vertices
+typedef struct walkpolygon_s
+{
+	polygon_t	*polygon;
+	box3		box;
+
+} walkpolygon_t;
+
+walkpolygon_t WalkPolygon(polygon_t *p);
+int WalkPolygonSide(walkpolygon_t *w, plane_t plane, polygonsides_t *sides);
+void WalkSplitPolygon(walkpolygon_t *w, plane_t plane, const polygonsides_t *sides, walkpolygon_t *front, walkpolygon_t *back);
+
+// the box of the piece of a polygon on one side of a plane
+box3 SplitBox(box3 box, plane_t plane, int side);
 
 // bsp tree
 bsptree_t *BuildTree();
+bsptree_t *MakeTree(box3 box);
+void SplitNode(bsptree_t *tree, bspnode_t *node, plane_t plane, bool areahint);
+void LinkLeaf(bsptree_t *tree, bspnode_t *node);
+void KeepCachedNodes();
+
+// expected nodes a point query visits, from the node boxes
+float TreeCost(bsptree_t *tree);
 
 // portals
 void BuildPortals(bsptree_t* tree);
+void AddPortalToLeaf(bsptree_t *tree, bspnode_t *srcleaf, polygon_t *polygon, bspnode_t *dstleaf, bool areahint);
+
+// outside fill
+void FillOutside(bsptree_t *tree);
+void DiscardOutsidePortals(bsptree_t *tree);
+void WriteLeakFile(bsptree_t *tree);
+
+// tree pruning
+void PruneTree(bsptree_t *tree);
 
 // areas
 void MarkEmptyLeafs(bsptree_t *tree);
 void BuildAreas(bsptree_t *tree);
+area_t *AllocArea(bsptree_t *tree);
+void AddPortalsToAreas(bsptree_t *tree);
+
+// surfaces
+void BuildAreaModels(bsptree_t *tree);
 
 // output functions
 void WriteBinary(bsptree_t *tree);
+void WritePackedBinary();
 
 
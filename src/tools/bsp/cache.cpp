@@ -0,0 +1,437 @@
+#include "bsp.h"
+
+// ==============================================
+// Incremental build cache
+// the split of each tree node and the finished surface of each area are cached
+// next to the output, keyed by a hash of everything that goes into them. A tree
+// node is keyed by the faces that reach it, in order, and records its children
+// by their keys, so a subtree whose faces didn't change can be rebuilt from the
+// cache without choosing any splits. An area surface is keyed by the triangles
+// of its leaf faces, and skips the t-junction fixing and normals
+//
+// entries are written back if they were used or made by the build, so the
+// cache doesn't keep growing as the map is edited. A cache made with other
+// split parameters, or that can't be read, is ignored
+//
+// bspcache	int version, float clipepsilon, float splitweights[NUM_SPLIT_WEIGHTS], int numentries, { u64 key, int kind, int numbytes, bytes }
+
+#define CACHE_VERSION		2
+#define CACHE_HASH_SIZE		4096
+
+enum
+{
+	CACHE_NODE,
+	CACHE_AREA
+};
+
+typedef struct cacheentry_s
+{
+	struct cacheentry_s	*hashnext;
+	struct cacheentry_s	*next;
+
+	cachekey_t		key;
+	int			kind;
+	int			numbytes;
+	void			*data;
+
+	// set by the compiles that reuse the entry, so it's kept
+	bool			used;
+
+} cacheentry_t;
+
+typedef struct cache_s
+{
+	cacheentry_t		*hash[CACHE_HASH_SIZE];
+	cacheentry_t		*entries;
+
+} cache_t;
+
+// fnv-1a
+cachekey_t HashBytes(cachekey_t key, const void *data, int numbytes)
+{
+	const unsigned char *b = (const unsigned char*)data;
+
+	for (int i = 0; i < numbytes; i++)
+	{
+		key ^= b[i];
+		key *= 0x100000001b3ull;
+	}
+
+	return key;
+}
+
+cachekey_t HashPolygon(cachekey_t key, polygon_t *p)
+{
+	key = HashBytes(key, &p->numvertices, sizeof(p->numvertices));
+	for (int i = 0; i < p->numvertices; i++)
+		key = HashBytes(key, &p->vertices[i][0], 3 * sizeof(float));
+
+	return key;
+}
+
+static cacheentry_t *FindEntry(cachekey_t key, int kind)
+{
+	cache_t *c = ctx->cache;
+	if (!c)
+		return NULL;
+
+	for (cacheentry_t *e = c->hash[key & (CACHE_HASH_SIZE - 1)]; e; e = e->hashnext)
+	{
+		if (e->key == key && e->kind == kind)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void UseEntry(cacheentry_t *e)
+{
+	// compiles of packed models share the cache
+	__atomic_store_n(&e->used, true, __ATOMIC_RELAXED);
+}
+
+// entries made by a compile go on its own list, the loaded cache is only read
+static void AddEntry(cachekey_t key, int kind, const void *data, int numbytes)
+{
+	cacheentry_t *e = (cacheentry_t*)MallocZeroed(sizeof(cacheentry_t));
+	e->key = key;
+	e->kind = kind;
+	e->numbytes = numbytes;
+	e->data = Malloc(numbytes);
+	memcpy(e->data, data, numbytes);
+
+	e->next = ctx->newcacheentries;
+	ctx->newcacheentries = e;
+}
+
+// ==============================================
+// Tree nodes
+
+const cachenode_t *CacheFindNode(cachekey_t key)
+{
+	cacheentry_t *e = FindEntry(key, CACHE_NODE);
+	if (!e || e->numbytes != sizeof(cachenode_t))
+		return NULL;
+
+	UseEntry(e);
+
+	return (const cachenode_t*)e->data;
+}
+
+void CacheAddNode(cachekey_t key, const cachenode_t *node)
+{
+	AddEntry(key, CACHE_NODE, node, sizeof(*node));
+}
+
+// ==============================================
+// Area surfaces
+// stored as the vertices and normals of each triangle
+
+#define AREATRI_FLOATS	18
+
+trilist_t *CacheFindArea(cachekey_t key)
+{
+	cacheentry_t *e = FindEntry(key, CACHE_AREA);
+	if (!e || e->numbytes % (AREATRI_FLOATS * sizeof(float)))
+		return NULL;
+
+	UseEntry(e);
+
+	trilist_t *trilist = CreateTriList();
+
+	const float *f = (const float*)e->data;
+	int numtris = e->numbytes / (AREATRI_FLOATS * sizeof(float));
+	for (int i = 0; i < numtris; i++, f += AREATRI_FLOATS)
+	{
+		areatri_t *t = AllocAreaTri();
+		for (int j = 0; j < 3; j++)
+		{
+			t->vertices[j] = vec3(f[j * 3 + 0], f[j * 3 + 1], f[j * 3 + 2]);
+			t->normals[j] = vec3(f[9 + j * 3 + 0], f[9 + j * 3 + 1], f[9 + j * 3 + 2]);
+		}
+
+		Append(trilist, t);
+	}
+
+	return trilist;
+}
+
+void CacheAddArea(cachekey_t key, trilist_t *trilist)
+{
+	int numtris = Length(trilist);
+	float *data = (float*)Malloc(numtris * AREATRI_FLOATS * sizeof(float) + 1);
+
+	float *f = data;
+	for (areatri_t *t = trilist->head; t; t = t->next, f += AREATRI_FLOATS)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				f[j * 3 + k] = t->vertices[j][k];
+				f[9 + j * 3 + k] = t->normals[j][k];
+			}
+		}
+	}
+
+	AddEntry(key, CACHE_AREA, data, numtris * AREATRI_FLOATS * sizeof(float));
+	Free(data);
+}
+
+// ==============================================
+// Cache file
+
+static void CacheFilename(char *filename, int size)
+{
+	snprintf(filename, size, "%s.cache", ctx->outputfilename);
+}
+
+static bool ReadCacheEntries(cache_t *c, FILE *fp)
+{
+	char header[8];
+	int version;
+	float clipepsilon;
+	float splitweights[NUM_SPLIT_WEIGHTS];
+	int numentries;
+
+	if (fread(header, 8, 1, fp) != 1 || strncmp(header, "bspcache", 8))
+		return false;
+	if (fread(&version, sizeof(int), 1, fp) != 1 || version != CACHE_VERSION)
+		return false;
+	if (fread(&clipepsilon, sizeof(float), 1, fp) != 1 || clipepsilon != CLIP_EPSILON)
+		return false;
+	if (fread(splitweights, sizeof(splitweights), 1, fp) != 1 || memcmp(splitweights, ctx->options.splitweights, sizeof(splitweights)))
+		return false;
+	if (fread(&numentries, sizeof(int), 1, fp) != 1 || numentries < 0)
+		return false;
+
+	for (int i = 0; i < numentries; i++)
+	{
+		cachekey_t key;
+		int kind, numbytes;
+		if (fread(&key, sizeof(key), 1, fp) != 1)
+			return false;
+		if (fread(&kind, sizeof(int), 1, fp) != 1 || fread(&numbytes, sizeof(int), 1, fp) != 1)
+			return false;
+		if (numbytes < 0 || numbytes > (1 << 28))
+			return false;
+
+		cacheentry_t *e = (cacheentry_t*)MallocZeroed(sizeof(cacheentry_t));
+		e->key = key;
+		e->kind = kind;
+		e->numbytes = numbytes;
+		e->data = Malloc(numbytes + 1);
+		if (fread(e->data, 1, numbytes, fp) != (size_t)numbytes)
+			return false;
+
+		// the first copy of a key wins
+		cacheentry_t **bucket = &c->hash[key & (CACHE_HASH_SIZE - 1)];
+		bool duplicate = false;
+		for (cacheentry_t *d = *bucket; d; d = d->hashnext)
+			duplicate = duplicate || (d->key == key && d->kind == kind);
+		if (duplicate)
+			continue;
+
+		e->hashnext = *bucket;
+		*bucket = e;
+		e->next = c->entries;
+		c->entries = e;
+	}
+
+	return true;
+}
+
+void CacheLoad()
+{
+	char filename[1024];
+	CacheFilename(filename, sizeof(filename));
+
+	// the same output as the context's last compile
+	if (ctx->keptcache && !strcmp(ctx->keptcachefilename, filename))
+	{
+		for (cacheentry_t *e = ctx->keptcache->entries; e; e = e->next)
+			e->used = false;
+
+		ctx->cache = ctx->keptcache;
+		return;
+	}
+
+	cache_t *c = (cache_t*)MallocZeroed(sizeof(cache_t));
+	ctx->cache = c;
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+	{
+		Message("No cache \"%s\", building everything\n", filename);
+		return;
+	}
+
+	if (!ReadCacheEntries(c, fp))
+	{
+		Warning("Ignoring cache \"%s\", it's from another version or can't be read\n", filename);
+		memset(c, 0, sizeof(*c));
+	}
+
+	fclose(fp);
+}
+
+static int WriteCacheEntries(cacheentry_t *list, bool onlyused, FILE *fp)
+{
+	int numentries = 0;
+
+	for (cacheentry_t *e = list; e; e = e->next)
+	{
+		if (onlyused && !e->used)
+			continue;
+
+		fwrite(&e->key, sizeof(e->key), 1, fp);
+		fwrite(&e->kind, sizeof(int), 1, fp);
+		fwrite(&e->numbytes, sizeof(int), 1, fp);
+		fwrite(e->data, 1, e->numbytes, fp);
+		numentries++;
+	}
+
+	return numentries;
+}
+
+// the cache is written to a temporary file and moved over the old one, so a
+// failed write leaves the last cache
+void CacheWrite()
+{
+	if (!ctx->cache)
+		return;
+
+	char filename[1024], tempfilename[1040];
+	CacheFilename(filename, sizeof(filename));
+	snprintf(tempfilename, sizeof(tempfilename), "%s.tmp", filename);
+
+	FILE *fp = fopen(tempfilename, "wb");
+	if (!fp)
+	{
+		Warning("Failed to write cache \"%s\"\n", tempfilename);
+		return;
+	}
+
+	int version = CACHE_VERSION;
+	float clipepsilon = CLIP_EPSILON;
+	int numentries = 0;
+	fwrite("bspcache", 8, 1, fp);
+	fwrite(&version, sizeof(int), 1, fp);
+	fwrite(&clipepsilon, sizeof(float), 1, fp);
+	fwrite(ctx->options.splitweights, sizeof(ctx->options.splitweights), 1, fp);
+	long countpos = ftell(fp);
+	fwrite(&numentries, sizeof(int), 1, fp);
+
+	numentries += WriteCacheEntries(ctx->cache->entries, true, fp);
+	numentries += WriteCacheEntries(ctx->newcacheentries, false, fp);
+	for (mapmodel_t *m = ctx->models; m; m = m->next)
+	{
+		if (m->context)
+			numentries += WriteCacheEntries(m->context->newcacheentries, false, fp);
+	}
+
+	fseek(fp, countpos, SEEK_SET);
+	fwrite(&numentries, sizeof(int), 1, fp);
+
+	bool ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tempfilename, filename))
+	{
+		Warning("Failed to write cache \"%s\"\n", filename);
+		remove(tempfilename);
+		return;
+	}
+
+	Message("Wrote %i cache entries to \"%s\"\n", numentries, filename);
+}
+
+// ==============================================
+// Kept cache
+// a context keeps the entries written by its last compile outside of the
+// compile memory, so compiling the same output again, as the watch mode does,
+// finds them without reading the cache file back
+
+void CacheFreeKept(bspcontext_t *c)
+{
+	if (!c->keptcache)
+		return;
+
+	cacheentry_t *next;
+	for (cacheentry_t *e = c->keptcache->entries; e; e = next)
+	{
+		next = e->next;
+		free(e->data);
+		free(e);
+	}
+
+	free(c->keptcache);
+	c->keptcache = NULL;
+}
+
+static bool KeepEntries(cache_t *c, cacheentry_t *list, bool onlyused)
+{
+	for (cacheentry_t *e = list; e; e = e->next)
+	{
+		if (onlyused && !e->used)
+			continue;
+
+		cacheentry_t **bucket = &c->hash[e->key & (CACHE_HASH_SIZE - 1)];
+		bool duplicate = false;
+		for (cacheentry_t *d = *bucket; d; d = d->hashnext)
+			duplicate = duplicate || (d->key == e->key && d->kind == e->kind);
+		if (duplicate)
+			continue;
+
+		cacheentry_t *k = (cacheentry_t*)calloc(1, sizeof(cacheentry_t));
+		void *data = malloc(e->numbytes + 1);
+		if (!k || !data)
+		{
+			free(k);
+			free(data);
+			return false;
+		}
+
+		memcpy(data, e->data, e->numbytes);
+		k->key = e->key;
+		k->kind = e->kind;
+		k->numbytes = e->numbytes;
+		k->data = data;
+
+		k->hashnext = *bucket;
+		*bucket = k;
+		k->next = c->entries;
+		c->entries = k;
+	}
+
+	return true;
+}
+
+// keeps the same entries CacheWrite writes. Running out of memory just means
+// the next compile reads the file
+void CacheKeep()
+{
+	if (!ctx->cache)
+		return;
+
+	cache_t *c = (cache_t*)calloc(1, sizeof(cache_t));
+	if (!c)
+		return;
+
+	bool ok = KeepEntries(c, ctx->cache->entries, true);
+	ok = ok && KeepEntries(c, ctx->newcacheentries, false);
+	for (mapmodel_t *m = ctx->models; m && ok; m = m->next)
+	{
+		if (m->context)
+			ok = KeepEntries(c, m->context->newcacheentries, false);
+	}
+
+	// the old entries may be the ones just copied
+	ctx->cache = NULL;
+	CacheFreeKept(ctx);
+	ctx->keptcache = c;
+	CacheFilename(ctx->keptcachefilename, sizeof(ctx->keptcachefilename));
+
+	if (!ok)
+		CacheFreeKept(ctx);
+}
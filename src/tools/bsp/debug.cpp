@@ -1,48 +1,425 @@
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "bsp.h"
+#include "gldfile.h"
 
-// global debug file pointer
-FILE *debugfp = NULL;
+// debug output is disabled unless requested in the compile options. When
+// options.debughost is set the map debug stream is sent to a glvis listening on
+// host[:port]. The map stream and the leaf portal source polygons are kept in
+// the compile context
 
-void DebugWritePolygon(FILE *fp, polygon_t *p)
+// ________________________________________________________________________________ 
+// Background writer
+// debug data is encoded into blocks on the calling thread and handed off to a
+// writer thread so the compiler never waits on the disk. The writer is started
+// by the first compile that wants debug output and is shared by all of them
+
+#define DEBUG_BLOCK_SIZE	(64 * 1024)
+#define DEBUG_MAX_BLOCKS	64
+
+typedef struct debugblock_s
+{
+	struct debugblock_s	*next;
+	struct debugfile_s	*file;
+	bool			close;
+
+	int			numbytes;
+	unsigned char		data[DEBUG_BLOCK_SIZE];
+
+} debugblock_t;
+
+typedef struct debugfile_s
 {
-	fprintf(fp, "polygon\n");
-	fprintf(fp, "%i\n", p->numvertices);
-	for(int i = 0; i < p->numvertices; i++)
-		fprintf(fp, "%f %f %f\n",
-			p->vertices[i][0],
-			p->vertices[i][1],
-			p->vertices[i][2]);
+	FILE			*fp;
+	debugblock_t		*block;
+
+	// live streams are sent on the socket as soon as each block is written,
+	// -1 for files. The file is still what closes it
+	int			socket;
+	bool			disconnected;	// writer only
+
+} debugfile_t;
+
+static pthread_t	writerthread;
+static pthread_mutex_t	writerlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writerwake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	writerdrained = PTHREAD_COND_INITIALIZER;
+
+static debugblock_t	*queuehead;
+static debugblock_t	*queuetail;
+static int		numqueued;
+static bool		writerquit;
+static bool		writerrunning;
+
+// sends without raising SIGPIPE, so a viewer that goes away only ends the
+// stream instead of the compiler
+static void DebugSendBlock(debugblock_t *b)
+{
+	debugfile_t *f = b->file;
+	const unsigned char *data = b->data;
+	int numbytes = b->numbytes;
+
+	while (numbytes && !f->disconnected)
+	{
+		ssize_t count = send(f->socket, data, numbytes, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR)
+			continue;
+
+		if (count <= 0)
+		{
+			Warning("Debug host closed the connection, no longer streaming\n");
+			f->disconnected = true;
+			break;
+		}
+
+		data += count;
+		numbytes -= count;
+	}
 }
 
-void DebugWriteWireFillPolygon(FILE *fp, polygon_t *p)
+static void *DebugWriterThread(void *args)
 {
-	fprintf(fp, "polyline\n");
-	fprintf(fp, "%i\n", p->numvertices + 1);
-	for(int i = 0; i < p->numvertices; i++)
-		fprintf(fp, "%f %f %f\n",
-			p->vertices[i][0],
-			p->vertices[i][1],
-			p->vertices[i][2]);
-	
-	fprintf(fp, "%f %f %f\n",
-		p->vertices[0][0],
-		p->vertices[0][1],
-		p->vertices[0][2]);
+	pthread_mutex_lock(&writerlock);
+
+	while (1)
+	{
+		while (!queuehead && !writerquit)
+			pthread_cond_wait(&writerwake, &writerlock);
+
+		if (!queuehead)
+			break;
+
+		// unlink the next block
+		debugblock_t *b = queuehead;
+		queuehead = b->next;
+		if (!queuehead)
+			queuetail = NULL;
+		numqueued--;
+
+		pthread_cond_signal(&writerdrained);
+		pthread_mutex_unlock(&writerlock);
+
+		// write the block outside the lock
+		if (b->file->socket != -1)
+			DebugSendBlock(b);
+		else
+			WriteBytes(b->data, b->numbytes, b->file->fp);
+
+		if (b->close)
+		{
+			FileClose(b->file->fp);
+			free(b->file);
+		}
+
+		free(b);
+
+		pthread_mutex_lock(&writerlock);
+	}
+
+	pthread_mutex_unlock(&writerlock);
+
+	return NULL;
+}
+
+// blocks and files are freed by the writer, possibly after the compile that
+// wrote them has ended, so they don't come from the compile's memory
+static void *DebugAlloc(int numbytes)
+{
+	void *mem = malloc(numbytes);
+	if (!mem)
+		Error("Failed to allocate debug block\n");
+
+	return mem;
+}
+
+static debugblock_t *DebugAllocBlock(debugfile_t *f)
+{
+	debugblock_t *b = (debugblock_t*)DebugAlloc(sizeof(debugblock_t));
+
+	b->next = NULL;
+	b->file = f;
+	b->close = false;
+	b->numbytes = 0;
+
+	return b;
+}
+
+static void DebugSubmitBlock(debugblock_t *b)
+{
+	pthread_mutex_lock(&writerlock);
+
+	// don't let the queue grow without bound if the disk can't keep up
+	while (numqueued >= DEBUG_MAX_BLOCKS)
+		pthread_cond_wait(&writerdrained, &writerlock);
+
+	if (queuetail)
+		queuetail->next = b;
+	else
+		queuehead = b;
+	queuetail = b;
+	numqueued++;
+
+	pthread_cond_signal(&writerwake);
+	pthread_mutex_unlock(&writerlock);
+}
+
+static void DebugWriteBytes(debugfile_t *f, const void *data, int numbytes)
+{
+	const unsigned char *src = (const unsigned char*)data;
+
+	while (numbytes)
+	{
+		debugblock_t *b = f->block;
+
+		int count = DEBUG_BLOCK_SIZE - b->numbytes;
+		if (count > numbytes)
+			count = numbytes;
+
+		memcpy(b->data + b->numbytes, src, count);
+		b->numbytes += count;
+		src += count;
+		numbytes -= count;
+
+		// hand full blocks off to the writer
+		if (b->numbytes == DEBUG_BLOCK_SIZE)
+		{
+			DebugSubmitBlock(b);
+			f->block = DebugAllocBlock(f);
+		}
+	}
+}
+
+static debugfile_t *DebugOpenStream(FILE *fp, int fd)
+{
+	debugfile_t *f = (debugfile_t*)DebugAlloc(sizeof(debugfile_t));
+	f->fp = fp;
+	f->socket = fd;
+	f->disconnected = false;
+	f->block = DebugAllocBlock(f);
+
+	gldheader_t header;
+	memcpy(header.magic, GLD_MAGIC, 4);
+	header.version = GLD_VERSION;
+	DebugWriteBytes(f, &header, sizeof(header));
+
+	return f;
+}
+
+debugfile_t *DebugOpenFile(const char *filename)
+{
+	if (!ctx->options.debugout)
+		return NULL;
+
+	return DebugOpenStream(FileOpenBinaryWrite(filename), -1);
+}
+
+// connect to a glvis running with --net. The address is host[:port]
+debugfile_t *DebugConnect(const char *address)
+{
+	if (!ctx->options.debugout)
+		return NULL;
+
+	char host[256];
+	const char *port = "1234";
+
+	strncpy(host, address, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+
+	char *colon = strchr(host, ':');
+	if (colon)
+	{
+		*colon = '\0';
+		port = address + (colon - host) + 1;
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res))
+		Error("Failed to resolve debug host \"%s\"\n", address);
+
+	int fd = -1;
+	for (struct addrinfo *a = res; a && fd == -1; a = a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		if (connect(fd, a->ai_addr, a->ai_addrlen))
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+
+	if (fd == -1)
+		Error("Failed to connect to debug host \"%s\"\n", address);
+
+	FILE *fp = fdopen(fd, "wb");
+	if (!fp)
+		Error("Failed to create debug stream for \"%s\"\n", address);
+
+	return DebugOpenStream(fp, fd);
 }
 
-void DebugWriteColor(FILE *fp, float *rgb)
+// the file is closed by the writer once all of its pending data is written
+void DebugCloseFile(debugfile_t *f)
 {
-	fprintf(fp, "color %f %f %f 1\n", rgb[0], rgb[1], rgb[2]);
+	if (!f)
+		return;
+
+	f->block->close = true;
+	DebugSubmitBlock(f->block);
+}
+
+// ________________________________________________________________________________ 
+// Command encoding
+
+static void DebugWritePacket(debugfile_t *f, int cmd, int numbytes)
+{
+	gldpacket_t packet;
+
+	packet.cmd = cmd;
+	packet.numbytes = numbytes;
+	DebugWriteBytes(f, &packet, sizeof(packet));
+}
+
+static void DebugWriteVertex(debugfile_t *f, vec3 v)
+{
+	float xyz[3] = { v[0], v[1], v[2] };
+
+	DebugWriteBytes(f, xyz, sizeof(xyz));
+}
+
+// writes the polygon edges as a closed line loop
+static void DebugWriteLineLoop(debugfile_t *f, vec3 *vertices, int numvertices)
+{
+	int count = numvertices * 2;
+
+	DebugWritePacket(f, GLD_CMD_LINES, sizeof(int) + (count * 3 * sizeof(float)));
+	DebugWriteBytes(f, &count, sizeof(int));
+
+	for (int i = 0; i < numvertices; i++)
+	{
+		DebugWriteVertex(f, vertices[i]);
+		DebugWriteVertex(f, vertices[(i + 1) % numvertices]);
+	}
+}
+
+void DebugWriteFlush(debugfile_t *f)
+{
+	if (!f)
+		return;
+
+	DebugWritePacket(f, GLD_CMD_FLUSH, 0);
+}
+
+void DebugWritePolygon(debugfile_t *f, polygon_t *p)
+{
+	if (!f)
+		return;
+
+	int count = (p->numvertices - 2) * 3;
+
+	DebugWritePacket(f, GLD_CMD_TRIANGLES, sizeof(int) + (count * 3 * sizeof(float)));
+	DebugWriteBytes(f, &count, sizeof(int));
+
+	for (int i = 0; i < p->numvertices - 2; i++)
+	{
+		DebugWriteVertex(f, p->vertices[0]);
+		DebugWriteVertex(f, p->vertices[i + 1]);
+		DebugWriteVertex(f, p->vertices[i + 2]);
+	}
+}
+
+void DebugWriteWireFillPolygon(debugfile_t *f, polygon_t *p)
+{
+	if (!f)
+		return;
+
+	DebugWriteLineLoop(f, p->vertices, p->numvertices);
+}
+
+void DebugWriteColor(debugfile_t *f, float *rgb)
+{
+	if (!f)
+		return;
+
+	float rgba[4] = { rgb[0], rgb[1], rgb[2], 1.0f };
+
+	DebugWritePacket(f, GLD_CMD_COLOR, sizeof(rgba));
+	DebugWriteBytes(f, rgba, sizeof(rgba));
 }
 
+static void DebugStartWriter()
+{
+	pthread_mutex_lock(&writerlock);
+
+	bool failed = false;
+	if (!writerrunning)
+	{
+		writerquit = false;
+		writerrunning = !pthread_create(&writerthread, NULL, DebugWriterThread, NULL);
+		failed = !writerrunning;
+	}
+
+	pthread_mutex_unlock(&writerlock);
+
+	if (failed)
+		Error("Failed to create debug writer thread\n");
+}
+
+// opens the debug streams of the compile on this thread
 void DebugInit()
 {
-	debugfp = FileOpenTextWrite("debug.gld");
+	if (!ctx->options.debugout)
+		return;
+
+	DebugStartWriter();
+
+	// a glvis kept running shows only the latest compile
+	if (ctx->options.debughost)
+	{
+		ctx->debugfile = DebugConnect(ctx->options.debughost);
+		DebugWriteFlush(ctx->debugfile);
+	}
+	else
+		ctx->debugfile = DebugOpenFile("debug.gld");
+}
+
+void DebugCloseFiles()
+{
+	DebugCloseFile(ctx->debugfile);
+	ctx->debugfile = NULL;
+
+	DebugCloseFile(ctx->portalsrcfile);
+	ctx->portalsrcfile = NULL;
 }
 
+// let the writer drain the queue and exit, once no compile is using it
 void DebugShutdown()
 {
-	fclose(debugfp);
+	pthread_mutex_lock(&writerlock);
+
+	if (!writerrunning)
+	{
+		pthread_mutex_unlock(&writerlock);
+		return;
+	}
+
+	writerquit = true;
+	pthread_cond_signal(&writerwake);
+	pthread_mutex_unlock(&writerlock);
+
+	pthread_join(writerthread, NULL);
+	writerrunning = false;
 }
 
 static vec3 Center(box3 box)
@@ -90,9 +467,35 @@ static void ColorMap(float rgb[3], int i, int n)
 // that the leaf can see into the other leaf. There may be splits in the portals even though the
 // leaf was not split. This is because the destination leaf(s) volumes have been split across the face
 // of the src leaf portal.
+// writes the portal edges scaled towards the portal center and pushed away
+// from its normal, so the individual portals of a leaf are visible
+static void DebugWritePortalLoop(debugfile_t *f, polygon_t *p)
+{
+	box3 box = Polygon_BoundingBox(p);
+	vec3 center = box.Center();
+	vec3 normal = Polygon_Normal(p);
+
+	int count = p->numvertices * 2;
+
+	DebugWritePacket(f, GLD_CMD_LINES, sizeof(int) + (count * 3 * sizeof(float)));
+	DebugWriteBytes(f, &count, sizeof(int));
+
+	for (int i = 0; i < p->numvertices; i++)
+	{
+		vec3 v0 = p->vertices[i];
+		vec3 v1 = p->vertices[(i + 1) % p->numvertices];
+
+		DebugWriteVertex(f, center + (0.95f * (v0 - center)) + -normal * 4.0f);
+		DebugWriteVertex(f, center + (0.95f * (v1 - center)) + -normal * 4.0f);
+	}
+}
+
 void DebugWritePortalFile(bsptree_t *tree)
 {
-	FILE *fp = FileOpenTextWrite("portal_debug.gld");
+	if (!ctx->options.debugout)
+		return;
+
+	debugfile_t *f = DebugOpenFile("portal_debug.gld");
 	
 	// iterate through all leafs
 	int leafnum = 0;
@@ -104,13 +507,12 @@ void DebugWritePortalFile(bsptree_t *tree)
 		
 		// calculate a color for the portal polygon
 		{
-			//fprintf(fp, "color 1 0 0 1\n");
 			float rgb[3];
-			float f = (float)leafnum / tree->numleafs;
-			//f = 1.2f * f;
-			//f = f - floor(f);
-			HSVToRGB(rgb, f, 1.0f, 1.0f);
-			fprintf(fp, "color %f %f %f 1\n", rgb[0], rgb[1], rgb[2]);
+			float h = (float)leafnum / tree->numleafs;
+			//h = 1.2f * h;
+			//h = h - floor(h);
+			HSVToRGB(rgb, h, 1.0f, 1.0f);
+			DebugWriteColor(f, rgb);
 		}
 
 		for (portal_t *p = l->portals; p; p = p->leafnext)
@@ -119,94 +521,39 @@ void DebugWritePortalFile(bsptree_t *tree)
 			//if (p->srcleaf->empty ^ p->dstleaf->empty)
 			//	continue;
 
-			fprintf(fp, "polyline\n");
-			fprintf(fp, "%i\n", p->polygon->numvertices + 1);
-			
-			for(int i = 0; i < p->polygon->numvertices + 1; i++)
-			{
-				vec3 v = p->polygon->vertices[i % p->polygon->numvertices];
-
-#if 0
-				{
-					vec3 center = l->box.Center();
-					vec3 boxsize =  l->box.Size();
-
-					vec3 scale;
-					scale[0] = (boxsize[0] - 8.0f) / boxsize[0];
-					scale[1] = (boxsize[1] - 8.0f) / boxsize[1];
-					scale[2] = (boxsize[2] - 8.0f) / boxsize[2];
-
-					v[0] = center[0] + (scale[0] * ( v[0] - center[0]));
-					v[1] = center[1] + (scale[1] * ( v[1] - center[1]));
-					v[2] = center[2] + (scale[2] * ( v[2] - center[2]));
-				}
-#endif
-
-				// scale the vertices so the individual portals are visible
-#if 1
-				{
-					box3 box = Polygon_BoundingBox(p->polygon);
-					vec3 center = box.Center();
-					vec3 boxsize =  box.Size();
-
-					v = center + (0.95f * (v - center));
-
-					// push them away from the normal
-					vec3 normal = Polygon_Normal(p->polygon);
-					v = v + -normal * 4.0f;
-					//vec3 scale;
-					//scale[0] = (boxsize[0] - 8.0f) / boxsize[0];
-					//scale[1] = (boxsize[1] - 8.0f) / boxsize[1];
-					//scale[2] = (boxsize[2] - 8.0f) / boxsize[2];
-
-					//v[0] = center[0] + (scale[0] * ( v[0] - center[0]));
-					//v[1] = center[1] + (scale[1] * ( v[1] - center[1]));
-					//v[2] = center[2] + (scale[2] * ( v[2] - center[2]));
-				}
-#endif
-				
-				// write the vertex data
-				fprintf(fp, "%f %f %f\n",
-					v[0],
-					v[1],
-					v[2]);
-			}
+			DebugWritePortalLoop(f, p->polygon);
 		}
 	}
 	
-	fclose(fp);
+	DebugCloseFile(f);
 }
 
 // This is a visualisation of the portal source polygons for the leaf before they are pushed into
 // the tree. These polygons will eventually be clipped into other destination leafs, and may be
 // split during the process
-static int leafnum = 0;
 void DebugWritePortalPolygon(bsptree_t *tree, polygon_t *p)
 {
-	static FILE *fp = NULL;
-
 	// guard against a null polygon
-	if (!p)
+	if (!p || !ctx->options.debugout)
 		return;
 
-	if (!fp)
-		fp = FileOpenTextWrite("portal_src.gld");
+	if (!ctx->portalsrcfile)
+		ctx->portalsrcfile = DebugOpenFile("portal_src.gld");
 
-	//if (leafnum != 1)
+	//if (ctx->debugleafnum != 1)
 	//	return;
 
 	// write the color
 	float rgb[3];
-	HSVToRGB(rgb, (float)leafnum / tree->numleafs, 1.0f, 1.0f);
-	fprintf(fp, "color %f %f %f 1\n", rgb[0], rgb[1], rgb[2]);
+	HSVToRGB(rgb, (float)ctx->debugleafnum / tree->numleafs, 1.0f, 1.0f);
+	DebugWriteColor(ctx->portalsrcfile, rgb);
 
-	DebugWriteWireFillPolygon(fp, p);
-	fflush(fp);
+	DebugWriteWireFillPolygon(ctx->portalsrcfile, p);
 }
 
 void DebugEndLeafPolygons()
 {
-	leafnum++;
+	ctx->debugleafnum++;
 }
 
 #if 0
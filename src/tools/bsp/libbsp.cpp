@@ -0,0 +1,697 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "bsp.h"
+
+// at 128 = 1m, 0.02 = 0.15625mm
+extern const float CLIP_EPSILON		= 0.2f;
+extern const float AREA_EPSILON		= 0.1f;
+extern const float PLANAR_EPSILON	= 0.2f;		// same as clip epsilon
+extern const float MAX_VERTEX_SIZE	= 4096.0f;
+
+// context of the compile running on this thread
+__thread bspcontext_t	*ctx = NULL;
+
+void Message(const char *format, ...)
+{
+	if(!ctx || !ctx->options.verbose)
+	{
+		return;
+	}
+
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, format);
+	vsprintf(buffer, format, valist);
+	va_end(valist);
+
+	fprintf(stdout, "%s", buffer);
+}
+
+// ==============================================
+// Memory allocation
+// compile memory is linked into the context so everything a compile allocated
+// can be released when it ends, and a process running many compiles doesn't
+// grow. The header keeps the allocation 16 byte aligned
+
+typedef struct memblock_s
+{
+	struct memblock_s	*prev;
+	struct memblock_s	*next;
+	long			numbytes;
+	long			pad;
+
+} memblock_t;
+
+void *Malloc(int numbytes)
+{
+	if (!ctx)
+		Error("Malloc: No compile is running\n");
+
+	memblock_t *b = (memblock_t*)malloc(sizeof(memblock_t) + numbytes);
+
+	if(!b)
+	{
+		Error("Malloc: Failed to allocated memory");
+	}
+
+	b->numbytes = numbytes;
+	b->prev = NULL;
+	b->next = ctx->memblocks;
+	if (b->next)
+		b->next->prev = b;
+	ctx->memblocks = b;
+
+	ctx->memorysize += numbytes;
+	if (ctx->memorysize > ctx->stats.peakmemory)
+		ctx->stats.peakmemory = ctx->memorysize;
+
+	return b + 1;
+}
+
+void *MallocZeroed(int numbytes)
+{
+	void *mem;
+	
+	mem = Malloc(numbytes);
+
+	memset(mem, 0, numbytes);
+
+	return mem;
+}
+
+void Free(void *mem)
+{
+	if (!mem)
+		return;
+
+	memblock_t *b = (memblock_t*)mem - 1;
+
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		ctx->memblocks = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+
+	ctx->memorysize -= b->numbytes;
+	free(b);
+}
+
+static void FreeCompileMemory(bspcontext_t *c)
+{
+	memblock_t *next;
+	for (memblock_t *b = c->memblocks; b; b = next)
+	{
+		next = b->next;
+		free(b);
+	}
+
+	c->memblocks = NULL;
+	c->memorysize = 0;
+}
+
+// polygons come from the compile's memory too. Anything using the polygon code
+// outside a compile gets the heap as before
+static void *PolygonAlloc(int numbytes)
+{
+	if (ctx && ctx->compiling)
+		return Malloc(numbytes);
+
+	return malloc(numbytes);
+}
+
+static void PolygonFree(void *mem)
+{
+	if (ctx && ctx->compiling)
+		Free(mem);
+	else
+		free(mem);
+}
+
+// ==============================================
+// Debugging functions
+
+void PrintPolygon(polygon_t *p)
+{
+	printf("polygon %p, numvertices=%i, maxvertices=%i\n", p, p->numvertices, p->maxvertices);
+	for(int i = 0; i < p->numvertices; i++)
+		printf("vertex %i: (%f %f %f)\n",
+			i,
+			p->vertices[i][0],
+			p->vertices[i][1],
+			p->vertices[i][2]);
+}
+
+void PrintNode(bspnode_t *n)
+{
+	printf("plane=(%f, %f, %f, %f)", n->plane[0], n->plane[1], n->plane[2], n->plane[3]);
+	printf(" ");
+	printf("children=(%p, %p)", n->children[0], n->children[1]);
+	printf("\n");
+}
+
+// ==============================================
+// Errors
+// Error jumps back to the compile running on the thread, which closes the files
+// it had open and returns the stage that failed. Errors outside a compile exit
+// as they always have
+
+static pthread_once_t hooksonce = PTHREAD_ONCE_INIT;
+
+static void CompileErrorHook(const char *message)
+{
+	if (!ctx || !ctx->compiling)
+		return;
+
+	strncpy(ctx->errorstring, message, sizeof(ctx->errorstring) - 1);
+	ctx->errorstring[sizeof(ctx->errorstring) - 1] = '\0';
+
+	longjmp(ctx->errorjmp, 1);
+}
+
+static void InstallHooks()
+{
+	SetErrorHook(CompileErrorHook);
+	Polygon_SetMemCallbacks(PolygonAlloc, PolygonFree);
+}
+
+// ==============================================
+// Compiling
+
+static void ResetContext(bspcontext_t *c)
+{
+	memset(&c->mapdata, 0, sizeof(c->mapdata));
+	c->models = NULL;
+	c->nummodels = 0;
+	c->modelblocks = false;
+	c->smodels = NULL;
+	c->linenum = 0;
+	c->polygonlinenum = 0;
+	c->bspnodes = NULL;
+	c->cache = NULL;
+	c->newcacheentries = NULL;
+	c->mapfp = NULL;
+	c->outputfp = NULL;
+	c->debugfile = NULL;
+	c->portalsrcfile = NULL;
+	c->debugleafnum = 0;
+	c->errorstring[0] = '\0';
+	c->cheapstages = 0;
+	memset(&c->stats, 0, sizeof(c->stats));
+}
+
+static double Seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ==============================================
+// Time budget
+// a preview builds every stage the cheap way. Otherwise a stage is built the
+// cheap way once the compile has used the share of the budget the stages up to
+// it should take, and stays cheap for the rest of the compile. The models of a
+// packed file share the budget of the whole compile
+
+static const float	budgetshares[NUM_BUDGET_STAGES] = { 0.4f, 0.5f, 0.8f };
+static const char	*budgetnames[NUM_BUDGET_STAGES] = { "sampling split planes", "skipping tree optimisation and pruning", "skipping t-junction fixing and smoothed normals" };
+
+bool CheapStage(int stage)
+{
+	if (ctx->options.preview)
+		return true;
+	if (ctx->options.timebudget <= 0.0f)
+		return false;
+	if (ctx->cheapstages & (1 << stage))
+		return true;
+
+	double elapsed = Seconds() - ctx->compilestart;
+	if (elapsed < budgetshares[stage] * ctx->options.timebudget)
+		return false;
+
+	ctx->cheapstages |= (1 << stage);
+	ctx->stats.numcheapstages++;
+	Warning("%.1fs into a %.1fs time budget, %s\n", elapsed, ctx->options.timebudget, budgetnames[stage]);
+
+	return true;
+}
+
+// build the tree, portals, areas and area models from the map data. The
+// stages found in the stage cache are loaded instead of built
+static bsptree_t *CompileModel()
+{
+	bsptree_t *tree;
+	bspstats_t *stats = &ctx->stats;
+
+	double time = Seconds();
+	int resumed = LoadStages(&tree);
+	stats->numcachedstages = resumed;
+
+	if (resumed < STAGE_TREE)
+	{
+		tree = BuildTree();
+		SaveStage(tree, STAGE_TREE);
+	}
+	stats->numnodes = tree->numnodes;
+	stats->numleafs = tree->numleafs;
+	stats->treetime = Seconds() - time;
+	
+	time = Seconds();
+	if (resumed < STAGE_EMPTY)
+	{
+		MarkEmptyLeafs(tree);
+		SaveStage(tree, STAGE_EMPTY);
+	}
+
+	if (resumed < STAGE_PORTALS)
+	{
+		BuildPortals(tree);
+		SaveStage(tree, STAGE_PORTALS);
+	}
+
+	if (resumed < STAGE_OUTSIDE)
+	{
+		FillOutside(tree);
+		SaveStage(tree, STAGE_OUTSIDE);
+	}
+	stats->numportals = tree->numportals;
+	stats->numoutsideleafs = tree->numoutsideleafs;
+	stats->leaked = tree->leaked;
+	stats->portaltime = Seconds() - time;
+
+	time = Seconds();
+	if (resumed < STAGE_AREAS)
+	{
+		BuildAreas(tree);
+		SaveStage(tree, STAGE_AREAS);
+	}
+	stats->numareas = tree->numareas;
+
+	if (!CheapStage(BUDGET_OPTIONAL))
+		PruneTree(tree);
+	stats->numnodes = tree->numnodes;
+	stats->numleafs = tree->numleafs;
+	stats->numportals = tree->numportals;
+	stats->treecost = TreeCost(tree);
+	stats->numprunednodes = tree->numprunednodes;
+	stats->numprunedportals = tree->numprunedportals;
+	stats->areatime = Seconds() - time;
+
+	time = Seconds();
+#if 1
+	BuildAreaModels(tree);
+#endif
+	stats->modeltime = Seconds() - time;
+
+	return tree;
+}
+
+// BuildTreeFromMapPolys
+static void ProcessModel()
+{
+	Message("Processing model...\n");
+
+	bsptree_t *tree = CompileModel();
+
+	ctx->stage = BSP_ERROR_OUTPUT;
+	double time = Seconds();
+	WriteBinary(tree);
+	ctx->stats.writetime = Seconds() - time;
+}
+
+// ==============================================
+// Packed models
+// each model is compiled in a context of its own by a pool of workers, the
+// calling thread being one of them. The map data of the models is only read,
+// so they can share it. The contexts keep the trees until the packed file has
+// been written
+
+#define MAX_MODEL_THREADS	64
+
+typedef struct modeljobs_s
+{
+	mapmodel_t		**models;
+	int			nummodels;
+	int			nextmodel;
+	bspoptions_t		options;
+	struct cache_s		*cache;
+	const char		*outputfilename;
+	double			compilestart;
+
+} modeljobs_t;
+
+static void BuildPackedModel(mapmodel_t *m, modeljobs_t *jobs)
+{
+	bspcontext_t *c = Bsp_CreateContext(&jobs->options);
+	if (!c)
+	{
+		m->result = BSP_ERROR_COMPILE;
+		return;
+	}
+
+	bspcontext_t *saved = ctx;
+	ctx = c;
+
+	m->context = c;
+	c->mapdata = m->data;
+	c->cache = jobs->cache;
+	c->compilestart = jobs->compilestart;
+	snprintf(c->leakfilename, sizeof(c->leakfilename), "%s.%s.leak", jobs->outputfilename, m->name);
+	c->compiling = true;
+	c->stage = BSP_ERROR_COMPILE;
+
+	if (setjmp(c->errorjmp))
+		m->result = c->stage;
+	else
+		m->tree = CompileModel();
+
+	c->compiling = false;
+
+	ctx = saved;
+}
+
+static void *ModelWorker(void *args)
+{
+	modeljobs_t *jobs = (modeljobs_t*)args;
+
+	while (1)
+	{
+		int i = __atomic_fetch_add(&jobs->nextmodel, 1, __ATOMIC_RELAXED);
+		if (i >= jobs->nummodels)
+			break;
+
+		BuildPackedModel(jobs->models[i], jobs);
+	}
+
+	return NULL;
+}
+
+static void ProcessModels()
+{
+	Message("Processing %i models...\n", ctx->nummodels);
+
+	modeljobs_t jobs;
+	memset(&jobs, 0, sizeof(jobs));
+	jobs.models = (mapmodel_t**)Malloc(ctx->nummodels * sizeof(mapmodel_t*));
+	for (mapmodel_t *m = ctx->models; m; m = m->next)
+		jobs.models[jobs.nummodels++] = m;
+
+	// the debug streams belong to the packing compile
+	jobs.options = ctx->options;
+	jobs.options.debugout = false;
+	jobs.cache = ctx->cache;
+	jobs.outputfilename = ctx->outputfilename;
+	jobs.compilestart = ctx->compilestart;
+
+	int numthreads = ctx->options.modelthreads;
+	if (numthreads <= 0)
+		numthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (numthreads > jobs.nummodels)
+		numthreads = jobs.nummodels;
+
+	// a thread that can't be started just leaves its share to the others
+	pthread_t threads[MAX_MODEL_THREADS];
+	int numstarted = 0;
+	for (int i = 1; i < numthreads && numstarted < MAX_MODEL_THREADS; i++)
+	{
+		if (pthread_create(threads + numstarted, NULL, ModelWorker, &jobs))
+			break;
+		numstarted++;
+	}
+
+	ModelWorker(&jobs);
+
+	for (int i = 0; i < numstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	// the model errors are reported once every worker has finished
+	bspstats_t *stats = &ctx->stats;
+	for (int i = 0; i < jobs.nummodels; i++)
+	{
+		mapmodel_t *m = jobs.models[i];
+
+		if (m->result != BSP_OK)
+			Error("Model \"%s\": %s", m->name, (m->context ? Bsp_ErrorString(m->context) : "Failed to create compile context\n"));
+
+		bspstats_t *s = &m->context->stats;
+		stats->numnodes += s->numnodes;
+		stats->numleafs += s->numleafs;
+		stats->numportals += s->numportals;
+		stats->numareas += s->numareas;
+		stats->numoutsideleafs += s->numoutsideleafs;
+		stats->leaked = stats->leaked || s->leaked;
+		stats->numsplitfaces += s->numsplitfaces;
+		stats->greedytreecost += s->greedytreecost;
+		stats->treecost += s->treecost;
+		stats->numrebuiltsubtrees += s->numrebuiltsubtrees;
+		stats->numprunednodes += s->numprunednodes;
+		stats->numprunedportals += s->numprunedportals;
+		stats->numcheapstages += s->numcheapstages;
+		stats->numcachednodes += s->numcachednodes;
+		stats->numcachedareas += s->numcachedareas;
+		stats->numcachedstages += s->numcachedstages;
+		stats->treetime += s->treetime;
+		stats->portaltime += s->portaltime;
+		stats->areatime += s->areatime;
+		stats->modeltime += s->modeltime;
+		stats->peakmemory += s->peakmemory;
+	}
+
+	Free(jobs.models);
+
+	ctx->stage = BSP_ERROR_OUTPUT;
+	double time = Seconds();
+	WritePackedBinary();
+	stats->writetime = Seconds() - time;
+}
+
+static void FreeModelContexts(bspcontext_t *c)
+{
+	for (mapmodel_t *m = c->models; m; m = m->next)
+	{
+		if (!m->context)
+			continue;
+
+		FreeCompileMemory(m->context);
+		Bsp_FreeContext(m->context);
+		m->context = NULL;
+	}
+}
+
+// the files a failed compile left open. A partly written output is removed
+static void CloseCompileFiles(bspcontext_t *c)
+{
+	if (c->mapfp)
+		FileClose(c->mapfp);
+
+	if (c->outputfp)
+	{
+		FileClose(c->outputfp);
+		remove(c->outputfilename);
+	}
+
+	c->mapfp = NULL;
+	c->outputfp = NULL;
+}
+
+void Bsp_DefaultOptions(bspoptions_t *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->outputfilename = "out.bsp";
+	options->nodelayout = NODELAYOUT_NONE;
+
+	options->splitweights[SPLIT_WEIGHT_AREAHINT] = 1.0f;
+	options->splitweights[SPLIT_WEIGHT_AXIAL] = 0.0f;
+	options->splitweights[SPLIT_WEIGHT_SPLITS] = 0.5f;
+	options->splitweights[SPLIT_WEIGHT_ONPLANE] = 0.1f;
+	options->splitweights[SPLIT_WEIGHT_BALANCE] = 0.4f;
+}
+
+// ==============================================
+// Split profiles
+// a profile is text, a weight per line as its name and value. Lines starting
+// with // are comments
+
+static const char *splitweightnames[NUM_SPLIT_WEIGHTS] = { "areahint", "axial", "splits", "onplane", "balance" };
+
+const char *Bsp_SplitWeightName(int weight)
+{
+	if (weight < 0 || weight >= NUM_SPLIT_WEIGHTS)
+		return NULL;
+
+	return splitweightnames[weight];
+}
+
+bool Bsp_ReadSplitProfile(const char *filename, float *weights)
+{
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		return false;
+
+	float read[NUM_SPLIT_WEIGHTS];
+	memcpy(read, weights, sizeof(read));
+
+	bool ok = true;
+	char line[256];
+	while (ok && fgets(line, sizeof(line), fp))
+	{
+		char name[64], end[2];
+		float value;
+
+		int numfields = sscanf(line, " %63s %f %1s", name, &value, end);
+		if (numfields <= 0 || !strncmp(name, "//", 2))
+			continue;
+
+		int i = 0;
+		while (i < NUM_SPLIT_WEIGHTS && strcmp(name, splitweightnames[i]))
+			i++;
+
+		ok = (numfields == 2 && i < NUM_SPLIT_WEIGHTS);
+		if (ok)
+			read[i] = value;
+	}
+
+	fclose(fp);
+
+	if (ok)
+		memcpy(weights, read, sizeof(read));
+
+	return ok;
+}
+
+bool Bsp_WriteSplitProfile(const char *filename, const float *weights, const char *comment)
+{
+	FILE *fp = fopen(filename, "w");
+	if (!fp)
+		return false;
+
+	if (comment)
+		fprintf(fp, "// %s\n", comment);
+	for (int i = 0; i < NUM_SPLIT_WEIGHTS; i++)
+		fprintf(fp, "%s %g\n", splitweightnames[i], weights[i]);
+
+	return (fclose(fp) == 0);
+}
+
+bspcontext_t *Bsp_CreateContext(const bspoptions_t *options)
+{
+	pthread_once(&hooksonce, InstallHooks);
+
+	bspcontext_t *c = (bspcontext_t*)calloc(1, sizeof(bspcontext_t));
+	if (!c)
+		return NULL;
+
+	c->options = *options;
+
+	return c;
+}
+
+void Bsp_FreeContext(bspcontext_t *c)
+{
+	if (!c)
+		return;
+
+	CacheFreeKept(c);
+
+	free(c->mesh.vertices);
+	free(c->mesh.indicies);
+	free(c);
+}
+
+bsperror_t Bsp_CompileMap(bspcontext_t *c, const char *filename, const char *outputfilename)
+{
+	return Bsp_CompileModels(c, &filename, 1, outputfilename);
+}
+
+bsperror_t Bsp_CompileModels(bspcontext_t *c, const char **filenames, int numfilenames, const char *outputfilename)
+{
+	// the context belongs to this thread for the length of the compile
+	bspcontext_t *saved = ctx;
+	ctx = c;
+
+	ResetContext(c);
+	c->outputfilename = (outputfilename ? outputfilename : c->options.outputfilename);
+	snprintf(c->leakfilename, sizeof(c->leakfilename), "%s.leak", c->outputfilename);
+
+	c->compiling = true;
+	c->compilestart = Seconds();
+	c->stage = BSP_ERROR_DEBUG;
+
+	bsperror_t result = BSP_OK;
+	if (setjmp(c->errorjmp))
+	{
+		result = c->stage;
+		CloseCompileFiles(c);
+	}
+	else
+	{
+		DebugInit();
+
+		if (c->options.incremental)
+			CacheLoad();
+
+		c->stage = BSP_ERROR_MAP;
+		double time = Seconds();
+		for (int i = 0; i < numfilenames; i++)
+			ReadMap(filenames[i]);
+		for (mapmodel_t *m = c->models; m; m = m->next)
+		{
+			c->stats.numfaces += m->data.numfaces;
+			c->stats.numareahints += m->data.numareahints;
+			c->stats.numdetailfaces += m->data.numdetailfaces;
+		}
+		c->stats.nummodels = c->nummodels;
+		c->stats.readtime = Seconds() - time;
+
+		if (!c->nummodels)
+			Error("No maps to compile\n");
+
+		c->stage = BSP_ERROR_COMPILE;
+		if (c->nummodels == 1)
+		{
+			c->mapdata = c->models->data;
+			ProcessModel();
+		}
+		else
+		{
+			ProcessModels();
+		}
+
+		if (c->cache)
+		{
+			Message("Reused %i nodes and %i area surfaces from the cache\n", c->stats.numcachednodes, c->stats.numcachedareas);
+			CacheWrite();
+			CacheKeep();
+		}
+	}
+
+	// errors while closing the debug streams aren't caught
+	c->compiling = false;
+	DebugCloseFiles();
+
+	FreeModelContexts(c);
+	FreeCompileMemory(c);
+
+	ctx = saved;
+
+	return result;
+}
+
+const char *Bsp_ErrorString(const bspcontext_t *c)
+{
+	return c->errorstring;
+}
+
+void Bsp_GetStats(const bspcontext_t *c, bspstats_t *stats)
+{
+	*stats = c->stats;
+}
+
+void Bsp_Shutdown()
+{
+	DebugShutdown();
+}
@@ -0,0 +1,192 @@
+#ifndef __LIBBSP_H__
+#define __LIBBSP_H__
+
+// compiler library
+//
+// every compile runs against its own context, so several maps can be compiled
+// at once on different threads of the same process. A context compiles one map
+// at a time and can be reused for the next. The memory a compile allocates is
+// released when it ends. Errors are returned as a code from the compile, with
+// the message kept in the context, instead of exiting
+
+// layout of the optional compact traversal node lumps. The implicit records
+// are written instead of the node block
+typedef enum
+{
+	NODELAYOUT_NONE,
+	NODELAYOUT_DFS,
+	NODELAYOUT_VEB,
+	NODELAYOUT_IMPLICIT
+
+} nodelayout_t;
+
+// the weights of the features a split plane is scored by. A split profile
+// holds a value for each, by name
+typedef enum
+{
+	SPLIT_WEIGHT_AREAHINT,	// the plane is an areahint
+	SPLIT_WEIGHT_AXIAL,	// the plane is axial
+	SPLIT_WEIGHT_SPLITS,	// few faces cross the plane
+	SPLIT_WEIGHT_ONPLANE,	// much of the face area lies on the plane
+	SPLIT_WEIGHT_BALANCE,	// the face area on each side is even
+	NUM_SPLIT_WEIGHTS
+
+} splitweight_t;
+
+typedef enum
+{
+	BSP_OK,
+	BSP_ERROR_MAP,		// the map couldn't be read or is invalid
+	BSP_ERROR_COMPILE,	// the tree, portals or areas couldn't be built
+	BSP_ERROR_OUTPUT,	// the output file couldn't be written
+	BSP_ERROR_DEBUG		// the debug output couldn't be opened
+
+} bsperror_t;
+
+typedef struct bspoptions_s
+{
+	const char	*outputfilename;
+	nodelayout_t	nodelayout;
+	bool		verbose;
+
+	// write the glvis debug streams, to the glvis at debughost if it's set.
+	// The debug files go to the working directory with fixed names, so only
+	// one compile at a time should turn this on
+	bool		debugout;
+	const char	*debughost;
+
+	// threads building the models of a map with more than one, 0 for one
+	// per cpu
+	int		modelthreads;
+
+	// reuse the tree nodes and area surfaces of the last build that are
+	// unchanged, from a cache kept next to the output as output.cache. The
+	// output is the same as a clean build
+	bool		incremental;
+
+	// directory of the stage cache. The tree, empty leafs, portals and areas
+	// of each model are saved there by the hash of the map, and a compile of
+	// the same faces resumes after the last stage saved, so only the area
+	// surfaces and the output are built again. NULL to turn it off. It isn't
+	// read when writing debug output, which comes from the skipped stages
+	const char	*stagecache;
+
+	// rebuild the subtrees of the greedy tree that a point query is expected
+	// to be slow through, choosing splits by the cost under them. The areas
+	// and what's solid don't change, the nodes do
+	bool		optimizetree;
+
+	// how the greedy build scores split planes, see splitweight_t
+	float		splitweights[NUM_SPLIT_WEIGHTS];
+
+	// a quick build to look at. Splits are chosen from a sample of the
+	// faces, the tree isn't optimized or pruned, and the area surfaces keep
+	// their t-junctions and get flat normals
+	bool		preview;
+
+	// seconds the compile should take, 0 for no limit. A stage that starts
+	// past its share of the budget is built the way a preview builds it
+	float		timebudget;
+
+	// check that the pieces of every face split while building the tree
+	// still lie in the plane of the face. Slow, for debugging the splits
+	bool		validate;
+
+} bspoptions_t;
+
+typedef struct bspstats_s
+{
+	int		nummodels;
+	int		numfaces;
+	int		numareahints;
+	int		numdetailfaces;
+	int		numnodes;
+	int		numleafs;
+	int		numportals;
+	int		numareas;
+
+	// leafs in the void around the map, which aren't written. A map that
+	// leaks has none, and its leak trace is written to output.leak
+	int		numoutsideleafs;
+	bool		leaked;
+
+	// nodes and portals taken out of the tree after the areas were built. The
+	// counts above are what's left
+	int		numprunednodes;
+	int		numprunedportals;
+
+	// faces split building the greedy tree
+	int		numsplitfaces;
+
+	// expected nodes a point query visits in the tree written. The cost of
+	// the greedy tree and the subtrees rebuilt are only set when the tree is
+	// optimized
+	float		treecost;
+	float		greedytreecost;
+	int		numrebuiltsubtrees;
+
+	// stages built the preview way because the compile ran over its time
+	// budget
+	int		numcheapstages;
+
+	// nodes and area surfaces reused from the incremental build cache
+	int		numcachednodes;
+	int		numcachedareas;
+
+	// stages resumed from the stage cache, summed over the models
+	int		numcachedstages;
+
+	// seconds spent in each stage. The stages of the models of a packed file
+	// are summed over the models
+	double		readtime;
+	double		treetime;
+	double		portaltime;
+	double		areatime;
+	double		modeltime;
+	double		writetime;
+
+	// most memory the compile had allocated at once, in bytes
+	long		peakmemory;
+
+} bspstats_t;
+
+typedef struct bspcontext_s bspcontext_t;
+
+void Bsp_DefaultOptions(bspoptions_t *options);
+
+// read the split weights from a profile, keeping the ones it doesn't name.
+// Returns false if the file can't be read or has a line that isn't a weight
+bool Bsp_ReadSplitProfile(const char *filename, float *weights);
+
+// write a profile of the weights, with the comment at the top if it isn't NULL
+bool Bsp_WriteSplitProfile(const char *filename, const float *weights, const char *comment);
+
+// name of a weight in a profile
+const char *Bsp_SplitWeightName(int weight);
+
+// the options are copied, but the strings they point to must outlive the context
+bspcontext_t *Bsp_CreateContext(const bspoptions_t *options);
+void Bsp_FreeContext(bspcontext_t *context);
+
+// the output goes to outputfilename, or to the one in the options if it's NULL
+bsperror_t Bsp_CompileMap(bspcontext_t *context, const char *filename, const char *outputfilename);
+
+// compile the maps into one output. The faces of each map outside its model
+// blocks are a model named after the map, and each model block is a model of
+// its own. More than one model is written as a packed file with a tree per
+// model, built in parallel. A single model is written the same as
+// Bsp_CompileMap
+bsperror_t Bsp_CompileModels(bspcontext_t *context, const char **filenames, int numfilenames, const char *outputfilename);
+
+// message for the last error, empty if the last compile succeeded
+const char *Bsp_ErrorString(const bspcontext_t *context);
+
+// stats of the last compile, up to the stage that failed if it didn't succeed
+void Bsp_GetStats(const bspcontext_t *context, bspstats_t *stats);
+
+// the debug writer thread is shared by all contexts. This waits for it to
+// finish writing and stops it, and should be called once no compiles are
+// running, before the process exits
+void Bsp_Shutdown();
+
+#endif
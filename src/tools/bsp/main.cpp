@@ -1,118 +1,405 @@
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "bsp.h"
 
-// at 128 = 1m, 0.02 = 0.15625mm
-extern const float CLIP_EPSILON		= 0.2f;
-extern const float AREA_EPSILON		= 0.1f;
-extern const float PLANAR_EPSILON	= 0.2f;		// same as clip epsilon
-extern const float MAX_VERTEX_SIZE	= 4096.0f;
+static bspoptions_t	options;
+static bool		outputset = false;
+static bool		pack = false;
+static bool		watch = false;
+static int		numworkers = 0;
 
-const char	*outputfilename = "out.bsp";
-static bool	verbose = false;
+// ==============================================
+// Batch
+// the maps from the command line and the manifest are compiled by a pool of
+// workers, each with its own compile context. The largest maps are started
+// first so a big map picked up late doesn't hold up the end of the batch. A map
+// that fails is reported and the batch carries on
+
+typedef struct job_s
+{
+	char		mapfilename[1024];
+	char		outputfilename[1024];
+	long		mapsize;
+
+	bsperror_t	result;
+	char		errorstring[2048];
+	bspstats_t	stats;
+	double		time;
+
+} job_t;
+
+static job_t		*jobs;
+static int		numjobs;
+static int		maxjobs;
+
+// jobs largest first, taken by the workers from nextjob
+static job_t		**order;
+static int		nextjob;
+static int		numfinished;
+static pthread_mutex_t	printlock = PTHREAD_MUTEX_INITIALIZER;
+
+static double Seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-void Message(const char *format, ...)
+// the output is the map name with a .bsp extension unless one is given
+static void AddJob(const char *mapfilename, const char *outputfilename)
 {
-	if(!verbose)
+	if (numjobs == maxjobs)
 	{
-		return;
+		maxjobs = (maxjobs ? maxjobs * 2 : 64);
+		jobs = (job_t*)realloc(jobs, maxjobs * sizeof(job_t));
+		if (!jobs)
+			Error("Failed to allocate %i jobs\n", maxjobs);
 	}
-	
-	va_list valist;
-	char buffer[2048];
-	
-	va_start(valist, format);
-	vsprintf(buffer, format, valist);
-	va_end(valist);
-
-	fprintf(stdout, "%s", buffer);
-}
 
-// ==============================================
-// Memory allocation
+	job_t *j = jobs + numjobs++;
+	memset(j, 0, sizeof(*j));
+
+	if (strlen(mapfilename) >= sizeof(j->mapfilename) - 4)
+		Error("Map filename \"%s\" is too long\n", mapfilename);
+	strcpy(j->mapfilename, mapfilename);
+
+	if (outputfilename)
+	{
+		if (strlen(outputfilename) >= sizeof(j->outputfilename))
+			Error("Output filename \"%s\" is too long\n", outputfilename);
+		strcpy(j->outputfilename, outputfilename);
+	}
+	else
+	{
+		strcpy(j->outputfilename, mapfilename);
 
-void *Malloc(int numbytes)
+		char *slash = strrchr(j->outputfilename, '/');
+		char *dot = strrchr(j->outputfilename, '.');
+		if (dot && (!slash || dot > slash))
+			*dot = '\0';
+		strcat(j->outputfilename, ".bsp");
+
+		if (!strcmp(j->outputfilename, j->mapfilename))
+			Error("Map \"%s\" would be overwritten by its output\n", mapfilename);
+	}
+
+	struct stat st;
+	if (stat(mapfilename, &st) == 0)
+		j->mapsize = st.st_size;
+}
+
+// one map per line, optionally followed by its output filename. Blank lines
+// and lines starting with # are skipped
+static void ReadManifest(const char *filename)
 {
-	void *mem;
-	
-	mem = malloc(numbytes);
+	FILE *fp = FileOpenTextRead(filename);
 
-	if(!mem)
+	char line[4096];
+	while (fgets(line, sizeof(line), fp))
 	{
-		Error("Malloc: Failed to allocated memory");
+		char mapfilename[1024], outputfilename[1024];
+
+		int count = sscanf(line, "%1023s %1023s", mapfilename, outputfilename);
+		if (count <= 0 || mapfilename[0] == '#')
+			continue;
+
+		AddJob(mapfilename, (count == 2 ? outputfilename : NULL));
 	}
 
-	return mem;
+	FileClose(fp);
 }
 
-void *MallocZeroed(int numbytes)
+static int CompareJobSize(const void *a, const void *b)
 {
-	void *mem;
-	
-	mem = Malloc(numbytes);
+	long sizea = (*(job_t**)a)->mapsize;
+	long sizeb = (*(job_t**)b)->mapsize;
 
-	memset(mem, 0, numbytes);
+	return (sizea < sizeb) - (sizea > sizeb);
+}
+
+static void PrintJobResult(job_t *j)
+{
+	pthread_mutex_lock(&printlock);
 
-	return mem;
+	numfinished++;
+	if (j->result == BSP_OK)
+		printf("[%i/%i] %s: %.3fs\n", numfinished, numjobs, j->mapfilename, j->time);
+	else
+		printf("[%i/%i] %s: failed, %s", numfinished, numjobs, j->mapfilename, j->errorstring);
+	fflush(stdout);
+
+	pthread_mutex_unlock(&printlock);
 }
 
-// ==============================================
-// Debugging functions
+static void *BatchWorker(void *args)
+{
+	bspcontext_t *context = Bsp_CreateContext(&options);
+	if (!context)
+		Error("Failed to create compile context\n");
+
+	while (1)
+	{
+		int i = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED);
+		if (i >= numjobs)
+			break;
+
+		job_t *j = order[i];
+
+		double start = Seconds();
+		j->result = Bsp_CompileMap(context, j->mapfilename, j->outputfilename);
+		j->time = Seconds() - start;
+
+		Bsp_GetStats(context, &j->stats);
+		strcpy(j->errorstring, Bsp_ErrorString(context));
+
+		PrintJobResult(j);
+	}
+
+	Bsp_FreeContext(context);
 
-void PrintPolygon(polygon_t *p)
+	return NULL;
+}
+
+static void PrintBatchStats(int workers, double walltime)
 {
-	printf("polygon %p, numvertices=%i, maxvertices=%i\n", p, p->numvertices, p->maxvertices);
-	for(int i = 0; i < p->numvertices; i++)
-		printf("vertex %i: (%f %f %f)\n",
-			i,
-			p->vertices[i][0],
-			p->vertices[i][1],
-			p->vertices[i][2]);
+	static const char *results[] = { "ok", "map", "compile", "output", "debug" };
+
+	printf("\n%-32s %8s %9s %7s %7s %7s %7s %6s %9s\n",
+		"map", "result", "seconds", "faces", "nodes", "leafs", "portals", "areas", "peak kb");
+
+	int numfailed = 0;
+	double compiletime = 0.0;
+	bspstats_t total;
+	memset(&total, 0, sizeof(total));
+
+	for (int i = 0; i < numjobs; i++)
+	{
+		job_t *j = jobs + i;
+		bspstats_t *s = &j->stats;
+
+		printf("%-32s %8s %9.3f %7i %7i %7i %7i %6i %9li\n",
+			j->mapfilename, results[j->result], j->time,
+			s->numfaces, s->numnodes, s->numleafs, s->numportals, s->numareas, s->peakmemory / 1024);
+
+		numfailed += (j->result != BSP_OK ? 1 : 0);
+		compiletime += j->time;
+
+		total.readtime += s->readtime;
+		total.treetime += s->treetime;
+		total.portaltime += s->portaltime;
+		total.areatime += s->areatime;
+		total.modeltime += s->modeltime;
+		total.writetime += s->writetime;
+		total.greedytreecost += s->greedytreecost;
+		total.treecost += s->treecost;
+		total.numrebuiltsubtrees += s->numrebuiltsubtrees;
+		total.numprunednodes += s->numprunednodes;
+		total.numprunedportals += s->numprunedportals;
+		total.numcheapstages += s->numcheapstages;
+		total.numcachednodes += s->numcachednodes;
+		total.numcachedareas += s->numcachedareas;
+		total.numcachedstages += s->numcachedstages;
+		if (s->peakmemory > total.peakmemory)
+			total.peakmemory = s->peakmemory;
+	}
+
+	int numleaked = 0;
+	for (int i = 0; i < numjobs; i++)
+		numleaked += (jobs[i].stats.leaked ? 1 : 0);
+
+	printf("\n%i maps, %i failed, %i leaked\n", numjobs, numfailed, numleaked);
+	printf("stages: read %.3fs, tree %.3fs, portals %.3fs, areas %.3fs, models %.3fs, write %.3fs\n",
+		total.readtime, total.treetime, total.portaltime, total.areatime, total.modeltime, total.writetime);
+	printf("pruned %i nodes and %i portals\n", total.numprunednodes, total.numprunedportals);
+	if (options.optimizetree)
+		printf("rebuilt %i subtrees, expected point query cost %.2f -> %.2f nodes summed over the maps\n", total.numrebuiltsubtrees, total.greedytreecost, total.treecost);
+	if (options.timebudget > 0.0f)
+		printf("%i stages built the preview way over the time budget\n", total.numcheapstages);
+	if (options.incremental)
+		printf("reused %i nodes and %i area surfaces from the cache\n", total.numcachednodes, total.numcachedareas);
+	if (options.stagecache)
+		printf("resumed %i stages from the stage cache\n", total.numcachedstages);
+	printf("largest peak memory %li kb\n", total.peakmemory / 1024);
+	printf("%.3fs compiling in %.3fs on %i workers (%.2fx)\n",
+		compiletime, walltime, workers, (walltime > 0.0 ? compiletime / walltime : 0.0));
 }
 
-void PrintNode(bspnode_t *n)
+static int RunBatch()
 {
-	printf("plane=(%f, %f, %f, %f)", n->plane[0], n->plane[1], n->plane[2], n->plane[3]);
-	printf(" ");
-	printf("children=(%p, %p)", n->children[0], n->children[1]);
-	printf("\n");
+	order = (job_t**)malloc(numjobs * sizeof(job_t*));
+	if (!order)
+		Error("Failed to allocate %i jobs\n", numjobs);
+
+	for (int i = 0; i < numjobs; i++)
+		order[i] = jobs + i;
+	qsort(order, numjobs, sizeof(job_t*), CompareJobSize);
+
+	int workers = numworkers;
+	if (workers <= 0)
+		workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > numjobs)
+		workers = numjobs;
+	if (workers < 1)
+		workers = 1;
+
+	// the workers are the pool, a map with models builds them on its worker
+	// instead of starting threads of its own
+	options.modelthreads = 1;
+
+	double start = Seconds();
+
+	pthread_t *threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	for (int i = 0; i < workers; i++)
+	{
+		if (pthread_create(threads + i, NULL, BatchWorker, NULL))
+			Error("Failed to create worker thread\n");
+	}
+
+	for (int i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+
+	double walltime = Seconds() - start;
+
+	PrintBatchStats(workers, walltime);
+
+	int numfailed = 0;
+	for (int i = 0; i < numjobs; i++)
+		numfailed += (jobs[i].result != BSP_OK ? 1 : 0);
+
+	free(threads);
+	free(order);
+
+	return (numfailed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 // ==============================================
-// Main
+// Watch
+// the maps are compiled again each time one of them is saved, by the same
+// context, until the process is killed. The incremental cache stays in the
+// context between compiles, so an edit rebuilds only the subtrees and area
+// surfaces it touched. The directories are watched instead of the files, as
+// editors often save by moving a new file over the old one
 
-static void PrintUsage()
+// wait for a change to settle before compiling, an editor can write a file in
+// several goes
+#define WATCH_SETTLE_MS		50
+
+typedef struct watchfile_s
 {
-	printf( "[-v] [-o outputfile] file ...\n");
+	int		wd;
+	char		name[256];
+
+} watchfile_t;
+
+static bool ReadWatchEvents(int fd, watchfile_t *files, int numfiles)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	ssize_t numbytes = read(fd, buffer, sizeof(buffer));
+	if (numbytes <= 0)
+		return false;
+
+	bool changed = false;
+	for (char *p = buffer; p < buffer + numbytes; )
+	{
+		struct inotify_event *e = (struct inotify_event*)p;
+		p += sizeof(struct inotify_event) + e->len;
+
+		for (int i = 0; i < numfiles && e->len; i++)
+			changed = changed || (e->wd == files[i].wd && !strcmp(e->name, files[i].name));
+	}
+
+	return changed;
 }
 
-static void ProcessEnvVars()
-{}
+static void WatchCompile(bspcontext_t *context, const char **filenames)
+{
+	double start = Seconds();
+	bsperror_t result = Bsp_CompileModels(context, filenames, numjobs, NULL);
+	double seconds = Seconds() - start;
+
+	time_t now = time(NULL);
+	char timestring[16];
+	strftime(timestring, sizeof(timestring), "%H:%M:%S", localtime(&now));
+
+	bspstats_t stats;
+	Bsp_GetStats(context, &stats);
+
+	if (result == BSP_OK)
+		printf("[%s] built in %.3fs, reused %i nodes and %i area surfaces\n", timestring, seconds, stats.numcachednodes, stats.numcachedareas);
+	else
+		printf("[%s] failed, %s", timestring, Bsp_ErrorString(context));
+	fflush(stdout);
+}
 
-// BuildTreeFromMapPolys
-static void ProcessModel()
+static void RunWatch(bspcontext_t *context, const char **filenames)
 {
-	bsptree_t *tree;
-	
-	Message("Processing model...\n");
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1)
+		Error("Failed to start watching the maps\n");
+
+	watchfile_t *files = (watchfile_t*)malloc(numjobs * sizeof(watchfile_t));
+	for (int i = 0; i < numjobs; i++)
+	{
+		char dir[1024];
+		if (strlen(filenames[i]) >= sizeof(dir))
+			Error("Map path \"%s\" is too long\n", filenames[i]);
+		strcpy(dir, filenames[i]);
+
+		char *slash = strrchr(dir, '/');
+		const char *name = (slash ? slash + 1 : dir);
+		if (strlen(name) >= sizeof(files[i].name))
+			Error("Map filename \"%s\" is too long\n", filenames[i]);
+		strcpy(files[i].name, name);
+
+		if (slash == dir)
+			strcpy(dir, "/");
+		else if (slash)
+			*slash = '\0';
+		else
+			strcpy(dir, ".");
 
-	tree = BuildTree();
-	
-	MarkEmptyLeafs(tree);
+		files[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+		if (files[i].wd == -1)
+			Error("Failed to watch \"%s\"\n", dir);
+	}
+
+	printf("watching %i map%s, ctrl-c to stop\n", numjobs, (numjobs > 1 ? "s" : ""));
 
-	BuildPortals(tree);
+	while (1)
+	{
+		WatchCompile(context, filenames);
 
-	BuildAreas(tree);
-#if 1
-	extern void BuildAreaModels(bsptree_t *tree);
-	BuildAreaModels(tree);
-#endif
+		while (!ReadWatchEvents(fd, files, numjobs))
+			;
 
-	WriteBinary(tree);
+		struct pollfd p = { fd, POLLIN, 0 };
+		while (poll(&p, 1, WATCH_SETTLE_MS) > 0)
+			ReadWatchEvents(fd, files, numjobs);
+	}
 }
 
-static void ProcessCommandLine(int argc, char *argv[])
+// ==============================================
+// Main
+
+static void PrintUsage()
+{
+	printf( "[-v] [-o outputfile] [-j numworkers] [--manifest file] [--pack] [--watch] [--incremental] [--stage-cache dir] [--optimize-tree] [--split-profile file] [--preview] [--time-budget seconds] [--validate] [--debug-out] [--debug-net host[:port]] [--compact-nodes dfs|veb|implicit] file ...\n");
+}
+
+static void ProcessEnvVars()
+{}
+
+static bool ProcessCommandLine(int argc, char *argv[])
 {
 	int i;
-	
+	bool batch = false;
+
 	if(argc == 1)
 	{
 		PrintUsage();
@@ -124,33 +411,155 @@ static void ProcessCommandLine(int argc, char *argv[])
 		if(!strcmp(argv[i], "-o"))
 		{
 			i++;
-			outputfilename = argv[i];
+			options.outputfilename = argv[i];
+			outputset = true;
 		}
 		else if(!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
 		{
-			verbose = true;
+			options.verbose = true;
+		}
+		else if(!strcmp(argv[i], "-j") && i + 1 < argc)
+		{
+			numworkers = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "--manifest") && i + 1 < argc)
+		{
+			ReadManifest(argv[++i]);
+			batch = true;
+		}
+		else if(!strcmp(argv[i], "--pack"))
+		{
+			pack = true;
+		}
+		else if(!strcmp(argv[i], "--watch"))
+		{
+			watch = true;
+			options.incremental = true;
+		}
+		else if(!strcmp(argv[i], "--incremental"))
+		{
+			options.incremental = true;
+		}
+		else if(!strcmp(argv[i], "--stage-cache") && i + 1 < argc)
+		{
+			options.stagecache = argv[++i];
+		}
+		else if(!strcmp(argv[i], "--optimize-tree"))
+		{
+			options.optimizetree = true;
+		}
+		else if(!strcmp(argv[i], "--split-profile") && i + 1 < argc)
+		{
+			i++;
+			if (!Bsp_ReadSplitProfile(argv[i], options.splitweights))
+				Error("Failed to read split profile \"%s\"\n", argv[i]);
+		}
+		else if(!strcmp(argv[i], "--preview"))
+		{
+			options.preview = true;
+		}
+		else if(!strcmp(argv[i], "--time-budget") && i + 1 < argc)
+		{
+			options.timebudget = atof(argv[++i]);
+			if (options.timebudget <= 0.0f)
+				Error("Time budget \"%s\" isn't a number of seconds\n", argv[i]);
+		}
+		else if(!strcmp(argv[i], "--validate"))
+		{
+			options.validate = true;
+		}
+		else if(!strcmp(argv[i], "--debug-out"))
+		{
+			options.debugout = true;
+		}
+		else if(!strcmp(argv[i], "--debug-net"))
+		{
+			i++;
+			options.debugout = true;
+			options.debughost = argv[i];
+		}
+		else if(!strcmp(argv[i], "--compact-nodes"))
+		{
+			i++;
+			if (i < argc && !strcmp(argv[i], "dfs"))
+				options.nodelayout = NODELAYOUT_DFS;
+			else if (i < argc && !strcmp(argv[i], "veb"))
+				options.nodelayout = NODELAYOUT_VEB;
+			else if (i < argc && !strcmp(argv[i], "implicit"))
+				options.nodelayout = NODELAYOUT_IMPLICIT;
+			else
+				Error("Unknown node layout \"%s\"\n", (i < argc ? argv[i] : ""));
 		}
 		else
 			Error("Unknown option \"%s\"\n", argv[i]);
 	}
 
-	// eventually this could loop through all source files
-	// the higher level construct would be of a "bsp model"
-	// allowing multiple bsp models to be packed into a single file?
-	ReadMap(argv[i]);
+	// several maps, or a manifest, run as a batch unless they're packed
+	// into one file
+	for (; i < argc; i++)
+		AddJob(argv[i], NULL);
+
+	if (!numjobs)
+	{
+		PrintUsage();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (pack && batch)
+		Error("--pack can't be used with a manifest\n");
+	if (watch && batch)
+		Error("--watch can't be used with a manifest\n");
+	if (pack)
+	{
+		options.modelthreads = numworkers;
+		return false;
+	}
+
+	batch = batch || numjobs > 1;
+
+	if (watch && batch)
+		Error("--watch can only be used with a single map, or with --pack\n");
 
-	ProcessModel();
+	if (batch && outputset)
+		Error("-o can only be used with a single map, use a manifest to name the outputs\n");
+	if (batch && options.debugout)
+		Error("Debug output can only be used with a single map\n");
+
+	return batch;
 }
 
 int main(int argc, char *argv[])
 {
-	DebugInit();
-	
 	ProcessEnvVars();
 
-	ProcessCommandLine(argc, argv);
-	
-	DebugShutdown();
-	
+	Bsp_DefaultOptions(&options);
+
+	bool batch = ProcessCommandLine(argc, argv);
+
+	if (batch)
+		return RunBatch();
+
+	bspcontext_t *context = Bsp_CreateContext(&options);
+	if (!context)
+		Error("Failed to create compile context\n");
+
+	// the maps are the models of a packed file, or a single map
+	const char **filenames = (const char**)malloc(numjobs * sizeof(const char*));
+	for (int i = 0; i < numjobs; i++)
+		filenames[i] = jobs[i].mapfilename;
+
+	if (watch)
+		RunWatch(context, filenames);
+
+	bsperror_t result = Bsp_CompileModels(context, filenames, numjobs, NULL);
+
+	Bsp_Shutdown();
+
+	if (result != BSP_OK)
+		Error("%s", Bsp_ErrorString(context));
+
+	Bsp_FreeContext(context);
+	free(filenames);
+
 	return 0;
 }
@@ -1,12 +1,6 @@
 #include <ctype.h>
 #include "bsp.h"
 
-// map data
-static mapdata_t	mapdatalocal;
-mapdata_t		*mapdata = &mapdatalocal;
-
-smodel_t *smodels = NULL;
-
 static mapface_t *MallocMapPolygon(polygon_t *p)
 {
 	mapface_t *face	= (mapface_t*)MallocZeroed(sizeof(*face));
@@ -14,21 +8,19 @@ static mapface_t *MallocMapPolygon(polygon_t *p)
 	return face;
 }
 
-static int linenum;
-static int polygonlinenum;
-static char buffer[1024];
-
 static char *ReadToken(FILE *fp)
 {
 	int c;
 
+	char *buffer = ctx->token;
+
 	c = fgetc(fp);
 	for (; c != EOF && isspace(c); c = fgetc(fp))
 		if (c == '\n')
-			linenum++;
+			ctx->linenum++;
 
 	int i = 0;
-	for (; c != EOF && !isspace(c); c = fgetc(fp))
+	for (; c != EOF && !isspace(c) && i < (int)sizeof(ctx->token) - 1; c = fgetc(fp))
 		buffer[i++] = c;
 
 	buffer[i] = '\0';
@@ -53,7 +45,7 @@ static void ExpectToken(char *expect, FILE *fp)
 
 static char* PolygonString(polygon_t *p)
 {
-	static char buffer[2048];
+	char *buffer = ctx->polygonstring;
 	char *s = buffer;
 
 	s += sprintf(s, "polygon\n");
@@ -77,7 +69,7 @@ static void CheckSize(polygon_t *p)
 		for (int j = 0; j < 3; j++)
 		{
 			if ((p->vertices[i][j] > MAX_VERTEX_SIZE) || (p->vertices[i][j] < -MAX_VERTEX_SIZE))
-				Error("(%i) Polygon is larger than max size\n%s", polygonlinenum, PolygonString(p));
+				Error("(%i) Polygon is larger than max size\n%s", ctx->polygonlinenum, PolygonString(p));
 		}
 	}
 }
@@ -85,7 +77,7 @@ static void CheckSize(polygon_t *p)
 static void CheckDegenerate(polygon_t *p)
 {
 	if (Polygon_Area(p) < AREA_EPSILON)
-		Error("(%i) Polygon has degenerate area\n%s", polygonlinenum, PolygonString(p));
+		Error("(%i) Polygon has degenerate area\n%s", ctx->polygonlinenum, PolygonString(p));
 }
 
 static void CheckPlanar(polygon_t *p)
@@ -96,7 +88,7 @@ static void CheckPlanar(polygon_t *p)
 
 	for (int i = 0; i < p->numvertices; i++)
 		if (PointOnPlaneSide(plane, p->vertices[i], PLANAR_EPSILON) != PLANE_SIDE_ON)
-			Error("(%i) Polygon is non-planar\n%s", polygonlinenum, PolygonString(p));
+			Error("(%i) Polygon is non-planar\n%s", ctx->polygonlinenum, PolygonString(p));
 }
 
 static void ValidatePolygon(polygon_t *p)
@@ -157,7 +149,7 @@ static polygon_t *ReadPolygon(FILE *fp)
 {
 	polygon_t *p = NULL;
 	
-	polygonlinenum = linenum;
+	ctx->polygonlinenum = ctx->linenum;
 
 	ExpectToken("{", fp);
 
@@ -185,7 +177,7 @@ static polygon_t *ReadPolygon(FILE *fp)
 		}
 		else
 		{
-			Error("(%i) Unknown token \"%s\" when reading polygon\n", linenum, token);
+			Error("(%i) Unknown token \"%s\" when reading polygon\n", ctx->linenum, token);
 		}
 	}
 }
@@ -201,14 +193,35 @@ static void ReadMapFace(FILE *fp)
 	face->areahint	= false;
 	
 	// link the face into the map list
-	face->next = mapdata->faces;
-	mapdata->faces = face;
+	face->next = ctx->mapdata.faces;
+	ctx->mapdata.faces = face;
 	
-	mapdata->numfaces++;
+	ctx->mapdata.numfaces++;
 	
 	static float white[3] = { 1, 1, 1 };
-	DebugWriteColor(debugfp, white);
-	DebugWriteWireFillPolygon(debugfp, face->polygon);
+	DebugWriteColor(ctx->debugfile, white);
+	DebugWriteWireFillPolygon(ctx->debugfile, face->polygon);
+}
+
+static void ReadDetailFace(FILE *fp)
+{
+	polygon_t *p = ReadPolygon(fp);
+	
+	mapface_t *face = MallocMapPolygon(p);
+	face->polygon	= p;
+	face->plane	= Polygon_Plane(p);
+	face->box	= Polygon_BoundingBox(p);
+	face->detail	= true;
+	
+	// link the face into the map list
+	face->next = ctx->mapdata.faces;
+	ctx->mapdata.faces = face;
+	
+	ctx->mapdata.numdetailfaces++;
+	
+	static float grey[3] = { 0.6f, 0.6f, 0.6f };
+	DebugWriteColor(ctx->debugfile, grey);
+	DebugWriteWireFillPolygon(ctx->debugfile, face->polygon);
 }
 
 static void ReadAreaHint(FILE *fp)
@@ -222,14 +235,14 @@ static void ReadAreaHint(FILE *fp)
 	face->areahint	= true;
 
 	// link the face into the map list
-	face->next = mapdata->faces;
-	mapdata->faces = face;
+	face->next = ctx->mapdata.faces;
+	ctx->mapdata.faces = face;
 	
-	mapdata->numareahints++;
+	ctx->mapdata.numareahints++;
 
 	static float green[3] = { 0, 1, 0 };
-	DebugWriteColor(debugfp, green);
-	DebugWriteWireFillPolygon(debugfp, face->polygon);
+	DebugWriteColor(ctx->debugfile, green);
+	DebugWriteWireFillPolygon(ctx->debugfile, face->polygon);
 }
 
 static void ReadStaticModel(FILE *fp)
@@ -270,15 +283,99 @@ static void ReadStaticModel(FILE *fp)
 		else if (!strcmp(token, "}"))
 		{
 			// link it into the static list
-			m->next = smodels;
-			smodels = m;
+			m->next = ctx->smodels;
+			ctx->smodels = m;
 			return;
 		}
 		else
 		{
-			Error("(%i) Unknown token \"%s\" when reading static model\n", linenum, token);
+			Error("(%i) Unknown token \"%s\" when reading static model\n", ctx->linenum, token);
+		}
+	}
+}
+
+// models are kept in the order they're read, with the faces outside the model
+// blocks of a map ahead of the map's model blocks
+static mapmodel_t *AllocModel(const char *name, mapmodel_t **insert)
+{
+	if (strlen(name) >= sizeof(((mapmodel_t*)0)->name))
+		Error("(%i) Model name \"%s\" is too long\n", ctx->linenum, name);
+
+	for (mapmodel_t *m = ctx->models; m; m = m->next)
+	{
+		if (!strcmp(m->name, name))
+			Error("(%i) Model \"%s\" is already defined\n", ctx->linenum, name);
+	}
+
+	mapmodel_t *m = (mapmodel_t*)MallocZeroed(sizeof(mapmodel_t));
+	strcpy(m->name, name);
+
+	m->next = *insert;
+	*insert = m;
+	ctx->nummodels++;
+
+	return m;
+}
+
+static mapmodel_t **ModelListTail()
+{
+	mapmodel_t **tail = &ctx->models;
+	while (*tail)
+		tail = &(*tail)->next;
+
+	return tail;
+}
+
+// model name { polygon { } detail { } areahint { } }
+static void ReadModel(FILE *fp)
+{
+	char *token = ReadToken(fp);
+	if (!token)
+		Error("(%i) Expected a model name\n", ctx->linenum);
+
+	mapmodel_t *m = AllocModel(token, ModelListTail());
+	ctx->modelblocks = true;
+
+	// the model's faces are read into the map data, then handed to the model
+	mapdata_t mapdata = ctx->mapdata;
+	memset(&ctx->mapdata, 0, sizeof(ctx->mapdata));
+
+	ExpectToken("{", fp);
+
+	while (1)
+	{
+		token = ReadToken(fp);
+
+		if (!token)
+		{
+			Error("(%i) Unexpected end of file in model \"%s\"\n", ctx->linenum, m->name);
+		}
+		else if (!strcmp(token, "polygon"))
+		{
+			ReadMapFace(fp);
+		}
+		else if (!strcmp(token, "detail"))
+		{
+			ReadDetailFace(fp);
+		}
+		else if (!strcmp(token, "areahint"))
+		{
+			ReadAreaHint(fp);
+		}
+		else if (!strcmp(token, "}"))
+		{
+			break;
+		}
+		else
+		{
+			Error("(%i) Unknown token \"%s\" when reading model\n", ctx->linenum, token);
 		}
 	}
+
+	Message("model \"%s\": %i faces, %i detail faces, %i areahints\n", m->name, ctx->mapdata.numfaces, ctx->mapdata.numdetailfaces, ctx->mapdata.numareahints);
+
+	m->data = ctx->mapdata;
+	ctx->mapdata = mapdata;
 }
 
 static void ReadMapFile(FILE *fp)
@@ -291,6 +388,10 @@ static void ReadMapFile(FILE *fp)
 		{
 			ReadMapFace(fp);
 		}
+		else if (!strcmp(token, "detail"))
+		{
+			ReadDetailFace(fp);
+		}
 		else if (!strcmp(token, "areahint"))
 		{
 			ReadAreaHint(fp);
@@ -299,26 +400,61 @@ static void ReadMapFile(FILE *fp)
 		{
 			ReadStaticModel(fp);
 		}
+		else if (!strcmp(token, "model"))
+		{
+			ReadModel(fp);
+		}
 		else
 		{
-			Error("(%i) Unknown token \"%s\" when reading map\n", linenum, token);
+			Error("(%i) Unknown token \"%s\" when reading map\n", ctx->linenum, token);
 		}
 	}
 	
-	Message("%i faces\n", mapdata->numfaces);
-	Message("%i areahints\n", mapdata->numareahints);
+	Message("%i faces\n", ctx->mapdata.numfaces);
+	Message("%i detail faces\n", ctx->mapdata.numdetailfaces);
+	Message("%i areahints\n", ctx->mapdata.numareahints);
 }
 
-void ReadMap(char *filename)
+// the model of the faces outside the model blocks is named after the map
+static void ModelNameFromFilename(char *name, int size, const char *filename)
 {
-	FILE *fp;
+	const char *base = strrchr(filename, '/');
+	base = (base ? base + 1 : filename);
+
+	const char *dot = strrchr(base, '.');
+	int len = (dot && dot != base ? dot - base : (int)strlen(base));
+	if (len >= size)
+		len = size - 1;
 
+	memcpy(name, base, len);
+	name[len] = '\0';
+}
+
+void ReadMap(const char *filename)
+{
 	Message("Reading map \"%s\"\n", filename);
+
+	mapmodel_t **insert = ModelListTail();
+	ctx->modelblocks = false;
+	ctx->linenum = 0;
 	
-	fp = FileOpenBinaryRead(filename);
+	ctx->mapfp = FileOpenBinaryRead(filename);
+
+	ReadMapFile(ctx->mapfp);
 
-	ReadMapFile(fp);
+	FileClose(ctx->mapfp);
+	ctx->mapfp = NULL;
+
+	// a map of only model blocks has no model of its own
+	if (ctx->mapdata.numfaces || ctx->mapdata.numdetailfaces || ctx->mapdata.numareahints || !ctx->modelblocks)
+	{
+		char name[64];
+		ModelNameFromFilename(name, sizeof(name), filename);
+
+		mapmodel_t *m = AllocModel(name, insert);
+		m->data = ctx->mapdata;
+	}
 
-	FileClose(fp);
+	memset(&ctx->mapdata, 0, sizeof(ctx->mapdata));
 }
 
@@ -172,6 +172,7 @@ static void EmitNode(int num, bspnode_t *n, FILE *fp)
 	// write the node data
 	EmitPlane(n->plane, fp);
 	EmitBox3(n->box, fp);
+	EmitInt(n->empty ? 1 : 0, fp);
 }
 
 static void EmitNodeBlock(bsptree_t *tree, FILE *fp)
@@ -187,6 +188,322 @@ static void EmitNodeBlock(bsptree_t *tree, FILE *fp)
 		EmitNode(i, tree->root, fp);
 }
 
+// ________________________________________________________________________________ 
+// compact traversal nodes
+//
+// the optional compact lumps hold just what's needed to walk the tree. Nodes
+// index a shared plane array and have child indices with LEAF_BIT set for
+// leafs. Boxes are cold data kept in their own lump, node boxes first then leaf
+// boxes. Each node and leaf keeps the number of the full node it came from
+//
+// planes	numplanes, { float a, b, c, d }
+// tnodes	numtnodes, int headnode, { int planenum, children[2], nodenumber }
+// tleafs	numtleafs, { int nodenumber, empty }
+// tboxes	numtnodes + numtleafs, { float min[3], max[3] }
+
+#define LEAF_BIT	0x80000000
+
+#define PLANE_HASH_SIZE	1024
+
+typedef struct layoutplane_s
+{
+	struct layoutplane_s	*hashnext;
+	plane_t			plane;
+	int			planenum;
+
+} layoutplane_t;
+
+typedef struct layout_s
+{
+	// nodes and leafs in layout order
+	bspnode_t	**nodes;
+	int		numnodes;
+	bspnode_t	**leafs;
+	int		numleafs;
+
+	// layout index of each full node, by node number
+	int		*index;
+
+	layoutplane_t	*planehash[PLANE_HASH_SIZE];
+	plane_t		*planes;
+	int		numplanes;
+
+} layout_t;
+
+static bool IsLeaf(bspnode_t *n)
+{
+	return !n->children[0] && !n->children[1];
+}
+
+static int FindPlane(layout_t *l, plane_t plane)
+{
+	unsigned int hash = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		unsigned int bits;
+		float f = plane[i];
+		memcpy(&bits, &f, sizeof(bits));
+		hash = hash * 31 + bits;
+	}
+	hash &= (PLANE_HASH_SIZE - 1);
+
+	for (layoutplane_t *p = l->planehash[hash]; p; p = p->hashnext)
+	{
+		if (p->plane.a == plane.a && p->plane.b == plane.b && p->plane.c == plane.c && p->plane.d == plane.d)
+			return p->planenum;
+	}
+
+	layoutplane_t *p = (layoutplane_t*)MallocZeroed(sizeof(layoutplane_t));
+	p->plane = plane;
+	p->planenum = l->numplanes;
+	p->hashnext = l->planehash[hash];
+	l->planehash[hash] = p;
+
+	l->planes[l->numplanes++] = plane;
+
+	return p->planenum;
+}
+
+static void FreeLayoutPlanes(layout_t *l)
+{
+	for (int i = 0; i < PLANE_HASH_SIZE; i++)
+	{
+		layoutplane_t *next;
+		for (layoutplane_t *p = l->planehash[i]; p; p = next)
+		{
+			next = p->hashnext;
+			Free(p);
+		}
+	}
+}
+
+static void AddLayoutNode(layout_t *l, bspnode_t *n)
+{
+	l->index[n->nodenumber] = l->numnodes;
+	l->nodes[l->numnodes++] = n;
+}
+
+static void LayoutDepthFirst(layout_t *l, bspnode_t *n)
+{
+	if (IsLeaf(n))
+		return;
+
+	AddLayoutNode(l, n);
+	LayoutDepthFirst(l, n->children[0]);
+	LayoutDepthFirst(l, n->children[1]);
+}
+
+// number of node levels below n, not counting leafs
+static int SubtreeHeight(bspnode_t *n)
+{
+	if (IsLeaf(n))
+		return 0;
+
+	int h0 = SubtreeHeight(n->children[0]);
+	int h1 = SubtreeHeight(n->children[1]);
+
+	return 1 + (h0 > h1 ? h0 : h1);
+}
+
+static void LayoutVEB(layout_t *l, bspnode_t *n, int height);
+
+// lay out the subtrees hanging depth levels below n
+static void LayoutVEBBottoms(layout_t *l, bspnode_t *n, int depth, int height)
+{
+	if (IsLeaf(n))
+		return;
+
+	if (depth == 0)
+	{
+		LayoutVEB(l, n, height);
+		return;
+	}
+
+	LayoutVEBBottoms(l, n->children[0], depth - 1, height);
+	LayoutVEBBottoms(l, n->children[1], depth - 1, height);
+}
+
+// van emde boas order: the top half of the levels, then each of the subtrees
+// hanging off it, each laid out the same way. Any path from the root then
+// crosses a small number of blocks whatever the cache line size
+static void LayoutVEB(layout_t *l, bspnode_t *n, int height)
+{
+	if (IsLeaf(n) || height <= 0)
+		return;
+
+	if (height == 1)
+	{
+		AddLayoutNode(l, n);
+		return;
+	}
+
+	int top = height / 2;
+	LayoutVEB(l, n, top);
+	LayoutVEBBottoms(l, n, top, height - top);
+}
+
+// leafs are numbered in the order the laid out nodes reference them, so
+// sibling leafs sit next to each other
+static int ChildIndex(layout_t *l, bspnode_t *n)
+{
+	if (!IsLeaf(n))
+		return l->index[n->nodenumber];
+
+	if (l->index[n->nodenumber] == -1)
+	{
+		l->index[n->nodenumber] = l->numleafs;
+		l->leafs[l->numleafs++] = n;
+	}
+
+	return l->index[n->nodenumber] | LEAF_BIT;
+}
+
+static void EmitCompactNodeBlocks(bsptree_t *tree, FILE *fp)
+{
+	layout_t l;
+	memset(&l, 0, sizeof(l));
+
+	l.nodes = (bspnode_t**)Malloc(tree->numnodes * sizeof(bspnode_t*));
+	l.leafs = (bspnode_t**)Malloc(tree->numnodes * sizeof(bspnode_t*));
+	l.planes = (plane_t*)Malloc(tree->numnodes * sizeof(plane_t));
+	l.index = (int*)Malloc(tree->numnodes * sizeof(int));
+	for (int i = 0; i < tree->numnodes; i++)
+		l.index[i] = -1;
+
+	if (ctx->options.nodelayout == NODELAYOUT_VEB)
+		LayoutVEB(&l, tree->root, SubtreeHeight(tree->root));
+	else
+		LayoutDepthFirst(&l, tree->root);
+
+	if (l.numnodes != tree->numnodes - tree->numleafs)
+		Error("Laid out %i of %i nodes\n", l.numnodes, tree->numnodes - tree->numleafs);
+
+	// number the children and planes in node order
+	int *children = (int*)Malloc(l.numnodes * 2 * sizeof(int));
+	int *planenums = (int*)Malloc(l.numnodes * sizeof(int));
+	for (int i = 0; i < l.numnodes; i++)
+	{
+		children[i * 2 + 0] = ChildIndex(&l, l.nodes[i]->children[0]);
+		children[i * 2 + 1] = ChildIndex(&l, l.nodes[i]->children[1]);
+		planenums[i] = FindPlane(&l, l.nodes[i]->plane);
+	}
+	int headnode = ChildIndex(&l, tree->root);
+
+	Message("Compact nodes: %i nodes, %i leafs, %i planes\n", l.numnodes, l.numleafs, l.numplanes);
+
+	EmitHeader("planes", fp);
+	EmitInt(l.numplanes, fp);
+	for (int i = 0; i < l.numplanes; i++)
+		EmitPlane(l.planes[i], fp);
+
+	EmitHeader("tnodes", fp);
+	EmitInt(l.numnodes, fp);
+	EmitInt(headnode, fp);
+	for (int i = 0; i < l.numnodes; i++)
+	{
+		EmitInt(planenums[i], fp);
+		EmitInt(children[i * 2 + 0], fp);
+		EmitInt(children[i * 2 + 1], fp);
+		EmitInt(l.nodes[i]->nodenumber, fp);
+	}
+
+	EmitHeader("tleafs", fp);
+	EmitInt(l.numleafs, fp);
+	for (int i = 0; i < l.numleafs; i++)
+	{
+		EmitInt(l.leafs[i]->nodenumber, fp);
+		EmitInt(l.leafs[i]->empty ? 1 : 0, fp);
+	}
+
+	EmitHeader("tboxes", fp);
+	EmitInt(l.numnodes + l.numleafs, fp);
+	for (int i = 0; i < l.numnodes; i++)
+		EmitBox3(l.nodes[i]->box, fp);
+	for (int i = 0; i < l.numleafs; i++)
+		EmitBox3(l.leafs[i]->box, fp);
+
+	FreeLayoutPlanes(&l);
+	Free(children);
+	Free(planenums);
+	Free(l.nodes);
+	Free(l.leafs);
+	Free(l.planes);
+	Free(l.index);
+}
+
+// ________________________________________________________________________________
+// implicit pre-order nodes
+//
+// the records are written in pre-order, so the front child of a node is always
+// the next record and only the offset to the back child is stored. Leafs are
+// flagged with LEAF_BIT and hold the leaf flags and area number instead of a
+// plane. The records replace the node block, and the areas and portals use the
+// record numbers. Only the root box is kept, a child's box is its parent's cut
+// down by the parent's plane where the plane is along an axis, the same as
+// SplitNode makes them, so a loader makes the others
+//
+// planes	numplanes, { float a, b, c, d }
+// inodes	numinodes, float rootbox[6], { int planenum, backoffset } or { int LEAF_BIT | flags, areanumber }
+
+#define INODE_EMPTY	0x1
+
+static void AddImplicitPlanes(layout_t *l, bspnode_t *n)
+{
+	if (IsLeaf(n))
+		return;
+
+	FindPlane(l, n->plane);
+	AddImplicitPlanes(l, n->children[0]);
+	AddImplicitPlanes(l, n->children[1]);
+}
+
+static void EmitImplicitNode(layout_t *l, bspnode_t *n, FILE *fp)
+{
+	if (IsLeaf(n))
+	{
+		EmitInt(LEAF_BIT | (n->empty ? INODE_EMPTY : 0), fp);
+		EmitInt((n->area ? n->area->areanumber : -1), fp);
+		return;
+	}
+
+	EmitInt(FindPlane(l, n->plane), fp);
+	EmitInt(n->children[1]->nodenumber - n->nodenumber, fp);
+
+	EmitImplicitNode(l, n->children[0], fp);
+	EmitImplicitNode(l, n->children[1], fp);
+}
+
+static void EmitImplicitNodeBlocks(bsptree_t *tree, FILE *fp)
+{
+	layout_t l;
+	memset(&l, 0, sizeof(l));
+
+	l.planes = (plane_t*)Malloc(tree->numnodes * sizeof(plane_t));
+
+	// the records are numbered the way the node block would be, and the leaf
+	// records reference the output area numbers
+	NumberNodesRecursive(tree->root, 0);
+	NumberAreasRecursive(tree->areas, 0);
+
+	// the plane numbers are fixed before any node references them
+	AddImplicitPlanes(&l, tree->root);
+
+	Message("Implicit nodes: %i records, %i planes\n", tree->numnodes, l.numplanes);
+
+	EmitHeader("planes", fp);
+	EmitInt(l.numplanes, fp);
+	for (int i = 0; i < l.numplanes; i++)
+		EmitPlane(l.planes[i], fp);
+
+	EmitHeader("inodes", fp);
+	EmitInt(tree->numnodes, fp);
+	EmitBox3(tree->root->box, fp);
+	EmitImplicitNode(&l, tree->root, fp);
+
+	FreeLayoutPlanes(&l);
+	Free(l.planes);
+}
+
 static void EmitPortalBlock(bsptree_t *tree, FILE *fp)
 {
 	EmitHeader("portals", fp);
@@ -281,12 +598,10 @@ static void EmitAreaRenderModels(bsptree_t *tree, FILE *fp)
 		EmitAreaRenderModel(a, fp);
 }
 
-static void EmitStaticRenderModel(smodel_t *m, FILE *fp)
+static void EmitStaticRenderModel(smodel_t *m, int number, FILE *fp)
 {
-	static int count = 0;
-
 	EmitHeader("rmodel", fp);
-	EmitString(fp, "staticmodel%04i", count);
+	EmitString(fp, "staticmodel%04i", number);
 	
 	// emit the vertex block
 	EmitInt(m->numvertices, fp);
@@ -308,17 +623,30 @@ static void EmitStaticRenderModel(smodel_t *m, FILE *fp)
 
 static void EmitStaticRenderModels(FILE *fp)
 {
-	for(smodel_t *m = smodels; m; m = m->next)
-		EmitStaticRenderModel(m, fp);
+	int number = 0;
+	for(smodel_t *m = ctx->smodels; m; m = m->next)
+		EmitStaticRenderModel(m, number++, fp);
 }
 
 void WriteBinary(bsptree_t *tree)
 {
-	Message("Writing binary \"%s\"...\n", outputfilename);
+	Message("Writing binary \"%s\"...\n", ctx->outputfilename);
 	
-	FILE *fp = FileOpenBinaryWrite(outputfilename);
+	// kept in the context so a failed compile can close it
+	FILE *fp = ctx->outputfp = FileOpenBinaryWrite(ctx->outputfilename);
 	
-	EmitNodeBlock(tree, fp);
+	// the implicit records replace the node block, the compact lumps go with it
+	if (ctx->options.nodelayout == NODELAYOUT_IMPLICIT)
+	{
+		EmitImplicitNodeBlocks(tree, fp);
+	}
+	else
+	{
+		EmitNodeBlock(tree, fp);
+
+		if (ctx->options.nodelayout != NODELAYOUT_NONE)
+			EmitCompactNodeBlocks(tree, fp);
+	}
 
 	EmitAreaBlock(tree, fp);
 
@@ -327,5 +655,132 @@ void WriteBinary(bsptree_t *tree)
 	EmitAreaRenderModels(tree, fp);
 
 	EmitStaticRenderModels(fp);
+
+	FileClose(fp);
+	ctx->outputfp = NULL;
 }
 
+
+// ________________________________________________________________________________
+// packed models
+//
+// a map with more than one model is written as a directory of the models, a
+// plane pool shared by all of them, then a section per model. A section holds
+// the model's nodes, areas, portals and area render models, numbered within the
+// model, so a loader can seek to one section and read just that model. The
+// node and area ranges number the models one after the other, for a loader
+// that reads them all into one array. The static render models follow the last
+// section
+//
+// models	nummodels, { string name, box3 bounds, int firstnode, numnodes, numleafs, firstarea, numareas, offset, numbytes }
+// planes	numplanes, { float a, b, c, d }
+// mnodes	numnodes, numleafs, { int children[2], planenum, box3 box, int empty }, planenum is -1 for leafs
+
+// the records are written in pre-order, the same as the node numbers
+static void EmitModelNode(layout_t *l, bspnode_t *n, FILE *fp)
+{
+	EmitInt((n->children[0] ? n->children[0]->nodenumber : -1), fp);
+	EmitInt((n->children[1] ? n->children[1]->nodenumber : -1), fp);
+	EmitInt((IsLeaf(n) ? -1 : FindPlane(l, n->plane)), fp);
+	EmitBox3(n->box, fp);
+	EmitInt(n->empty ? 1 : 0, fp);
+
+	if (IsLeaf(n))
+		return;
+
+	EmitModelNode(l, n->children[0], fp);
+	EmitModelNode(l, n->children[1], fp);
+}
+
+static void EmitModelSection(layout_t *l, bsptree_t *tree, FILE *fp)
+{
+	EmitHeader("mnodes", fp);
+	EmitInt(tree->numnodes, fp);
+	EmitInt(tree->numleafs, fp);
+	EmitModelNode(l, tree->root, fp);
+
+	EmitAreaBlock(tree, fp);
+
+	EmitPortalBlock(tree, fp);
+
+	EmitAreaRenderModels(tree, fp);
+}
+
+void WritePackedBinary()
+{
+	Message("Writing %i models to \"%s\"...\n", ctx->nummodels, ctx->outputfilename);
+
+	if (ctx->options.nodelayout != NODELAYOUT_NONE)
+		Warning("Compact node lumps aren't written for packed models, the model nodes index the shared planes\n");
+
+	FILE *fp = ctx->outputfp = FileOpenBinaryWrite(ctx->outputfilename);
+
+	layout_t l;
+	memset(&l, 0, sizeof(l));
+
+	int numnodes = 0;
+	for (mapmodel_t *m = ctx->models; m; m = m->next)
+		numnodes += m->tree->numnodes;
+	l.planes = (plane_t*)Malloc(numnodes * sizeof(plane_t));
+
+	long *sectionpos = (long*)Malloc(ctx->nummodels * sizeof(long));
+
+	// the directory, with the section offsets filled in once they're written
+	EmitHeader("models", fp);
+	EmitInt(ctx->nummodels, fp);
+
+	int firstnode = 0;
+	int firstarea = 0;
+	int i = 0;
+	for (mapmodel_t *m = ctx->models; m; m = m->next, i++)
+	{
+		bsptree_t *tree = m->tree;
+
+		NumberNodesRecursive(tree->root, 0);
+		AddImplicitPlanes(&l, tree->root);
+
+		EmitString(fp, "%s", m->name);
+		EmitBox3(tree->root->box, fp);
+		EmitInt(firstnode, fp);
+		EmitInt(tree->numnodes, fp);
+		EmitInt(tree->numleafs, fp);
+		EmitInt(firstarea, fp);
+		EmitInt(tree->numareas, fp);
+
+		sectionpos[i] = ftell(fp);
+		EmitInt(0, fp);
+		EmitInt(0, fp);
+
+		firstnode += tree->numnodes;
+		firstarea += tree->numareas;
+	}
+
+	Message("Packed models: %i nodes, %i areas, %i shared planes\n", firstnode, firstarea, l.numplanes);
+
+	EmitHeader("planes", fp);
+	EmitInt(l.numplanes, fp);
+	for (int i = 0; i < l.numplanes; i++)
+		EmitPlane(l.planes[i], fp);
+
+	i = 0;
+	for (mapmodel_t *m = ctx->models; m; m = m->next, i++)
+	{
+		long offset = ftell(fp);
+		EmitModelSection(&l, m->tree, fp);
+		long end = ftell(fp);
+
+		fseek(fp, sectionpos[i], SEEK_SET);
+		EmitInt((int)offset, fp);
+		EmitInt((int)(end - offset), fp);
+		fseek(fp, end, SEEK_SET);
+	}
+
+	EmitStaticRenderModels(fp);
+
+	FileClose(fp);
+	ctx->outputfp = NULL;
+
+	FreeLayoutPlanes(&l);
+	Free(l.planes);
+	Free(sectionpos);
+}
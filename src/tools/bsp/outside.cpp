@@ -0,0 +1,282 @@
+#include "bsp.h"
+
+// ==============================================
+// Outside fill
+// the void around the map is the leafs that aren't empty and can be reached
+// from beyond the map's bounds without going through a face. They're marked
+// outside, their portals are dropped and they're left out of the areas, so
+// none of it is written. A portal from the void into an empty leaf that the
+// faces in its plane don't cover is a leak. A leaking map is kept whole, and
+// the path the fill took to the opening is written to the leak file, a point
+// per line, for the editor to draw
+
+// narrowest opening counted as a leak. The faces of a polygon soup map don't
+// always quite meet, and the seams between them aren't holes
+#define LEAK_WIDTH_EPSILON	1.0f
+
+#define NORMAL_EPSILON		0.0001f
+
+typedef struct fillleaf_s
+{
+	bspnode_t	*leaf;
+
+	// where the fill came from, -1 for the leaf it started in
+	int		from;
+	portal_t	*portal;
+
+} fillleaf_t;
+
+static bspnode_t *PointLeaf(bspnode_t *n, vec3 p)
+{
+	// points on the plane go down the front side
+	while (n->children[0])
+		n = n->children[(Distance(n->plane, p) >= 0.0f ? 0 : 1)];
+
+	return n;
+}
+
+// structural faces in the plane, facing either way
+static bool FaceInPlane(mapface_t *f, plane_t plane)
+{
+	if (f->areahint || f->detail)
+		return false;
+
+	float dot = Dot(plane.GetNormal(), f->plane.GetNormal());
+	if (fabs(dot) < 1.0f - NORMAL_EPSILON)
+		return false;
+
+	float distance = (dot > 0.0f ? f->plane.GetDistance() : -f->plane.GetDistance());
+
+	return fabs(distance - plane.GetDistance()) < PLANAR_EPSILON;
+}
+
+// the plane through an edge of the polygon, at right angles to it, with the
+// polygon behind it. Returns false for an edge too short to have a direction
+static bool EdgePlane(polygon_t *p, vec3 normal, int edge, plane_t *plane)
+{
+	vec3 v0 = p->vertices[edge];
+	vec3 v1 = p->vertices[(edge + 1) % p->numvertices];
+
+	vec3 n = Cross(v1 - v0, normal);
+	if (Length(n) < NORMAL_EPSILON)
+		return false;
+
+	n = Normalize(n);
+	*plane = plane_t(n, -Dot(n, v0));
+
+	if (Distance(*plane, Polygon_Centroid(p)) > 0.0f)
+		*plane = -*plane;
+
+	return true;
+}
+
+// about the width of a long thin polygon, exact for a circle
+static float PolygonWidth(polygon_t *p)
+{
+	float perimeter = 0.0f;
+	for (int i = 0; i < p->numvertices; i++)
+		perimeter += Length(p->vertices[(i + 1) % p->numvertices] - p->vertices[i]);
+
+	if (perimeter <= 0.0f)
+		return 0.0f;
+
+	// Polygon_Area is twice the area
+	return Polygon_Area(p) / perimeter;
+}
+
+// the first piece of p the faces from f on don't cover, NULL if it's covered.
+// The pieces outside each face's edges are passed on to the faces after it
+static polygon_t *UncoveredPiece(polygon_t *p, mapface_t *f, plane_t plane)
+{
+	for (; f; f = f->next)
+	{
+		if (FaceInPlane(f, plane))
+			break;
+	}
+
+	if (!f)
+		return (PolygonWidth(p) > LEAK_WIDTH_EPSILON ? p : NULL);
+
+	vec3 normal = Polygon_Normal(f->polygon);
+	polygon_t *inside = p;
+
+	for (int i = 0; i < f->polygon->numvertices && inside; i++)
+	{
+		plane_t edgeplane;
+		if (!EdgePlane(f->polygon, normal, i, &edgeplane))
+			continue;
+
+		polygon_t *front, *back;
+		Polygon_SplitWithPlane(inside, edgeplane, CLIP_EPSILON, &front, &back);
+
+		if (front)
+		{
+			polygon_t *uncovered = UncoveredPiece(front, f->next, plane);
+			if (uncovered)
+				return uncovered;
+		}
+
+		inside = back;
+	}
+
+	// the rest is under the face
+	return NULL;
+}
+
+// from the start of the fill, through the centre of each portal it crossed, to
+// the middle of the opening
+static void TraceLeak(bsptree_t *tree, fillleaf_t *fill, int leaf, vec3 start, polygon_t *opening)
+{
+	int numsteps = 0;
+	for (int i = leaf; fill[i].from != -1; i = fill[i].from)
+		numsteps++;
+
+	tree->leakpoints = (vec3*)Malloc((numsteps + 2) * sizeof(vec3));
+	tree->numleakpoints = numsteps + 2;
+
+	// the steps are found from the leak back
+	int step = numsteps;
+	for (int i = leaf; fill[i].from != -1; i = fill[i].from)
+		tree->leakpoints[step--] = Polygon_Centroid(fill[i].portal->polygon);
+
+	tree->leakpoints[0] = start;
+	tree->leakpoints[numsteps + 1] = Polygon_Centroid(opening);
+}
+
+// drop the portals into and out of the void from the tree and leaf lists,
+// keeping the rest in order
+void DiscardOutsidePortals(bsptree_t *tree)
+{
+	portal_t **p = &tree->portals;
+	while (*p)
+	{
+		if ((*p)->srcleaf->outside || (*p)->dstleaf->outside)
+		{
+			*p = (*p)->treenext;
+			tree->numportals--;
+		}
+		else
+		{
+			p = &(*p)->treenext;
+		}
+	}
+
+	for (bspnode_t *l = tree->leafs; l; l = l->leafnext)
+	{
+		p = &l->portals;
+		while (*p)
+		{
+			if ((*p)->srcleaf->outside || (*p)->dstleaf->outside)
+			{
+				*p = (*p)->leafnext;
+				l->numportals--;
+			}
+			else
+			{
+				p = &(*p)->leafnext;
+			}
+		}
+	}
+}
+
+void WriteLeakFile(bsptree_t *tree)
+{
+	if (!ctx->leakfilename[0])
+		return;
+
+	if (!tree->leaked)
+	{
+		// the trace of a leak that's been fixed
+		remove(ctx->leakfilename);
+		return;
+	}
+
+	FILE *fp = fopen(ctx->leakfilename, "w");
+	if (!fp)
+	{
+		Warning("Failed to write leak trace \"%s\"\n", ctx->leakfilename);
+		return;
+	}
+
+	for (int i = 0; i < tree->numleakpoints; i++)
+		fprintf(fp, "%f %f %f\n", tree->leakpoints[i][0], tree->leakpoints[i][1], tree->leakpoints[i][2]);
+
+	fclose(fp);
+
+	Warning("Map leaks, the void reaches an empty leaf. The trace is in \"%s\"\n", ctx->leakfilename);
+}
+
+void FillOutside(bsptree_t *tree)
+{
+	Message("Filling outside\n");
+
+	// past the corner of the root box is past every face
+	vec3 start = tree->root->box.max;
+
+	fillleaf_t *fill = (fillleaf_t*)Malloc(tree->numleafs * sizeof(fillleaf_t));
+	int numfill = 0;
+
+	bspnode_t *leaf = PointLeaf(tree->root, start);
+	if (leaf->empty)
+	{
+		// there's no void, the empty space goes on past the faces
+		tree->leaked = true;
+		tree->leakpoints = (vec3*)Malloc(sizeof(vec3));
+		tree->leakpoints[0] = start;
+		tree->numleakpoints = 1;
+	}
+	else
+	{
+		leaf->outside = true;
+		fill[numfill].leaf = leaf;
+		fill[numfill].from = -1;
+		fill[numfill].portal = NULL;
+		numfill++;
+	}
+
+	// breadth first, so the leak trace is short
+	for (int i = 0; i < numfill && !tree->leaked; i++)
+	{
+		for (portal_t *p = fill[i].leaf->portals; p; p = p->leafnext)
+		{
+			bspnode_t *next = p->dstleaf;
+			if (next->outside)
+				continue;
+
+			if (next->empty)
+			{
+				polygon_t *opening = UncoveredPiece(p->polygon, ctx->mapdata.faces, Polygon_Plane(p->polygon));
+				if (!opening)
+					continue;
+
+				tree->leaked = true;
+				TraceLeak(tree, fill, i, start, opening);
+				break;
+			}
+
+			next->outside = true;
+			fill[numfill].leaf = next;
+			fill[numfill].from = i;
+			fill[numfill].portal = p;
+			numfill++;
+		}
+	}
+
+	if (tree->leaked)
+	{
+		for (int i = 0; i < numfill; i++)
+			fill[i].leaf->outside = false;
+	}
+	else
+	{
+		tree->numoutsideleafs = numfill;
+		DiscardOutsidePortals(tree);
+	}
+
+	Free(fill);
+
+	WriteLeakFile(tree);
+
+	Message("%i outside leafs\n", tree->numoutsideleafs);
+	Message("%i portals after the outside fill\n", tree->numportals);
+}
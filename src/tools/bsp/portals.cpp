@@ -95,7 +95,7 @@ static polygon_t *PolygonForPlane(plane_t plane, float usize, float vsize)
 	return p;
 }
 
-static void AddPortalToLeaf(bsptree_t *tree, bspnode_t *srcleaf, polygon_t *polygon, bspnode_t *dstleaf, bool areahint)
+void AddPortalToLeaf(bsptree_t *tree, bspnode_t *srcleaf, polygon_t *polygon, bspnode_t *dstleaf, bool areahint)
 {
 	portal_t *portal;
 	
@@ -117,7 +117,7 @@ static void AddPortalToLeaf(bsptree_t *tree, bspnode_t *srcleaf, polygon_t *poly
 	tree->numportals++;
 }
 
-static void PushPortalIntoTreeRecursive(bsptree_t *tree, bspnode_t *node, polygon_t *polygon, bspnode_t *srcleaf, bool areahint)
+static void PushPortalIntoTreeRecursive(bsptree_t *tree, bspnode_t *node, walkpolygon_t *polygon, bspnode_t *srcleaf, bool areahint)
 {
 	if (!node->children[0] && !node->children[1])
 	{
@@ -127,12 +127,13 @@ static void PushPortalIntoTreeRecursive(bsptree_t *tree, bspnode_t *node, polygo
 		
 		// this portal has landed in a leaf node that's not the leaf the source portal came from
 		// this means a connection exists from srcleaf to this node
-		AddPortalToLeaf(tree, srcleaf, polygon, node, areahint);
+		AddPortalToLeaf(tree, srcleaf, polygon->polygon, node, areahint);
 
 		return;
 	}
 	
-	int side = Polygon_OnPlaneSide(polygon, node->plane, CLIP_EPSILON);
+	polygonsides_t sides;
+	int side = WalkPolygonSide(polygon, node->plane, &sides);
 	
 	if (side == PLANE_SIDE_FRONT)
 		PushPortalIntoTreeRecursive(tree, node->children[0], polygon, srcleaf, areahint);
@@ -140,18 +141,20 @@ static void PushPortalIntoTreeRecursive(bsptree_t *tree, bspnode_t *node, polygo
 		PushPortalIntoTreeRecursive(tree, node->children[1], polygon, srcleaf, areahint);
 	else if (side == PLANE_SIDE_ON)
 	{
-		polygon_t *f, *b;
-		f = Polygon_Copy(polygon);
-		b = Polygon_Copy(polygon);
-		PushPortalIntoTreeRecursive(tree, node->children[0], f, srcleaf, areahint);
-		PushPortalIntoTreeRecursive(tree, node->children[1], b, srcleaf, areahint);
+		walkpolygon_t f, b;
+		f = *polygon;
+		b = *polygon;
+		f.polygon = Polygon_Copy(polygon->polygon);
+		b.polygon = Polygon_Copy(polygon->polygon);
+		PushPortalIntoTreeRecursive(tree, node->children[0], &f, srcleaf, areahint);
+		PushPortalIntoTreeRecursive(tree, node->children[1], &b, srcleaf, areahint);
 	}
 	else if (side == PLANE_SIDE_CROSS)
 	{
-		polygon_t *f, *b;
-		Polygon_SplitWithPlane(polygon, node->plane, CLIP_EPSILON, &f, &b);
-		PushPortalIntoTreeRecursive(tree, node->children[0], f, srcleaf, areahint);
-		PushPortalIntoTreeRecursive(tree, node->children[1], b, srcleaf, areahint);
+		walkpolygon_t f, b;
+		WalkSplitPolygon(polygon, node->plane, &sides, &f, &b);
+		PushPortalIntoTreeRecursive(tree, node->children[0], &f, srcleaf, areahint);
+		PushPortalIntoTreeRecursive(tree, node->children[1], &b, srcleaf, areahint);
 	}
 }
 
@@ -161,7 +164,8 @@ static void PushPortalIntoTree(bsptree_t *tree, polygon_t *polygon, bspnode_t *s
 	if (!polygon)
 		return;
 
-	PushPortalIntoTreeRecursive(tree, tree->root, polygon, srcleaf, areahint);
+	walkpolygon_t w = WalkPolygon(polygon);
+	PushPortalIntoTreeRecursive(tree, tree->root, &w, srcleaf, areahint);
 }
 
 // walk up the tree from leaf to root and clip the polygon in place
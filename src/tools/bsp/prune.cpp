@@ -0,0 +1,368 @@
+#include "bsp.h"
+
+// ==============================================
+// Tree pruning
+// the tree is split until the faces run out, which leaves sibling leafs that
+// are the same, both solid or both empty in the same area. Each such pair is
+// folded into its parent from the bottom up. The portals between the pair are
+// dropped, and the portals they had into the same leaf in the same plane are
+// joined into one. The leafs and portals that are left cover the same space as
+// before, so what a point or a trace finds doesn't change
+
+#define NORMAL_EPSILON		0.0001f
+
+// twice the area of the thinnest corner kept when portals are joined
+#define CORNER_EPSILON		0.01f
+
+static bool SameLeafs(bspnode_t *a, bspnode_t *b)
+{
+	if (a->children[0] || b->children[0])
+		return false;
+
+	return (a->empty == b->empty && a->outside == b->outside && a->area == b->area);
+}
+
+// returns the number of nodes folded into leafs
+static int PruneNode(bspnode_t *n)
+{
+	if (!n->children[0])
+		return 0;
+
+	int numpruned = PruneNode(n->children[0]) + PruneNode(n->children[1]);
+
+	bspnode_t *leaf = n->children[0];
+	if (!SameLeafs(leaf, n->children[1]))
+		return numpruned;
+
+	n->empty = leaf->empty;
+	n->outside = leaf->outside;
+	n->area = leaf->area;
+
+	n->children[0] = NULL;
+	n->children[1] = NULL;
+	n->plane = plane_t(0.0f, 0.0f, 0.0f, 0.0f);
+	n->areahint = false;
+
+	return numpruned + 1;
+}
+
+// the leaf a node ended up in, itself if it wasn't pruned
+static bspnode_t *PrunedLeaf(bspnode_t *n)
+{
+	while (n->parent && !n->parent->children[0])
+		n = n->parent;
+
+	return n;
+}
+
+// ==============================================
+// relinking
+// the pruned nodes are taken out of the lists and the leafs they were folded
+// into take the place of the first of them. nodenumber marks the leafs already
+// relinked, it's numbered again when the tree is written
+
+static void RelinkNodes(bsptree_t *tree)
+{
+	bspnode_t **n = &tree->nodes;
+	while (*n)
+	{
+		if (PrunedLeaf(*n) != *n)
+		{
+			*n = (*n)->treenext;
+			tree->numnodes--;
+		}
+		else
+		{
+			(*n)->nodenumber = 0;
+			n = &(*n)->treenext;
+		}
+	}
+}
+
+static void RelinkLeafs(bsptree_t *tree)
+{
+	bspnode_t *leafs = tree->leafs;
+	bspnode_t **tail = &tree->leafs;
+	tree->numleafs = 0;
+
+	for (bspnode_t *l = leafs, *next; l; l = next)
+	{
+		next = l->leafnext;
+
+		bspnode_t *leaf = PrunedLeaf(l);
+		if (leaf->nodenumber)
+			continue;
+
+		leaf->nodenumber = 1;
+		*tail = leaf;
+		tail = &leaf->leafnext;
+		tree->numleafs++;
+	}
+
+	*tail = NULL;
+}
+
+static void RelinkAreaLeafs(bsptree_t *tree)
+{
+	for (bspnode_t *l = tree->leafs; l; l = l->leafnext)
+		l->nodenumber = 0;
+
+	for (area_t *a = tree->areas; a; a = a->next)
+	{
+		bspnode_t *leafs = a->leafs;
+		bspnode_t **tail = &a->leafs;
+		a->numleafs = 0;
+
+		for (bspnode_t *l = leafs, *next; l; l = next)
+		{
+			next = l->areanext;
+
+			bspnode_t *leaf = PrunedLeaf(l);
+			if (leaf->nodenumber)
+				continue;
+
+			leaf->nodenumber = 1;
+			*tail = leaf;
+			tail = &leaf->areanext;
+			a->numleafs++;
+		}
+
+		*tail = NULL;
+	}
+}
+
+// ==============================================
+// portal joining
+
+static bool SamePlane(plane_t a, plane_t b)
+{
+	if (Dot(a.GetNormal(), b.GetNormal()) < 1.0f - NORMAL_EPSILON)
+		return false;
+
+	return fabs(a.GetDistance() - b.GetDistance()) < PLANAR_EPSILON;
+}
+
+static float Cross2(vec3 o, vec3 a, vec3 b, int u, int v)
+{
+	return (a[u] - o[u]) * (b[v] - o[v]) - (a[v] - o[v]) * (b[u] - o[u]);
+}
+
+// the convex hull of two polygons in the same plane, wound the way a is. Two
+// portals between the same convex leafs in one plane are pieces of the convex
+// face the leafs share, so the hull is just the two of them. NULL if the hull
+// has no area
+static polygon_t *JoinPolygons(polygon_t *a, polygon_t *b)
+{
+	vec3 area = Polygon_AreaVector(a);
+
+	// drop the axis the plane faces most along
+	int axis = 0;
+	for (int i = 1; i < 3; i++)
+	{
+		if (fabs(area[i]) > fabs(area[axis]))
+			axis = i;
+	}
+	int u = (axis + 1) % 3;
+	int v = (axis + 2) % 3;
+
+	int numpoints = a->numvertices + b->numvertices;
+	vec3 *points = (vec3*)Malloc(numpoints * sizeof(vec3));
+	for (int i = 0; i < a->numvertices; i++)
+		points[i] = a->vertices[i];
+	for (int i = 0; i < b->numvertices; i++)
+		points[a->numvertices + i] = b->vertices[i];
+
+	// sort along u then v
+	for (int i = 1; i < numpoints; i++)
+	{
+		vec3 p = points[i];
+		int j = i - 1;
+		for (; j >= 0 && (points[j][u] > p[u] || (points[j][u] == p[u] && points[j][v] > p[v])); j--)
+			points[j + 1] = points[j];
+		points[j + 1] = p;
+	}
+
+	// monotone chain, lower hull then upper, dropping the corners that don't turn
+	vec3 *hull = (vec3*)Malloc(2 * numpoints * sizeof(vec3));
+	int numhull = 0;
+	for (int i = 0; i < numpoints; i++)
+	{
+		while (numhull >= 2 && Cross2(hull[numhull - 2], hull[numhull - 1], points[i], u, v) <= CORNER_EPSILON)
+			numhull--;
+		hull[numhull++] = points[i];
+	}
+	for (int i = numpoints - 2, lower = numhull + 1; i >= 0; i--)
+	{
+		while (numhull >= lower && Cross2(hull[numhull - 2], hull[numhull - 1], points[i], u, v) <= CORNER_EPSILON)
+			numhull--;
+		hull[numhull++] = points[i];
+	}
+
+	// the last point is the first again
+	numhull--;
+	if (numhull < 3)
+	{
+		Free(hull);
+		Free(points);
+		return NULL;
+	}
+
+	polygon_t *p = Polygon_Alloc(numhull);
+	p->numvertices = numhull;
+
+	// the hull winds counter clockwise about the dropped axis
+	bool reverse = (area[axis] < 0.0f);
+	for (int i = 0; i < numhull; i++)
+		p->vertices[i] = hull[(reverse ? numhull - 1 - i : i)];
+
+	Free(hull);
+	Free(points);
+
+	return p;
+}
+
+// returns the number of portals joined into others
+static int JoinPortals(bsptree_t *tree)
+{
+	int numjoined = 0;
+
+	for (bspnode_t *l = tree->leafs; l; l = l->leafnext)
+	{
+		for (portal_t *p = l->portals; p; p = p->leafnext)
+		{
+			if (!p->srcleaf)
+				continue;
+
+			plane_t plane = Polygon_Plane(p->polygon);
+
+			for (portal_t *q = p->leafnext; q; q = q->leafnext)
+			{
+				if (!q->srcleaf || q->dstleaf != p->dstleaf || q->areahint != p->areahint)
+					continue;
+				if (!SamePlane(plane, Polygon_Plane(q->polygon)))
+					continue;
+
+				polygon_t *joined = JoinPolygons(p->polygon, q->polygon);
+				if (!joined)
+					continue;
+
+				p->polygon = joined;
+
+				// taken out of the lists below
+				q->srcleaf = NULL;
+				numjoined++;
+			}
+		}
+	}
+
+	return numjoined;
+}
+
+static void RelinkPortals(bsptree_t *tree)
+{
+	// move the portals of the pruned leafs onto the leafs they were folded
+	// into, dropping the ones that now lead back into the same leaf
+	portal_t **p = &tree->portals;
+	while (*p)
+	{
+		(*p)->srcleaf = PrunedLeaf((*p)->srcleaf);
+		(*p)->dstleaf = PrunedLeaf((*p)->dstleaf);
+
+		if ((*p)->srcleaf == (*p)->dstleaf)
+		{
+			*p = (*p)->treenext;
+			tree->numportals--;
+		}
+		else
+		{
+			p = &(*p)->treenext;
+		}
+	}
+
+	// the leaf lists are newest first like the tree list, so they're built
+	// from the oldest portal up
+	portal_t **portals = (portal_t**)Malloc(tree->numportals * sizeof(portal_t*));
+	int numportals = 0;
+	for (portal_t *portal = tree->portals; portal; portal = portal->treenext)
+		portals[numportals++] = portal;
+
+	for (bspnode_t *l = tree->leafs; l; l = l->leafnext)
+	{
+		l->portals = NULL;
+		l->numportals = 0;
+	}
+
+	for (int i = numportals - 1; i >= 0; i--)
+	{
+		portal_t *portal = portals[i];
+		portal->leafnext = portal->srcleaf->portals;
+		portal->srcleaf->portals = portal;
+		portal->srcleaf->numportals++;
+	}
+
+	Free(portals);
+
+	if (!JoinPortals(tree))
+		return;
+
+	p = &tree->portals;
+	while (*p)
+	{
+		if (!(*p)->srcleaf)
+		{
+			*p = (*p)->treenext;
+			tree->numportals--;
+		}
+		else
+		{
+			p = &(*p)->treenext;
+		}
+	}
+
+	for (bspnode_t *l = tree->leafs; l; l = l->leafnext)
+	{
+		p = &l->portals;
+		while (*p)
+		{
+			if (!(*p)->srcleaf)
+			{
+				*p = (*p)->leafnext;
+				l->numportals--;
+			}
+			else
+			{
+				p = &(*p)->leafnext;
+			}
+		}
+	}
+}
+
+void PruneTree(bsptree_t *tree)
+{
+	Message("Pruning tree\n");
+
+	int numnodes = tree->numnodes;
+	int numportals = tree->numportals;
+
+	if (PruneNode(tree->root))
+	{
+		RelinkNodes(tree);
+		RelinkLeafs(tree);
+		RelinkAreaLeafs(tree);
+		RelinkPortals(tree);
+
+		// the area portal lists are made again from the portals left
+		for (area_t *a = tree->areas; a; a = a->next)
+		{
+			a->portals = NULL;
+			a->numportals = 0;
+		}
+		AddPortalsToAreas(tree);
+	}
+
+	tree->numprunednodes = numnodes - tree->numnodes;
+	tree->numprunedportals = numportals - tree->numportals;
+
+	Message("%i nodes, %i leafs after pruning %i nodes\n", tree->numnodes, tree->numleafs, tree->numprunednodes);
+	Message("%i portals after pruning %i portals\n", tree->numportals, tree->numprunedportals);
+}
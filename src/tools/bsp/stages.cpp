@@ -0,0 +1,612 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bsp.h"
+
+// ==============================================
+// Stage cache
+// the tree, the empty leafs, the portals, the outside fill and the areas of a
+// model are saved as each stage finishes, to a directory of files named by
+// their key. The first stage is keyed by the structural faces and the epsilons,
+// and each stage after it by the key of the one before and its own version, so
+// a change to the map or to a stage misses that stage and every one after it. A
+// compile rebuilds the saved stages in the order a clean build made them, so
+// the lists come out the same and so does the output. The area surfaces and the
+// output aren't saved, so changes to them, or to the detail faces, skip
+// everything before
+//
+// stage file	"bspstage", int version, u64 key, int stage, stage data
+// tree		float rootbox[6], int numnodes, { int flags, [float plane[4]] } in pre-order
+// empty	int numnodes, { char empty } in pre-order
+// portals	int numportals, { int srcleaf, dstleaf, areahint, numvertices, { float xyz[3] } }
+// outside	int numnodes, { char outside } in pre-order, int leaked, numleakpoints, { float xyz[3] }
+// areas	int numareas, numemptyareas, { int numleafs, { int leaf } }
+//
+// portals, areas and the leafs of an area are in the order they were made.
+// Nodes are numbered in pre-order in nodenumber while a stage is saved or
+// loaded, the output numbers them again
+
+#define STAGE_FILE_VERSION	1
+
+#define STAGENODE_SPLIT		1
+#define STAGENODE_AREAHINT	2
+
+// bump the version of a stage when its output changes
+static const char	*stagenames[NUM_STAGES] = { "none", "tree", "empty", "portals", "outside", "areas" };
+static const int	stageversions[NUM_STAGES] = { 0, 1, 1, 1, 1, 1 };
+
+static void StageKeys(cachekey_t *keys)
+{
+	cachekey_t key = CACHE_KEY_SEED;
+
+	float epsilons[4] = { CLIP_EPSILON, PLANAR_EPSILON, AREA_EPSILON, MAX_VERTEX_SIZE };
+	key = HashBytes(key, epsilons, sizeof(epsilons));
+
+	int optimizetree = (ctx->options.optimizetree ? 1 : 0);
+	key = HashBytes(key, &optimizetree, sizeof(optimizetree));
+	key = HashBytes(key, ctx->options.splitweights, sizeof(ctx->options.splitweights));
+	int preview = (ctx->options.preview ? 1 : 0);
+	key = HashBytes(key, &preview, sizeof(preview));
+
+	// the stages don't depend on the detail faces
+	for (mapface_t *f = ctx->mapdata.faces; f; f = f->next)
+	{
+		if (f->detail)
+			continue;
+
+		int areahint = (f->areahint ? 1 : 0);
+		key = HashBytes(key, &areahint, sizeof(areahint));
+		key = HashPolygon(key, f->polygon);
+	}
+
+	keys[STAGE_NONE] = key;
+	for (int i = STAGE_TREE; i < NUM_STAGES; i++)
+	{
+		keys[i] = HashBytes(keys[i - 1], &i, sizeof(i));
+		keys[i] = HashBytes(keys[i], &stageversions[i], sizeof(int));
+	}
+}
+
+static void StageFilename(char *filename, int size, int stage)
+{
+	snprintf(filename, size, "%s/%016llx.%s", ctx->options.stagecache, ctx->stagekeys[stage], stagenames[stage]);
+}
+
+static int NumberNodesRecursive(bspnode_t *n, bspnode_t **nodes, int number)
+{
+	n->nodenumber = number;
+	nodes[number++] = n;
+
+	if (n->children[0])
+	{
+		number = NumberNodesRecursive(n->children[0], nodes, number);
+		number = NumberNodesRecursive(n->children[1], nodes, number);
+	}
+
+	return number;
+}
+
+// the nodes of the tree in pre-order
+static bspnode_t **NumberNodes(bsptree_t *tree)
+{
+	bspnode_t **nodes = (bspnode_t**)Malloc(tree->numnodes * sizeof(bspnode_t*));
+	NumberNodesRecursive(tree->root, nodes, 0);
+
+	return nodes;
+}
+
+// ==============================================
+// Saving
+
+static void WriteInt(int i, FILE *fp)
+{
+	fwrite(&i, sizeof(int), 1, fp);
+}
+
+static void WriteTreeNodes(bspnode_t *n, FILE *fp)
+{
+	int flags = (n->children[0] ? STAGENODE_SPLIT : 0) | (n->areahint ? STAGENODE_AREAHINT : 0);
+	WriteInt(flags, fp);
+
+	if (!n->children[0])
+		return;
+
+	float plane[4] = { n->plane[0], n->plane[1], n->plane[2], n->plane[3] };
+	fwrite(plane, sizeof(plane), 1, fp);
+
+	WriteTreeNodes(n->children[0], fp);
+	WriteTreeNodes(n->children[1], fp);
+}
+
+static void WriteTreeStage(bsptree_t *tree, FILE *fp)
+{
+	box3 box = tree->root->box;
+	float bounds[6] = { box.min[0], box.min[1], box.min[2], box.max[0], box.max[1], box.max[2] };
+	fwrite(bounds, sizeof(bounds), 1, fp);
+
+	WriteInt(tree->numnodes, fp);
+	WriteTreeNodes(tree->root, fp);
+}
+
+static void WriteEmptyStage(bsptree_t *tree, bspnode_t **nodes, FILE *fp)
+{
+	WriteInt(tree->numnodes, fp);
+	for (int i = 0; i < tree->numnodes; i++)
+	{
+		char empty = (nodes[i]->empty ? 1 : 0);
+		fwrite(&empty, 1, 1, fp);
+	}
+}
+
+static void WritePortalStage(bsptree_t *tree, FILE *fp)
+{
+	// the tree list is newest first
+	portal_t **portals = (portal_t**)Malloc((tree->numportals + 1) * sizeof(portal_t*));
+	int numportals = 0;
+	for (portal_t *p = tree->portals; p; p = p->treenext)
+		portals[numportals++] = p;
+
+	WriteInt(numportals, fp);
+	for (int i = numportals - 1; i >= 0; i--)
+	{
+		portal_t *p = portals[i];
+
+		WriteInt(p->srcleaf->nodenumber, fp);
+		WriteInt(p->dstleaf->nodenumber, fp);
+		WriteInt((p->areahint ? 1 : 0), fp);
+		WriteInt(p->polygon->numvertices, fp);
+		for (int j = 0; j < p->polygon->numvertices; j++)
+			fwrite(&p->polygon->vertices[j][0], sizeof(float), 3, fp);
+	}
+
+	Free(portals);
+}
+
+static void WriteOutsideStage(bsptree_t *tree, bspnode_t **nodes, FILE *fp)
+{
+	WriteInt(tree->numnodes, fp);
+	for (int i = 0; i < tree->numnodes; i++)
+	{
+		char outside = (nodes[i]->outside ? 1 : 0);
+		fwrite(&outside, 1, 1, fp);
+	}
+
+	WriteInt((tree->leaked ? 1 : 0), fp);
+	WriteInt(tree->numleakpoints, fp);
+	for (int i = 0; i < tree->numleakpoints; i++)
+		fwrite(&tree->leakpoints[i][0], sizeof(float), 3, fp);
+}
+
+static void WriteAreaStage(bsptree_t *tree, FILE *fp)
+{
+	// the area and leaf lists are newest first
+	area_t **areas = (area_t**)Malloc((tree->numareas + 1) * sizeof(area_t*));
+	bspnode_t **leafs = (bspnode_t**)Malloc((tree->numleafs + 1) * sizeof(bspnode_t*));
+
+	int numareas = 0;
+	for (area_t *a = tree->areas; a; a = a->next)
+		areas[numareas++] = a;
+
+	WriteInt(numareas, fp);
+	WriteInt(tree->numemptyareas, fp);
+	for (int i = numareas - 1; i >= 0; i--)
+	{
+		int numleafs = 0;
+		for (bspnode_t *l = areas[i]->leafs; l; l = l->areanext)
+			leafs[numleafs++] = l;
+
+		WriteInt(numleafs, fp);
+		for (int j = numleafs - 1; j >= 0; j--)
+			WriteInt(leafs[j]->nodenumber, fp);
+	}
+
+	Free(leafs);
+	Free(areas);
+}
+
+// written to a temporary file and moved into place, so a stage file is whole
+// even with several compiles saving the same one
+void SaveStage(bsptree_t *tree, int stage)
+{
+	// what a compile over its time budget builds depends on how long it
+	// took, so it isn't kept
+	if (!ctx->options.stagecache || ctx->cheapstages)
+		return;
+
+	char filename[1024], tempfilename[1100];
+	StageFilename(filename, sizeof(filename), stage);
+	snprintf(tempfilename, sizeof(tempfilename), "%s.%i.%p.tmp", filename, (int)getpid(), (void*)ctx);
+
+	FILE *fp = fopen(tempfilename, "wb");
+	if (!fp)
+	{
+		Warning("Failed to write stage \"%s\"\n", tempfilename);
+		return;
+	}
+
+	bspnode_t **nodes = NumberNodes(tree);
+
+	int version = STAGE_FILE_VERSION;
+	fwrite("bspstage", 8, 1, fp);
+	fwrite(&version, sizeof(int), 1, fp);
+	fwrite(&ctx->stagekeys[stage], sizeof(cachekey_t), 1, fp);
+	fwrite(&stage, sizeof(int), 1, fp);
+
+	if (stage == STAGE_TREE)
+		WriteTreeStage(tree, fp);
+	else if (stage == STAGE_EMPTY)
+		WriteEmptyStage(tree, nodes, fp);
+	else if (stage == STAGE_PORTALS)
+		WritePortalStage(tree, fp);
+	else if (stage == STAGE_OUTSIDE)
+		WriteOutsideStage(tree, nodes, fp);
+	else if (stage == STAGE_AREAS)
+		WriteAreaStage(tree, fp);
+
+	Free(nodes);
+
+	bool ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tempfilename, filename))
+	{
+		Warning("Failed to write stage \"%s\"\n", filename);
+		remove(tempfilename);
+	}
+}
+
+// ==============================================
+// Loading
+// a stage is read through once to check it before the tree is changed, so a
+// bad file leaves the tree as the stages before it made it
+
+typedef struct stagereader_s
+{
+	unsigned char	*data;
+	int		numbytes;
+	int		pos;
+	bool		ok;
+
+} stagereader_t;
+
+static void ReadBytes(stagereader_t *r, void *out, int numbytes)
+{
+	if (!r->ok || r->pos + numbytes > r->numbytes)
+	{
+		r->ok = false;
+		memset(out, 0, numbytes);
+		return;
+	}
+
+	memcpy(out, r->data + r->pos, numbytes);
+	r->pos += numbytes;
+}
+
+static int ReadInt(stagereader_t *r)
+{
+	int i;
+	ReadBytes(r, &i, sizeof(int));
+
+	return i;
+}
+
+static bool IsLeaf(bsptree_t *tree, bspnode_t **nodes, int number)
+{
+	return number >= 0 && number < tree->numnodes && !nodes[number]->children[0];
+}
+
+static bool OpenStage(stagereader_t *r, int stage)
+{
+	memset(r, 0, sizeof(*r));
+
+	char filename[1024];
+	StageFilename(filename, sizeof(filename), stage);
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (size > 0 && size < (1 << 30))
+	{
+		r->data = (unsigned char*)Malloc(size);
+		r->numbytes = size;
+		r->ok = (fread(r->data, 1, size, fp) == (size_t)size);
+	}
+
+	fclose(fp);
+
+	char header[8];
+	int version, filestage;
+	cachekey_t key;
+	ReadBytes(r, header, 8);
+	version = ReadInt(r);
+	ReadBytes(r, &key, sizeof(key));
+	filestage = ReadInt(r);
+
+	if (r->ok && strncmp(header, "bspstage", 8) == 0 && version == STAGE_FILE_VERSION && key == ctx->stagekeys[stage] && filestage == stage)
+		return true;
+
+	Warning("Ignoring stage \"%s\", it's from another version or can't be read\n", filename);
+	if (r->data)
+		Free(r->data);
+
+	return false;
+}
+
+static void ReadTreeNodes(stagereader_t *r, bsptree_t *tree, bspnode_t *node)
+{
+	int flags = ReadInt(r);
+	if (!(flags & STAGENODE_SPLIT))
+	{
+		LinkLeaf(tree, node);
+		return;
+	}
+
+	float plane[4];
+	ReadBytes(r, plane, sizeof(plane));
+	SplitNode(tree, node, plane_t(plane[0], plane[1], plane[2], plane[3]), (flags & STAGENODE_AREAHINT) != 0);
+
+	ReadTreeNodes(r, tree, node->children[0]);
+	ReadTreeNodes(r, tree, node->children[1]);
+}
+
+static bsptree_t *ReadTreeStage(stagereader_t *r)
+{
+	float bounds[6];
+	ReadBytes(r, bounds, sizeof(bounds));
+	int numnodes = ReadInt(r);
+
+	// every split opens two more nodes, a whole tree leaves none open
+	int start = r->pos;
+	int open = 1;
+	for (int i = 0; i < numnodes && r->ok && open > 0; i++, open--)
+	{
+		int flags = ReadInt(r);
+		if (flags & STAGENODE_SPLIT)
+		{
+			float plane[4];
+			ReadBytes(r, plane, sizeof(plane));
+			open += 2;
+		}
+	}
+
+	if (!r->ok || open != 0 || r->pos != r->numbytes)
+		return NULL;
+
+	box3 box;
+	box.min = vec3(bounds[0], bounds[1], bounds[2]);
+	box.max = vec3(bounds[3], bounds[4], bounds[5]);
+
+	r->pos = start;
+	bsptree_t *tree = MakeTree(box);
+	ReadTreeNodes(r, tree, tree->root);
+
+	Message("%i nodes\n", tree->numnodes);
+	Message("%i leaves\n", tree->numleafs);
+
+	return tree;
+}
+
+static bool ReadEmptyStage(stagereader_t *r, bsptree_t *tree, bspnode_t **nodes)
+{
+	int numnodes = ReadInt(r);
+	if (!r->ok || numnodes != tree->numnodes || r->pos + numnodes != r->numbytes)
+		return false;
+
+	for (int i = 0; i < numnodes; i++)
+		nodes[i]->empty = (r->data[r->pos + i] != 0);
+
+	return true;
+}
+
+static bool ReadPortalStage(stagereader_t *r, bsptree_t *tree, bspnode_t **nodes)
+{
+	int numportals = ReadInt(r);
+
+	int start = r->pos;
+	for (int i = 0; i < numportals && r->ok; i++)
+	{
+		int srcleaf = ReadInt(r);
+		int dstleaf = ReadInt(r);
+		ReadInt(r);
+		int numvertices = ReadInt(r);
+
+		if (!IsLeaf(tree, nodes, srcleaf) || !IsLeaf(tree, nodes, dstleaf) || numvertices < 3 || numvertices > r->numbytes / (3 * (int)sizeof(float)))
+			return false;
+
+		r->pos += numvertices * 3 * sizeof(float);
+	}
+
+	if (!r->ok || numportals < 0 || r->pos != r->numbytes)
+		return false;
+
+	r->pos = start;
+	for (int i = 0; i < numportals; i++)
+	{
+		bspnode_t *srcleaf = nodes[ReadInt(r)];
+		bspnode_t *dstleaf = nodes[ReadInt(r)];
+		bool areahint = (ReadInt(r) != 0);
+
+		polygon_t *p = Polygon_Alloc(ReadInt(r));
+		p->numvertices = p->maxvertices;
+		for (int j = 0; j < p->numvertices; j++)
+		{
+			float xyz[3];
+			ReadBytes(r, xyz, sizeof(xyz));
+			p->vertices[j] = vec3(xyz[0], xyz[1], xyz[2]);
+		}
+
+		AddPortalToLeaf(tree, srcleaf, p, dstleaf, areahint);
+	}
+
+	Message("%i portals\n", tree->numportals);
+
+	return true;
+}
+
+static bool ReadOutsideStage(stagereader_t *r, bsptree_t *tree, bspnode_t **nodes)
+{
+	int numnodes = ReadInt(r);
+	if (!r->ok || numnodes != tree->numnodes || r->pos + numnodes > r->numbytes)
+		return false;
+
+	const unsigned char *outside = r->data + r->pos;
+	r->pos += numnodes;
+
+	bool leaked = (ReadInt(r) != 0);
+	int numleakpoints = ReadInt(r);
+	if (!r->ok || numleakpoints < 0 || numleakpoints > (r->numbytes - r->pos) / (3 * (int)sizeof(float)))
+		return false;
+	if (r->pos + numleakpoints * 3 * (int)sizeof(float) != r->numbytes)
+		return false;
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		nodes[i]->outside = (outside[i] != 0);
+		tree->numoutsideleafs += (outside[i] ? 1 : 0);
+	}
+
+	tree->leaked = leaked;
+	tree->numleakpoints = numleakpoints;
+	tree->leakpoints = (vec3*)Malloc((numleakpoints + 1) * sizeof(vec3));
+	for (int i = 0; i < numleakpoints; i++)
+	{
+		float xyz[3];
+		ReadBytes(r, xyz, sizeof(xyz));
+		tree->leakpoints[i] = vec3(xyz[0], xyz[1], xyz[2]);
+	}
+
+	DiscardOutsidePortals(tree);
+	WriteLeakFile(tree);
+
+	Message("%i outside leafs\n", tree->numoutsideleafs);
+
+	return true;
+}
+
+static bool ReadAreaStage(stagereader_t *r, bsptree_t *tree, bspnode_t **nodes)
+{
+	int numareas = ReadInt(r);
+	int numemptyareas = ReadInt(r);
+
+	// every leaf but the void is in exactly one area
+	int start = r->pos;
+	int numleafs = 0;
+	for (int i = 0; i < numareas && r->ok; i++)
+	{
+		int count = ReadInt(r);
+		for (int j = 0; j < count && r->ok; j++, numleafs++)
+		{
+			int leaf = ReadInt(r);
+			if (!IsLeaf(tree, nodes, leaf) || nodes[leaf]->area || nodes[leaf]->outside)
+				return false;
+
+			// marked so a second use of the leaf is caught, and cleared below
+			nodes[leaf]->area = (area_t*)tree;
+		}
+	}
+
+	bool ok = r->ok && numareas >= 0 && numemptyareas >= 0 && numemptyareas <= numareas;
+	ok = ok && numleafs == tree->numleafs - tree->numoutsideleafs && r->pos == r->numbytes;
+
+	for (int i = 0; i < tree->numnodes; i++)
+		nodes[i]->area = NULL;
+
+	if (!ok)
+		return false;
+
+	r->pos = start;
+	for (int i = 0; i < numareas; i++)
+	{
+		area_t *a = AllocArea(tree);
+
+		int count = ReadInt(r);
+		for (int j = 0; j < count; j++)
+		{
+			bspnode_t *leaf = nodes[ReadInt(r)];
+
+			leaf->areanext = a->leafs;
+			a->leafs = leaf;
+			a->numleafs++;
+			leaf->area = a;
+		}
+	}
+
+	tree->numemptyareas = numemptyareas;
+
+	AddPortalsToAreas(tree);
+
+	Message("%d areas\n", tree->numareas);
+	Message("%d empty areas\n", tree->numemptyareas);
+
+	return true;
+}
+
+// loads the stages saved by an earlier compile of the same faces, and returns
+// the last one loaded, STAGE_NONE if the tree has to be built
+int LoadStages(bsptree_t **tree)
+{
+	*tree = NULL;
+
+	if (!ctx->options.stagecache)
+		return STAGE_NONE;
+
+	StageKeys(ctx->stagekeys);
+
+	// the debug streams are written by the stages
+	if (ctx->options.debugout)
+		return STAGE_NONE;
+
+	mkdir(ctx->options.stagecache, 0777);
+
+	int stage;
+	bspnode_t **nodes = NULL;
+	for (stage = STAGE_TREE; stage < NUM_STAGES; stage++)
+	{
+		stagereader_t r;
+		if (!OpenStage(&r, stage))
+			break;
+
+		bool ok;
+		if (stage == STAGE_TREE)
+		{
+			*tree = ReadTreeStage(&r);
+			ok = (*tree != NULL);
+			if (ok)
+				nodes = NumberNodes(*tree);
+		}
+		else if (stage == STAGE_EMPTY)
+			ok = ReadEmptyStage(&r, *tree, nodes);
+		else if (stage == STAGE_PORTALS)
+			ok = ReadPortalStage(&r, *tree, nodes);
+		else if (stage == STAGE_OUTSIDE)
+			ok = ReadOutsideStage(&r, *tree, nodes);
+		else
+			ok = ReadAreaStage(&r, *tree, nodes);
+
+		Free(r.data);
+
+		if (!ok)
+		{
+			char filename[1024];
+			StageFilename(filename, sizeof(filename), stage);
+			Warning("Ignoring stage \"%s\", it can't be read\n", filename);
+			break;
+		}
+	}
+
+	if (nodes)
+		Free(nodes);
+
+	stage--;
+	if (stage >= STAGE_TREE)
+	{
+		Message("Resumed after the %s stage from the stage cache\n", stagenames[stage]);
+		KeepCachedNodes();
+	}
+
+	return stage;
+}
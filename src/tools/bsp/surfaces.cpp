@@ -9,25 +9,23 @@ static void PrintLeafFaces(bsptree_t *tree)
 
 static void WriteGLViewFaces(bsptree_t *tree)
 {
-	FILE *fp = fopen("/tmp/f", "wb");
-	if (!fp)
+	debugfile_t *f = DebugOpenFile("/tmp/f");
+	if (!f)
 		return;
 
-	fprintf(fp, "flush\n");
+	DebugWriteFlush(f);
 	for (area_t *a = tree->areas; a; a = a->next)
 		for (leafface_t *lf = a->leaffaces; lf; lf = lf->areanext)
-			DebugWriteWireFillPolygon(fp, lf->polygon);
+			DebugWriteWireFillPolygon(f, lf->polygon);
 	
-	fclose(fp);
+	DebugCloseFile(f);
 }
 
 //________________________________________________________________________________
 // Debug code for generating faces
 
-static FILE *fifofp;
-
 // fixme: should include map faces?
-static void EmitAreaVertex(vec3 v)
+static void EmitAreaVertex(FILE *fifofp, vec3 v)
 {
 	fprintf(fifofp, "%f %f %f\n", v[0], v[1], v[2]);
 }
@@ -48,14 +46,14 @@ static void EmitAreaSurface(area_t *a)
 			//EmitAreaVertex(f->polygon->vertices[i + 1]);
 			//EmitAreaVertex(f->polygon->vertices[i + 2]);
 
-			fifofp = fopen("/tmp/f", "wb");
+			FILE *fifofp = fopen("/tmp/f", "wb");
 			if (fifofp)
 			{
 				fprintf(fifofp, "polyline 4\n");
-				EmitAreaVertex(f->polygon->vertices[0]);
-				EmitAreaVertex(f->polygon->vertices[i + 1]);
-				EmitAreaVertex(f->polygon->vertices[i + 2]);
-				EmitAreaVertex(f->polygon->vertices[0]);
+				EmitAreaVertex(fifofp, f->polygon->vertices[0]);
+				EmitAreaVertex(fifofp, f->polygon->vertices[i + 1]);
+				EmitAreaVertex(fifofp, f->polygon->vertices[i + 2]);
+				EmitAreaVertex(fifofp, f->polygon->vertices[0]);
 				fclose(fifofp);
 			}
 		}
@@ -63,8 +61,6 @@ static void EmitAreaSurface(area_t *a)
 
 static void EmitAreaGeometry(bsptree_t *tree)
 {
-	fprintf(fifofp, "flush\n");
-
 	for (area_t *a = tree->areas; a; a = a->next)
 	{
 		if (!a->leaffaces)
@@ -97,7 +93,7 @@ static leafface_t *AllocLeafFace(area_t *area, bspnode_t *node, polygon_t *p)
 	return lf;
 }
 
-static void PushFaceIntoTree(bspnode_t *n, polygon_t *p)
+static void PushFaceIntoTree(bspnode_t *n, walkpolygon_t *p)
 {
 	if (!n->children[0] && !n->children[1])
 	{
@@ -105,11 +101,12 @@ static void PushFaceIntoTree(bspnode_t *n, polygon_t *p)
 		if (!n->empty)
 			return;
 
-		AllocLeafFace(n->area, n, p);
+		AllocLeafFace(n->area, n, p->polygon);
 		return;
 	}
 
-	int side = Polygon_OnPlaneSide(p, n->plane, CLIP_EPSILON);
+	polygonsides_t sides;
+	int side = WalkPolygonSide(p, n->plane, &sides);
 
 	if (side == PLANE_SIDE_FRONT)
 		PushFaceIntoTree(n->children[0], p);
@@ -117,7 +114,7 @@ static void PushFaceIntoTree(bspnode_t *n, polygon_t *p)
 		PushFaceIntoTree(n->children[1], p);
 	else if (side == PLANE_SIDE_ON)
 	{
-		float dot = Dot(n->plane.GetNormal(), Polygon_Normal(p));
+		float dot = Dot(n->plane.GetNormal(), Polygon_Normal(p->polygon));
 
 		// map 0 to the front child and 1 to the back child
 		int facing = (dot > 0.0f ? 0 : 1);
@@ -126,25 +123,27 @@ static void PushFaceIntoTree(bspnode_t *n, polygon_t *p)
 	}
 	else if (side == PLANE_SIDE_CROSS)
 	{
-		polygon_t *f, *b;
-		Polygon_SplitWithPlane(p, n->plane, CLIP_EPSILON, &f, &b);
+		walkpolygon_t f, b;
+		WalkSplitPolygon(p, n->plane, &sides, &f, &b);
 
-		PushFaceIntoTree(n->children[0], f);
-		PushFaceIntoTree(n->children[1], b);
+		PushFaceIntoTree(n->children[0], &f);
+		PushFaceIntoTree(n->children[1], &b);
 	}
 }
 
 void BuildFaceFragments(bsptree_t *tree)
 {
-	for (mapface_t *f = mapdata->faces; f; f = f->next)
+	for (mapface_t *f = ctx->mapdata.faces; f; f = f->next)
 	{
-		// fixme: need a method to filter only structural polygons
+		// detail faces are drawn along with the structural faces
 		if (f->areahint)
 			continue;
 
-		polygon_t *polygon = Polygon_Copy(f->polygon);
+		walkpolygon_t polygon;
+		polygon.polygon = Polygon_Copy(f->polygon);
+		polygon.box = f->box;
 
-		PushFaceIntoTree(tree->root, polygon);
+		PushFaceIntoTree(tree->root, &polygon);
 	}
 }
 
@@ -175,6 +174,19 @@ static trilist_t *BuildAreaTriList(area_t *a)
 	return trilist;
 }
 
+// the surface of an area depends only on its triangles, so an area with the
+// same triangles as a cached one reuses its fixed up surface
+static cachekey_t TriListKey(trilist_t *trilist)
+{
+	cachekey_t key = CACHE_KEY_SEED;
+
+	for (areatri_t *t = trilist->head; t; t = t->next)
+		for (int i = 0; i < 3; i++)
+			key = HashBytes(key, &t->vertices[i][0], 3 * sizeof(float));
+
+	return key;
+}
+
 void BuildAreaModels(bsptree_t *tree)
 {
 	BuildFaceFragments(tree);
@@ -184,6 +196,29 @@ void BuildAreaModels(bsptree_t *tree)
 	{
 		trilist_t *trilist = BuildAreaTriList(a);
 
+		cachekey_t key = 0;
+		if (ctx->cache)
+		{
+			key = TriListKey(trilist);
+
+			trilist_t *cached = CacheFindArea(key);
+			if (cached)
+			{
+				FreeTriList(trilist);
+				a->trilist = cached;
+				ctx->stats.numcachedareas++;
+				continue;
+			}
+		}
+
+		// left unfixed with flat normals, and not cached so the next full
+		// build makes the surface properly
+		if (CheapStage(BUDGET_SURFACES))
+		{
+			a->trilist = CalculateFlatNormals(trilist);
+			continue;
+		}
+
 #if 1		
 		// fix the t-junctions
 		trilist_t *fixedlist = FixTJunctions(trilist);
@@ -194,7 +229,10 @@ void BuildAreaModels(bsptree_t *tree)
 		// calculate per vertex normals
 		trilist = CalculateNormals(trilist);
 
+		// a surface finished over the time budget is only partly fixed up
+		if (ctx->cache && !(ctx->cheapstages & (1 << BUDGET_SURFACES)))
+			CacheAddArea(key, trilist);
+
 		a->trilist = trilist;
 	}
 }
-
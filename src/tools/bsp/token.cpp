@@ -9,12 +9,10 @@ void Eatline(FILE *fp)
 	}
 }
 
-// note: returns a pointer to a static buffer
-char* ReadToken(FILE *fp)
+// note: the buffer must hold at least 1024 characters
+char* ReadToken(FILE *fp, char *buffer)
 {
-	static char buffer[1024];
-
-	int ret = fscanf(fp, "%s", buffer);
+	int ret = fscanf(fp, "%1023s", buffer);
 
 	if(ret == 0 || ret == EOF)
 	{
@@ -46,11 +44,10 @@ char* StripQuotes(char *string)
 	return string;
 }
 
-// note: returns a pointer to a static buffer
-char* ReadQuotedString(FILE *fp)
+// note: the buffer must hold at least 1024 characters
+char* ReadQuotedString(FILE *fp, char *buffer)
 {
-	static char buffer[1024];
-	fscanf(fp, "%s", buffer);
+	fscanf(fp, "%1023s", buffer);
 
 	StripQuotes(buffer);
 
@@ -1,3 +1,4 @@
+#include <time.h>
 #include "bsp.h"
 
 // takes as input a list of polygons
@@ -15,9 +16,6 @@ typedef struct bspface_s
 
 } bspface_t;
 
-// global list of bsp nodes
-static bspnode_t	*bspnodes;
-
 // A candidate split plane has features f1, f2 .. fn that characterize it
 // The split plane's 'static value' is a function of it's features
 // Typically this function is a linear combination of the features called a 'linear scoring polynomial'
@@ -33,7 +31,7 @@ typedef struct plane_features_s
 
 static int FaceOnPlaneSide(bspface_t *p, plane_t plane)
 {
-	return Polygon_OnPlaneSide(p->polygon, plane, CLIP_EPSILON);
+	return Polygon_OnPlaneSideInBox(p->polygon, p->box, plane, CLIP_EPSILON);
 }
 
 static plane_t FacePlane(bspface_t *p)
@@ -150,12 +148,13 @@ static float ComputeSplitPlaneScore(plane_t plane, bool areahint, bspface_t *lis
 		f5 = 0.0f;
 	float w5 = 1.0f;
 
-	// final weight adjustment
-	w1 = 1.0f * w1;
-	w2 = 0.0f * w2;
-	w3 = 0.5f * w3;
-	w4 = 0.1f * w4;
-	w5 = 0.4f * w5;
+	// final weight adjustment, from the split profile
+	const float *weights = ctx->options.splitweights;
+	w1 = weights[SPLIT_WEIGHT_AREAHINT] * w1;
+	w2 = weights[SPLIT_WEIGHT_AXIAL] * w2;
+	w3 = weights[SPLIT_WEIGHT_SPLITS] * w3;
+	w4 = weights[SPLIT_WEIGHT_ONPLANE] * w4;
+	w5 = weights[SPLIT_WEIGHT_BALANCE] * w5;
 
 	// compute score
 	//Message("score: %f %f %f %f %f\n", f1, f2, f3, f4, f5);
@@ -188,6 +187,73 @@ static plane_t ChooseBestSplitPlane(bspface_t *list, bool *areahint)
 	return bestplane;
 }
 
+// scoring the plane of every face against every face makes the greedy choice
+// quadratic in the faces at a node. The sampled choice scores the planes of a
+// few faces, the areahints if there are any, against a sample of the faces.
+// Lists short enough to sample whole get the greedy choice
+
+// planes scored at each node
+#define SAMPLE_PLANES		8
+
+// faces each plane is scored against
+#define SAMPLE_FACES		64
+
+static plane_t ChooseSampledSplitPlane(bspface_t *list, bool *areahint)
+{
+	int length = 0, numareahints = 0;
+	for (bspface_t *f = list; f; f = f->next)
+	{
+		length++;
+		numareahints += (f->areahint ? 1 : 0);
+	}
+
+	// every step'th face, copied into a list of its own
+	bspface_t *samples = (bspface_t*)Malloc(SAMPLE_FACES * sizeof(bspface_t));
+	int numsamples = 0;
+	int step = (length + SAMPLE_FACES - 1) / SAMPLE_FACES;
+
+	int i = 0;
+	for (bspface_t *f = list; f; f = f->next, i++)
+	{
+		if (!(i % step))
+			samples[numsamples++] = *f;
+	}
+	for (i = 0; i < numsamples; i++)
+		samples[i].next = (i + 1 < numsamples ? samples + i + 1 : NULL);
+
+	int numcandidates = (numareahints ? numareahints : length);
+	int planestep = (numcandidates + SAMPLE_PLANES - 1) / SAMPLE_PLANES;
+
+	float bestscore = -1.0f;
+	plane_t bestplane;
+
+	*areahint = false;
+	i = 0;
+	for (bspface_t *f = list; f; f = f->next)
+	{
+		if (numareahints && !f->areahint)
+			continue;
+		if (i++ % planestep)
+			continue;
+
+		plane_t plane = FacePlane(f);
+		float score = ComputeSplitPlaneScore(plane, f->areahint, samples);
+
+		if (score > bestscore)
+		{
+			bestscore	= score;
+			bestplane	= plane;
+		}
+	}
+
+	Free(samples);
+
+	if (bestscore == -1)
+		Error("best score is -1!\n");
+
+	return bestplane;
+}
+
 static bsptree_t *MallocTree()
 {
 	return (bsptree_t*)MallocZeroed(sizeof(bsptree_t));
@@ -211,8 +277,8 @@ static bspnode_t *MallocBSPNode(bsptree_t *tree, bspnode_t *parent)
 	n->tree	= tree;
 	
 	// link the node into the global list
-	n->globalnext = bspnodes;
-	bspnodes = n;
+	n->globalnext = ctx->bspnodes;
+	ctx->bspnodes = n;
 	
 	// link the node into the tree list
 	n->treenext = tree->nodes;
@@ -263,25 +329,30 @@ static void SplitFace(bspface_t *p, plane_t plane, float epsilon, bspface_t **f,
 	
 	*f = *b = NULL;
 	
-	// split the polygon
-	Polygon_SplitWithPlane(p->polygon, plane, epsilon, &fp, &bp);
+	// split the polygon with the distances it was classified by
+	polygonsides_t sides;
+	Polygon_ClassifyWithPlaneInBox(p->polygon, p->box, plane, epsilon, &sides);
+	Polygon_SplitWithSides(p->polygon, plane, &sides, &fp, &bp);
 	
 	if (fp)
 	{
 		*f = MallocBSPFace(fp);
 		(*f)->plane	= p->plane;
-		(*f)->box	= p->box;
+		(*f)->box	= SplitBox(p->box, plane, PLANE_SIDE_FRONT);
 		(*f)->areahint	= p->areahint;
 	}
 	if (bp)
 	{
 		*b = MallocBSPFace(bp);
 		(*b)->plane	= p->plane;
-		(*b)->box	= p->box;
+		(*b)->box	= SplitBox(p->box, plane, PLANE_SIDE_BACK);
 		(*b)->areahint	= p->areahint;
 	}
 	
 	// check that the split face sits in the original's plane
+	if (!ctx->options.validate)
+		return;
+
 	if (*f && !CheckFaceOnPlane(*f, FacePlane(p)))
 		Error("Front polygon doesn't sit on original plane after split\n");
 	if (*b && !CheckFaceOnPlane(*b, FacePlane(p)))
@@ -295,6 +366,10 @@ static bspface_t *MakeFaceList(mapface_t *mapfaces)
 
 	for (mapface_t *f = mapfaces; f; f = f->next)
 	{
+		// detail faces don't split the tree
+		if (f->detail)
+			continue;
+
 		// allocate a new bspface
 		polygon_t *p		= Polygon_Copy(f->polygon);
 		bspface_t *bspface	= MallocBSPFace(p);
@@ -310,22 +385,31 @@ static bspface_t *MakeFaceList(mapface_t *mapfaces)
 	return list;
 }
 
-static bsptree_t *MakeEmptyTree(bspface_t *flist)
+// a tree of just a root node with the given bounds
+bsptree_t *MakeTree(box3 box)
 {
 	bsptree_t	*tree;
 	
 	tree = MallocTree();
 	tree->root = MallocBSPNode(tree, NULL);
+	tree->root->box = box;
+
+	return tree;
+}
 
+static bsptree_t *MakeEmptyTree(bspface_t *flist)
+{
 	// setup the root node bounding box
-	tree->root->box = BoundingBox(flist);
-	tree->root->box.Expand(8.0f);
+	box3 box = BoundingBox(flist);
+	box.Expand(8.0f);
 
-	return tree;
+	return MakeTree(box);
 }
 
-static void PartitionFaceList(plane_t plane, bspface_t *list, bspface_t **sides)
+// returns the number of faces split in two
+static int PartitionFaceList(plane_t plane, bspface_t *list, bspface_t **sides)
 {
+	int numsplit = 0;
 	sides[0] = sides[1] = NULL;
 	
 	for(bspface_t *f = list; f; f = f->next)
@@ -343,14 +427,109 @@ static void PartitionFaceList(plane_t plane, bspface_t *list, bspface_t **sides)
 				sides[i] = split[i];
 			}
 		}
+
+		if (split[0] && split[1])
+			numsplit++;
 	}
+
+	return numsplit;
+}
+
+void LinkLeaf(bsptree_t *tree, bspnode_t *node)
+{
+	// link node into the leaf list
+	node->leafnext = tree->leafs;
+	tree->leafs = node;
+	
+	tree->numleafs++;
 }
 
+void SplitNode(bsptree_t *tree, bspnode_t *node, plane_t plane, bool areahint)
+{
+	node->plane = plane;
+	node->areahint = areahint;
+	
+	// add two new nodes to the tree
+	node->children[0] = MallocBSPNode(tree, node);
+	node->children[1] = MallocBSPNode(tree, node);
+	
+	node->children[0]->box = ClipBoxWithPlane(node->box,  node->plane);
+	node->children[1]->box = ClipBoxWithPlane(node->box, -node->plane);
+}
+
+// ==============================================
+// Incremental builds
+// the split of a node depends only on the faces that reach it, so a node whose
+// faces hash the same as a cached node gets the cached split. If every node
+// below it is cached too, the subtree is rebuilt from the cache without
+// choosing splits or splitting faces. The nodes are made in the same order as
+// a clean build, so the output is the same
+
+static cachekey_t FaceListKey(bspface_t *list)
+{
+	cachekey_t key = CACHE_KEY_SEED;
+
+	for (; list; list = list->next)
+	{
+		int areahint = (list->areahint ? 1 : 0);
+		key = HashBytes(key, &areahint, sizeof(areahint));
+		key = HashPolygon(key, list->polygon);
+	}
+
+	// 0 is a leaf
+	return (key ? key : 1);
+}
+
+// the depth limit stops a bad cache with a cycle from recursing forever
+static bool CachedSubtreeComplete(cachekey_t key, int depth)
+{
+	if (!key)
+		return true;
+
+	const cachenode_t *c = CacheFindNode(key);
+	if (!c || depth > 1024)
+		return false;
+
+	return CachedSubtreeComplete(c->children[0], depth + 1) && CachedSubtreeComplete(c->children[1], depth + 1);
+}
+
+static void RebuildCachedSubtree(bsptree_t *tree, bspnode_t *node, cachekey_t key)
+{
+	if (!key)
+	{
+		LinkLeaf(tree, node);
+		return;
+	}
+
+	const cachenode_t *c = CacheFindNode(key);
+	SplitNode(tree, node, plane_t(c->plane[0], c->plane[1], c->plane[2], c->plane[3]), c->areahint != 0);
+	ctx->stats.numcachednodes++;
+
+	RebuildCachedSubtree(tree, node->children[0], c->children[0]);
+	RebuildCachedSubtree(tree, node->children[1], c->children[1]);
+}
+
+// a tree that didn't need building, because it came from the stage cache,
+// still uses its nodes in the cache so they're written back for the next build
+void KeepCachedNodes()
+{
+	if (!ctx->cache)
+		return;
+
+	bspface_t *flist = MakeFaceList(ctx->mapdata.faces);
+	if (flist)
+		CachedSubtreeComplete(FaceListKey(flist), 0);
+}
+
+// ==============================================
+// Tree building
+
 // this will be called with a node and a list. The list will be of polygons fully
 // contained within the node. Then the node is split with a plane
 // Leaf nodes won't have a valid split plane
 // Leaf nodes wont have valid child pointers
-static void BuildTreeRecursive(bsptree_t *tree, bspnode_t *node, bspface_t *list)
+// Returns the cache key of the node, 0 for leafs or if there's no cache
+static cachekey_t BuildTreeRecursive(bsptree_t *tree, bspnode_t *node, bspface_t *list)
 {
 	plane_t		plane;
 	bspface_t	*sides[2];
@@ -358,34 +537,418 @@ static void BuildTreeRecursive(bsptree_t *tree, bspnode_t *node, bspface_t *list
 	// guard condition for an empty list
 	if (!list)
 	{
-		// link node into the leaf list
-		node->leafnext = tree->leafs;
-		tree->leafs = node;
-		
-		tree->numleafs++;
-		return;
+		LinkLeaf(tree, node);
+		return 0;
+	}
+
+	cachekey_t key = 0;
+	const cachenode_t *cached = NULL;
+	if (ctx->cache)
+	{
+		key = FaceListKey(list);
+		if (CachedSubtreeComplete(key, 0))
+		{
+			RebuildCachedSubtree(tree, node, key);
+			return key;
+		}
+
+		cached = CacheFindNode(key);
 	}
 	
 	// choose the best split plane for the list
 	bool areahint;
-	plane = ChooseBestSplitPlane(list, &areahint);
+	bool sampled = false;
+	if (cached)
+	{
+		plane = plane_t(cached->plane[0], cached->plane[1], cached->plane[2], cached->plane[3]);
+		areahint = (cached->areahint != 0);
+	}
+	else if (CheapStage(BUDGET_TREE))
+	{
+		plane = ChooseSampledSplitPlane(list, &areahint);
+		sampled = true;
+	}
+	else
+	{
+		plane = ChooseBestSplitPlane(list, &areahint);
+	}
 
 	// split the polygon list
-	PartitionFaceList(plane, list, sides);
+	ctx->stats.numsplitfaces += PartitionFaceList(plane, list, sides);
 
-	node->plane = plane;
-	node->areahint = areahint;
-	
-	// add two new nodes to the tree
-	node->children[0] = MallocBSPNode(tree, node);
-	node->children[1] = MallocBSPNode(tree, node);
-	
-	node->children[0]->box = ClipBoxWithPlane(node->box,  node->plane);
-	node->children[1]->box = ClipBoxWithPlane(node->box, -node->plane);
+	SplitNode(tree, node, plane, areahint);
 	
 	// recurse down the front and back sides
-	BuildTreeRecursive(tree, node->children[0], sides[0]);
-	BuildTreeRecursive(tree, node->children[1], sides[1]);
+	cachenode_t c;
+	memset(&c, 0, sizeof(c));
+	for (int i = 0; i < 4; i++)
+		c.plane[i] = plane[i];
+	c.areahint = (areahint ? 1 : 0);
+	c.children[0] = BuildTreeRecursive(tree, node->children[0], sides[0]);
+	c.children[1] = BuildTreeRecursive(tree, node->children[1], sides[1]);
+
+	// a sampled split isn't cached, the next full build chooses it properly
+	if (ctx->cache && !cached && !sampled)
+		CacheAddNode(key, &c);
+
+	return key;
+}
+
+// ==============================================
+// Tree optimisation
+// the greedy split choice can leave long chains that a point has to walk down
+// to reach its leaf. The expected number of nodes a point query visits is
+// estimated from the node boxes, a split sending the share of its box in front
+// of the plane down the front side. Subtrees that cost well over a balanced one
+// are rebuilt from the top down, choosing the split with the least expected
+// cost under it with the faces as the cost of each side, and a rebuild is only
+// kept if it's cheaper. Areahints are still split first by the greedy choice,
+// so the areas come out the same
+
+// smallest subtree worth rebuilding
+#define OPTIMIZE_MIN_LEAFS	4
+
+// how far over the cost of a balanced subtree one has to be to be rebuilt
+#define OPTIMIZE_SLACK		1.25f
+
+#define OPTIMIZE_MAX_REBUILDS	32
+
+#define HISTOGRAM_BUCKETS	8
+#define BENCH_POINTS		100000
+
+// the share of the box in front of the plane, exact for axial planes
+static float FrontFraction(box3 box, plane_t plane)
+{
+	float min = 0.0f, max = 0.0f;
+	for (int i = 0; i < 8; i++)
+	{
+		vec3 corner = vec3((i & 1 ? box.max.x : box.min.x), (i & 2 ? box.max.y : box.min.y), (i & 4 ? box.max.z : box.min.z));
+		float d = Distance(plane, corner);
+
+		if (!i || d < min)
+			min = d;
+		if (!i || d > max)
+			max = d;
+	}
+
+	if (max <= 0.0f)
+		return 0.0f;
+	if (min >= 0.0f)
+		return 1.0f;
+
+	return max / (max - min);
+}
+
+// expected nodes visited below n by a point in its box. costs and numleafs are
+// filled in by nodenumber when they aren't NULL
+static float SubtreeCost(bspnode_t *n, float *costs, int *numleafs)
+{
+	float cost = 0.0f;
+	int leafs = 1;
+
+	if (n->children[0])
+	{
+		float front = FrontFraction(n->box, n->plane);
+		cost = 1.0f + front * SubtreeCost(n->children[0], costs, numleafs) + (1.0f - front) * SubtreeCost(n->children[1], costs, numleafs);
+
+		if (numleafs)
+			leafs = numleafs[n->children[0]->nodenumber] + numleafs[n->children[1]->nodenumber];
+	}
+
+	if (costs)
+		costs[n->nodenumber] = cost;
+	if (numleafs)
+		numleafs[n->nodenumber] = leafs;
+
+	return cost;
+}
+
+float TreeCost(bsptree_t *tree)
+{
+	return SubtreeCost(tree->root, NULL, NULL);
+}
+
+static int NumberSubtree(bspnode_t *n, int number)
+{
+	n->nodenumber = number++;
+	if (n->children[0])
+	{
+		number = NumberSubtree(n->children[0], number);
+		number = NumberSubtree(n->children[1], number);
+	}
+
+	return number;
+}
+
+static plane_t ChooseCheapestSplitPlane(bspface_t *list, box3 box, bool *areahint)
+{
+	for (bspface_t *f = list; f; f = f->next)
+	{
+		if (f->areahint)
+			return ChooseBestSplitPlane(list, areahint);
+	}
+
+	float bestcost = 0.0f;
+	plane_t bestplane;
+
+	for (bspface_t *f = list; f; f = f->next)
+	{
+		plane_t plane = FacePlane(f);
+
+		int sides[4] = { 0, 0, 0, 0 };
+		for (bspface_t *g = list; g; g = g->next)
+			sides[FaceOnPlaneSide(g, plane)]++;
+
+		// faces on the plane are used up by the split, faces crossing it
+		// go down both sides
+		float front = FrontFraction(box, plane);
+		float cost = front * (sides[PLANE_SIDE_FRONT] + sides[PLANE_SIDE_CROSS]) + (1.0f - front) * (sides[PLANE_SIDE_BACK] + sides[PLANE_SIDE_CROSS]);
+
+		if (f == list || cost < bestcost)
+		{
+			bestcost = cost;
+			bestplane = plane;
+		}
+	}
+
+	*areahint = false;
+
+	return bestplane;
+}
+
+static void BuildCheapTreeRecursive(bsptree_t *tree, bspnode_t *node, bspface_t *list)
+{
+	if (!list)
+	{
+		LinkLeaf(tree, node);
+		return;
+	}
+
+	bool areahint;
+	plane_t plane = ChooseCheapestSplitPlane(list, node->box, &areahint);
+
+	bspface_t *sides[2];
+	PartitionFaceList(plane, list, sides);
+
+	SplitNode(tree, node, plane, areahint);
+
+	BuildCheapTreeRecursive(tree, node->children[0], sides[0]);
+	BuildCheapTreeRecursive(tree, node->children[1], sides[1]);
+}
+
+static void MarkSubtree(bspnode_t *n)
+{
+	n->nodenumber = -1;
+	if (n->children[0])
+	{
+		MarkSubtree(n->children[0]);
+		MarkSubtree(n->children[1]);
+	}
+}
+
+// rebuild the subtree under node from the faces that reach it, returns false
+// and leaves it as it is if the rebuild isn't cheaper
+static bool RebuildSubtree(bsptree_t *tree, bspnode_t *node, bspface_t *list, float cost)
+{
+	bsptree_t *rebuilt = MakeTree(node->box);
+	BuildCheapTreeRecursive(rebuilt, rebuilt->root, list);
+
+	if (SubtreeCost(rebuilt->root, NULL, NULL) >= cost)
+		return false;
+
+	// take the old nodes below node out of the tree lists
+	MarkSubtree(node->children[0]);
+	MarkSubtree(node->children[1]);
+
+	bspnode_t **n = &tree->nodes;
+	while (*n)
+	{
+		if ((*n)->nodenumber == -1)
+		{
+			*n = (*n)->treenext;
+			tree->numnodes--;
+		}
+		else
+		{
+			n = &(*n)->treenext;
+		}
+	}
+
+	n = &tree->leafs;
+	while (*n)
+	{
+		if ((*n)->nodenumber == -1)
+		{
+			*n = (*n)->leafnext;
+			tree->numleafs--;
+		}
+		else
+		{
+			n = &(*n)->leafnext;
+		}
+	}
+
+	// and move the new ones in, the root of the rebuild becoming node
+	bspnode_t *root = rebuilt->root;
+	node->plane = root->plane;
+	node->areahint = root->areahint;
+	node->children[0] = root->children[0];
+	node->children[1] = root->children[1];
+	node->children[0]->parent = node;
+	node->children[1]->parent = node;
+
+	for (bspnode_t *next, *r = rebuilt->nodes; r; r = next)
+	{
+		next = r->treenext;
+		if (r == root)
+			continue;
+
+		r->tree = tree;
+		r->treenext = tree->nodes;
+		tree->nodes = r;
+		tree->numnodes++;
+	}
+
+	for (bspnode_t *next, *r = rebuilt->leafs; r; r = next)
+	{
+		next = r->leafnext;
+		LinkLeaf(tree, r);
+	}
+
+	return true;
+}
+
+// the greedy build's face lists are made again on the way down, so a subtree
+// is rebuilt from the same faces it was built from
+static void OptimizeNode(bsptree_t *tree, bspnode_t *n, bspface_t *list, float *costs, int *numleafs, int *numtried, int *numrebuilt)
+{
+	if (!n->children[0])
+		return;
+
+	int leafs = numleafs[n->nodenumber];
+	float cost = costs[n->nodenumber];
+
+	if (leafs >= OPTIMIZE_MIN_LEAFS && cost > OPTIMIZE_SLACK * log2f(leafs) && *numtried < OPTIMIZE_MAX_REBUILDS)
+	{
+		(*numtried)++;
+		if (RebuildSubtree(tree, n, list, cost))
+		{
+			(*numrebuilt)++;
+			return;
+		}
+	}
+
+	bspface_t *sides[2];
+	PartitionFaceList(n->plane, list, sides);
+
+	OptimizeNode(tree, n->children[0], sides[0], costs, numleafs, numtried, numrebuilt);
+	OptimizeNode(tree, n->children[1], sides[1], costs, numleafs, numtried, numrebuilt);
+}
+
+static void LeafDepths(bspnode_t *n, int depth, int *depths)
+{
+	if (!n->children[0])
+	{
+		depths[depth]++;
+		return;
+	}
+
+	LeafDepths(n->children[0], depth + 1, depths);
+	LeafDepths(n->children[1], depth + 1, depths);
+}
+
+static void PrintDepthHistogram(bsptree_t *tree, const char *name)
+{
+	int maxdepth = TreeMaxDepth(tree->root);
+	int *depths = (int*)MallocZeroed((maxdepth + 1) * sizeof(int));
+	LeafDepths(tree->root, 0, depths);
+
+	int bucketsize = maxdepth / HISTOGRAM_BUCKETS + 1;
+	char line[1024];
+	int length = snprintf(line, sizeof(line), "%s leaf depths:", name);
+
+	for (int bucket = 0; bucket * bucketsize <= maxdepth; bucket++)
+	{
+		int count = 0;
+		for (int i = bucket * bucketsize; i < (bucket + 1) * bucketsize && i <= maxdepth; i++)
+			count += depths[i];
+
+		length += snprintf(line + length, sizeof(line) - length, " %i-%i:%i", bucket * bucketsize, (bucket + 1) * bucketsize - 1, count);
+	}
+
+	Message("%s\n", line);
+	Free(depths);
+}
+
+// walks the nodes to the leafs of seeded random points in the root box, for
+// the average number of nodes visited and the time per query
+static void BenchPointQueries(bsptree_t *tree, float *nodes, float *nanoseconds)
+{
+	vec3 *points = (vec3*)Malloc(BENCH_POINTS * sizeof(vec3));
+
+	unsigned int seed = 1;
+	vec3 size = tree->root->box.Size();
+	for (int i = 0; i < BENCH_POINTS; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			points[i][j] = tree->root->box.min[j] + size[j] * ((seed >> 8) * (1.0f / 16777216.0f));
+		}
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long visited = 0;
+	for (int i = 0; i < BENCH_POINTS; i++)
+	{
+		bspnode_t *n = tree->root;
+		while (n->children[0])
+		{
+			n = n->children[(Distance(n->plane, points[i]) >= 0.0f ? 0 : 1)];
+			visited++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*nodes = (float)visited / BENCH_POINTS;
+	*nanoseconds = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_POINTS;
+
+	Free(points);
+}
+
+static void OptimizeTree(bsptree_t *tree)
+{
+	Message("Optimizing tree\n");
+
+	float *costs = (float*)Malloc(tree->numnodes * sizeof(float));
+	int *numleafs = (int*)Malloc(tree->numnodes * sizeof(int));
+	NumberSubtree(tree->root, 0);
+	float cost = SubtreeCost(tree->root, costs, numleafs);
+
+	float nodes, nanoseconds;
+	BenchPointQueries(tree, &nodes, &nanoseconds);
+	PrintDepthHistogram(tree, "greedy");
+
+	int numtried = 0, numrebuilt = 0;
+	OptimizeNode(tree, tree->root, MakeFaceList(ctx->mapdata.faces), costs, numleafs, &numtried, &numrebuilt);
+
+	Free(costs);
+	Free(numleafs);
+
+	float optimizedcost = SubtreeCost(tree->root, NULL, NULL);
+	float optimizednodes, optimizednanoseconds;
+	BenchPointQueries(tree, &optimizednodes, &optimizednanoseconds);
+	PrintDepthHistogram(tree, "optimized");
+
+	ctx->stats.numrebuiltsubtrees = numrebuilt;
+	ctx->stats.greedytreecost = cost;
+
+	Message("%i of %i subtrees tried rebuilt\n", numrebuilt, numtried);
+	Message("expected point query cost %.2f -> %.2f nodes\n", cost, optimizedcost);
+	Message("point query bench %.2f -> %.2f nodes, %.1f -> %.1f ns\n", nodes, optimizednodes, nanoseconds, optimizednanoseconds);
 }
 
 bsptree_t *BuildTree()
@@ -396,11 +959,15 @@ bsptree_t *BuildTree()
 
 	Message("Building bsp tree\n");
 
-	flist = MakeFaceList(mapdata->faces);
+	flist = MakeFaceList(ctx->mapdata.faces);
 	
 	tree = MakeEmptyTree(flist);
 	
 	BuildTreeRecursive(tree, tree->root, flist);
+
+	if (ctx->options.optimizetree && !CheapStage(BUDGET_OPTIONAL))
+		OptimizeTree(tree);
+
 	tree->mindepth = TreeMinDepth(tree->root);
 	tree->maxdepth = TreeMaxDepth(tree->root);
 
@@ -30,7 +30,7 @@ void FreeTriList(trilist_t *l)
 		l->head = next;
 	}
 
-	free(l);
+	Free(l);
 }
 
 void Append(trilist_t *l, areatri_t *t)
@@ -248,12 +248,20 @@ static trilist_t *FixTriangleList(trilist_t *trilist, vec3 v)
 	return result;
 }
 
+// the triangles left when the compile runs over its time budget are passed
+// through as they are
 trilist_t *FixTJunctions(trilist_t *trilist)
 {
 	trilist_t *result = CreateTriList();
 
 	for (areatri_t *t = Head(trilist); t; t = t->next)
 	{
+		if (CheapStage(BUDGET_SURFACES))
+		{
+			Append(result, Copy(t));
+			continue;
+		}
+
 		// Make a list of a single element
 		trilist_t *fixedlist = CreateTriList();
 		Append(fixedlist, Copy(t));
@@ -391,10 +399,19 @@ static vec3 CalculateVertexNormal(vec3 vertex, vec3 refnormal, trilist_t *trilis
 	return vertexnormal;
 }
 
+// the triangles left when the compile runs over its time budget get flat
+// normals
 trilist_t *CalculateNormals(trilist_t *trilist)
 {
 	for (areatri_t *t = trilist->head; t; t = t->next)
 	{
+		if (CheapStage(BUDGET_SURFACES))
+		{
+			vec3 normal = TriNormal(t);
+			t->normals[0] = t->normals[1] = t->normals[2] = normal;
+			continue;
+		}
+
 		vec3 refnormal = TriNormal(t);
 		//printf("refnormal %f %f %f\n", refnormal[0], refnormal[1], refnormal[2]);
 		t->normals[0] = CalculateVertexNormal(t->vertices[0], refnormal, trilist);
@@ -405,6 +422,21 @@ trilist_t *CalculateNormals(trilist_t *trilist)
 	return trilist;
 }
 
+// the normal of each triangle at all of its corners, for a surface that isn't
+// smoothed
+trilist_t *CalculateFlatNormals(trilist_t *trilist)
+{
+	for (areatri_t *t = trilist->head; t; t = t->next)
+	{
+		vec3 normal = TriNormal(t);
+		t->normals[0] = normal;
+		t->normals[1] = normal;
+		t->normals[2] = normal;
+	}
+
+	return trilist;
+}
+
 //________________________________________________________________________________
 // Triangle Clipping
 // consumes a triangle and a plane and produces a two lists of triangles for the front and back planes
@@ -3,87 +3,87 @@
 // ________________________________________________________________________________ 
 // Mesh builder
 
-static int numvertices;
-static int maxvertices;
-static meshvertex_t *vertices;
+// the mesh being built lives in the compile context
 
-static int numindicies;
-static int maxindicies;
-static int *indicies;
-
-static void ExpandVertexList(int count)
+static void ExpandVertexList(meshbuilder_t *m, int count)
 {
-	maxvertices = count;
-	vertices = (meshvertex_t*)realloc(vertices, maxvertices * sizeof(meshvertex_t));
+	m->maxvertices = count;
+	m->vertices = (meshvertex_t*)realloc(m->vertices, m->maxvertices * sizeof(meshvertex_t));
+	if (!m->vertices)
+		Error("Failed to allocate %i mesh vertices\n", count);
 }
 
-static void ExpandIndexList(int count)
+static void ExpandIndexList(meshbuilder_t *m, int count)
 {
-	maxindicies = count;
-	indicies = (int*)realloc(indicies, maxindicies * sizeof(int));
+	m->maxindicies = count;
+	m->indicies = (int*)realloc(m->indicies, m->maxindicies * sizeof(int));
+	if (!m->indicies)
+		Error("Failed to allocate %i mesh indicies\n", count);
 }
 
-static int InsertVertex(meshvertex_t v)
+static int InsertVertex(meshbuilder_t *m, meshvertex_t v)
 {
-	if (numvertices == maxvertices)
-		ExpandVertexList(maxvertices * 2);
+	if (m->numvertices == m->maxvertices)
+		ExpandVertexList(m, m->maxvertices * 2);
 
-	vertices[numvertices++] = v;
-	return numvertices - 1;
+	m->vertices[m->numvertices++] = v;
+	return m->numvertices - 1;
 }
 
-static void InsertIndex(int index)
+static void InsertIndex(meshbuilder_t *m, int index)
 {
-	if (numindicies == maxindicies)
-		ExpandIndexList(maxindicies * 2);
+	if (m->numindicies == m->maxindicies)
+		ExpandIndexList(m, m->maxindicies * 2);
 	
-	indicies[numindicies++] = index;
+	m->indicies[m->numindicies++] = index;
 }
 
 #if 0
-static int LookupVertex(meshvertex_t v)
+static int LookupVertex(meshbuilder_t *m, meshvertex_t v)
 {
-	for (int i = 0; i < numvertices; i++)
-		if (vertices[i].xyz == v.xyz && 
-			vertices[i].normal == v.normal)
+	for (int i = 0; i < m->numvertices; i++)
+		if (m->vertices[i].xyz == v.xyz && 
+			m->vertices[i].normal == v.normal)
 			return i;
 
-	return InsertVertex(v);
+	return InsertVertex(m, v);
 }
 #endif
 #if 1
-static int LookupVertex(meshvertex_t v)
+static int LookupVertex(meshbuilder_t *m, meshvertex_t v)
 {
-	for (int i = 0; i < numvertices; i++)
-		if ((Length(vertices[i].xyz - v.xyz) < 0.01f) &&
-			vertices[i].normal == v.normal)
+	for (int i = 0; i < m->numvertices; i++)
+		if ((Length(m->vertices[i].xyz - v.xyz) < 0.01f) &&
+			m->vertices[i].normal == v.normal)
 			return i;
 
-	return InsertVertex(v);
+	return InsertVertex(m, v);
 }
 #endif
 
 void BeginMesh()
 {
-	if (vertices)
+	meshbuilder_t *m = &ctx->mesh;
+
+	if (m->vertices)
 	{
-		free(vertices);
-		vertices = NULL;
+		free(m->vertices);
+		m->vertices = NULL;
 	}
 
-	numvertices = 0;
-	maxvertices = 1;
-	ExpandVertexList(maxvertices);
+	m->numvertices = 0;
+	m->maxvertices = 1;
+	ExpandVertexList(m, m->maxvertices);
 
-	if (indicies)
+	if (m->indicies)
 	{
-		free(indicies);
-		indicies = NULL;
+		free(m->indicies);
+		m->indicies = NULL;
 	}
 
-	numindicies = 0;
-	maxindicies = 1;
-	ExpandIndexList(maxindicies);
+	m->numindicies = 0;
+	m->maxindicies = 1;
+	ExpandIndexList(m, m->maxindicies);
 }
 
 void EndMesh()
@@ -92,27 +92,29 @@ void EndMesh()
 
 void InsertTri(meshvertex_t v0, meshvertex_t v1, meshvertex_t v2)
 {
-	InsertIndex(LookupVertex(v0));
-	InsertIndex(LookupVertex(v1));
-	InsertIndex(LookupVertex(v2));
+	meshbuilder_t *m = &ctx->mesh;
+
+	InsertIndex(m, LookupVertex(m, v0));
+	InsertIndex(m, LookupVertex(m, v1));
+	InsertIndex(m, LookupVertex(m, v2));
 }
 
 int NumVertices()
 {
-	return numvertices;
+	return ctx->mesh.numvertices;
 }
 
 int NumIndicies()
 {
-	return numindicies;
+	return ctx->mesh.numindicies;
 }
 
 meshvertex_t GetVertex(int i)
 {
-	return vertices[i];
+	return ctx->mesh.vertices[i];
 }
 
 int GetIndex(int i)
 {
-	return indicies[i];
+	return ctx->mesh.indicies[i];
 }
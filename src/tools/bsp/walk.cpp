@@ -0,0 +1,58 @@
+#include "bsp.h"
+
+// ==============================================
+// Polygon walks
+// the faces and portals pushed down the tree carry their bounds. A node whose
+// plane the box is well clear of is decided by the box, and only the nodes the
+// box straddles look at the vertices. The pieces of a split keep the box of the
+// polygon they came from, cut down to their side of an axial plane, so no
+// vertices are looked at to bound them. The distances the vertices were
+// classified by are kept for the split
+
+walkpolygon_t WalkPolygon(polygon_t *p)
+{
+	walkpolygon_t w;
+
+	w.polygon = p;
+	if (p)
+		w.box = Polygon_BoundingBox(p);
+
+	return w;
+}
+
+int WalkPolygonSide(walkpolygon_t *w, plane_t plane, polygonsides_t *sides)
+{
+	return Polygon_ClassifyWithPlaneInBox(w->polygon, w->box, plane, CLIP_EPSILON, sides);
+}
+
+// the pieces can reach past the plane by the epsilon
+box3 SplitBox(box3 box, plane_t plane, int side)
+{
+	if (side == PLANE_SIDE_BACK)
+		plane = -plane;
+
+	for (int i = 0; i < 3; i++)
+	{
+		// only a plane along an axis cuts the box down
+		if (plane[i] == 0.0f || plane[(i + 1) % 3] != 0.0f || plane[(i + 2) % 3] != 0.0f)
+			continue;
+
+		// where the plane is the epsilon behind
+		float limit = (-plane[3] - CLIP_EPSILON) / plane[i];
+		if (plane[i] > 0.0f && box.min[i] < limit)
+			box.min[i] = limit;
+		else if (plane[i] < 0.0f && box.max[i] > limit)
+			box.max[i] = limit;
+	}
+
+	return box;
+}
+
+// sides is from WalkPolygonSide with the same plane
+void WalkSplitPolygon(walkpolygon_t *w, plane_t plane, const polygonsides_t *sides, walkpolygon_t *front, walkpolygon_t *back)
+{
+	Polygon_SplitWithSides(w->polygon, plane, sides, &front->polygon, &back->polygon);
+
+	front->box = SplitBox(w->box, plane, PLANE_SIDE_FRONT);
+	back->box = SplitBox(w->box, plane, PLANE_SIDE_BACK);
+}
@@ -99,6 +99,180 @@ static void DecodeNodes(FILE *fp)
 		max[2] = ReadFloat(fp);
 		printf("boxmin: %f, %f, %f\n", min[0], min[1], min[2]);
 		printf("boxmax: %f, %f, %f\n", max[0], max[1], max[2]);
+
+		int empty = ReadInt(fp);
+		printf("empty: %i\n", empty);
+	}
+}
+
+static void DecodePlanes(FILE *fp)
+{
+	int numplanes = ReadInt(fp);
+	printf("numplanes: %i\n", numplanes);
+
+	for (int i = 0; i < numplanes; i++)
+	{
+		float a, b, c, d;
+		a = ReadFloat(fp);
+		b = ReadFloat(fp);
+		c = ReadFloat(fp);
+		d = ReadFloat(fp);
+		printf("plane %i: %f, %f, %f, %f\n", i, a, b, c, d);
+	}
+}
+
+// children with the top bit set are leaf numbers
+static void PrintChild(int child)
+{
+	if (child & 0x80000000)
+		printf("leaf %i", child & 0x7fffffff);
+	else
+		printf("node %i", child);
+}
+
+static void DecodeCompactNodes(FILE *fp)
+{
+	int numnodes = ReadInt(fp);
+	printf("numtnodes: %i\n", numnodes);
+
+	printf("headnode: ");
+	PrintChild(ReadInt(fp));
+	printf("\n");
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		int planenum = ReadInt(fp);
+		int child0 = ReadInt(fp);
+		int child1 = ReadInt(fp);
+		int nodenum = ReadInt(fp);
+
+		printf("tnode %i: plane %i, children ", i, planenum);
+		PrintChild(child0);
+		printf(", ");
+		PrintChild(child1);
+		printf(", node %i\n", nodenum);
+	}
+}
+
+static void DecodeCompactLeafs(FILE *fp)
+{
+	int numleafs = ReadInt(fp);
+	printf("numtleafs: %i\n", numleafs);
+
+	for (int i = 0; i < numleafs; i++)
+	{
+		int nodenum = ReadInt(fp);
+		int empty = ReadInt(fp);
+		printf("tleaf %i: node %i, empty %i\n", i, nodenum, empty);
+	}
+}
+
+static void DecodeCompactBoxes(FILE *fp)
+{
+	int numboxes = ReadInt(fp);
+	printf("numtboxes: %i\n", numboxes);
+
+	for (int i = 0; i < numboxes; i++)
+	{
+		float min[3], max[3];
+		min[0] = ReadFloat(fp);
+		min[1] = ReadFloat(fp);
+		min[2] = ReadFloat(fp);
+		max[0] = ReadFloat(fp);
+		max[1] = ReadFloat(fp);
+		max[2] = ReadFloat(fp);
+		printf("tbox %i: %f, %f, %f - %f, %f, %f\n", i, min[0], min[1], min[2], max[0], max[1], max[2]);
+	}
+}
+
+// pre-order records, the front child of a node is the next record. They're
+// written instead of the node block, with only the root box
+static void DecodeImplicitNodes(FILE *fp)
+{
+	int numnodes = ReadInt(fp);
+	printf("numinodes: %i\n", numnodes);
+
+	float min[3], max[3];
+	min[0] = ReadFloat(fp);
+	min[1] = ReadFloat(fp);
+	min[2] = ReadFloat(fp);
+	max[0] = ReadFloat(fp);
+	max[1] = ReadFloat(fp);
+	max[2] = ReadFloat(fp);
+	printf("rootbox: %f, %f, %f - %f, %f, %f\n", min[0], min[1], min[2], max[0], max[1], max[2]);
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		int data0 = ReadInt(fp);
+		int data1 = ReadInt(fp);
+
+		if (data0 & 0x80000000)
+			printf("inode %i: leaf, empty %i, area %i\n", i, data0 & 0x1, data1);
+		else
+			printf("inode %i: plane %i, children node %i, node %i\n", i, data0, i + 1, i + data1);
+	}
+}
+
+// the directory of a packed file, followed by the shared planes and a section
+// per model
+static void DecodeModels(FILE *fp)
+{
+	int nummodels = ReadInt(fp);
+	printf("nummodels: %i\n", nummodels);
+
+	for (int i = 0; i < nummodels; i++)
+	{
+		char name[256];
+		ReadString(name, fp);
+
+		float min[3], max[3];
+		min[0] = ReadFloat(fp);
+		min[1] = ReadFloat(fp);
+		min[2] = ReadFloat(fp);
+		max[0] = ReadFloat(fp);
+		max[1] = ReadFloat(fp);
+		max[2] = ReadFloat(fp);
+
+		int firstnode = ReadInt(fp);
+		int numnodes = ReadInt(fp);
+		int numleafs = ReadInt(fp);
+		int firstarea = ReadInt(fp);
+		int numareas = ReadInt(fp);
+		int offset = ReadInt(fp);
+		int numbytes = ReadInt(fp);
+
+		printf("model %i \"%s\": bounds %f, %f, %f - %f, %f, %f\n", i, name, min[0], min[1], min[2], max[0], max[1], max[2]);
+		printf("nodes %i-%i (%i leafs), areas %i-%i, section %i, %i bytes\n",
+			firstnode, firstnode + numnodes - 1, numleafs, firstarea, firstarea + numareas - 1, offset, numbytes);
+	}
+}
+
+// the nodes of a packed model, with plane numbers into the shared planes
+static void DecodeModelNodes(FILE *fp)
+{
+	int numnodes = ReadInt(fp);
+	printf("nummnodes: %i\n", numnodes);
+	int numleafs = ReadInt(fp);
+	printf("numleafs: %i\n", numleafs);
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		int child0 = ReadInt(fp);
+		int child1 = ReadInt(fp);
+		int planenum = ReadInt(fp);
+
+		float min[3], max[3];
+		min[0] = ReadFloat(fp);
+		min[1] = ReadFloat(fp);
+		min[2] = ReadFloat(fp);
+		max[0] = ReadFloat(fp);
+		max[1] = ReadFloat(fp);
+		max[2] = ReadFloat(fp);
+
+		int empty = ReadInt(fp);
+
+		printf("mnode %i: children %i, %i, plane %i, empty %i, box %f, %f, %f - %f, %f, %f\n",
+			i, child0, child1, planenum, empty, min[0], min[1], min[2], max[0], max[1], max[2]);
 	}
 }
 
@@ -205,6 +379,20 @@ static void DecodeFile(FILE *fp)
 			DecodePortals(fp);
 		else if (!strncmp(header, "rmodel", 8))
 			DecodeRenderModels(fp);
+		else if (!strncmp(header, "planes", 8))
+			DecodePlanes(fp);
+		else if (!strncmp(header, "tnodes", 8))
+			DecodeCompactNodes(fp);
+		else if (!strncmp(header, "tleafs", 8))
+			DecodeCompactLeafs(fp);
+		else if (!strncmp(header, "tboxes", 8))
+			DecodeCompactBoxes(fp);
+		else if (!strncmp(header, "inodes", 8))
+			DecodeImplicitNodes(fp);
+		else if (!strncmp(header, "models", 8))
+			DecodeModels(fp);
+		else if (!strncmp(header, "mnodes", 8))
+			DecodeModelNodes(fp);
 		else
 			Error("Unknown header \"%s\"\n", header);
 	}
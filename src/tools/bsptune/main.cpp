@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "libbsp.h"
+
+// searches for the split weights that build the best trees over a set of maps,
+// and writes them as a split profile for bsp --split-profile. Each candidate
+// compiles every map, spread over a pool of workers with a compile context
+// each. A candidate's score is the mean over the maps of the objective relative
+// to the weights the search started from, so a big map doesn't outweigh the
+// rest. The search is seeded, so runs are repeatable apart from the time
+// objective. The areahint weight isn't searched, the areahints have to be the
+// first splits for the areas to come out right
+
+typedef enum
+{
+	OBJECTIVE_NODES,	// nodes written
+	OBJECTIVE_SPLITS,	// faces split building the tree
+	OBJECTIVE_PORTALS,	// portals written
+	OBJECTIVE_TIME,		// seconds in the tree, portal, area and model stages
+	OBJECTIVE_COST,		// expected nodes a point query visits
+	NUM_OBJECTIVES
+
+} objective_t;
+
+static const char *objectivenames[NUM_OBJECTIVES] = { "nodes", "splits", "portals", "time", "cost" };
+
+static int		objective = OBJECTIVE_NODES;
+static int		numrounds = 8;
+static unsigned int	seed = 1;
+static int		numworkers = 0;
+static const char	*profilefilename = "split.profile";
+static const char	*startfilename = NULL;
+static bool		verbose = false;
+
+// weights searched and the first step taken on each
+#define FIRST_STEP		0.25f
+#define MIN_STEP		0.01f
+
+// random candidates tried around the best each round
+#define RANDOM_CANDIDATES	4
+
+static const char	**maps;
+static int		nummaps;
+
+static char		tempdir[] = "/tmp/bsptuneXXXXXX";
+
+static double Seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Fatal(const char *error)
+{
+	fprintf(stderr, "%s", error);
+	exit(EXIT_FAILURE);
+}
+
+// ________________________________________________________________________________
+// random steps
+
+static unsigned int randstate;
+
+static float RandomFloat()
+{
+	randstate = randstate * 1664525u + 1013904223u;
+	return (randstate >> 8) * (1.0f / 16777216.0f);
+}
+
+// ________________________________________________________________________________
+// compiling
+// the candidates of a round are compiled together, one job per candidate and
+// map, so the workers stay busy to the end of the round
+
+typedef struct candidate_s
+{
+	float		weights[NUM_SPLIT_WEIGHTS];
+
+	// the objective of each map, negative if the map failed
+	double		*values;
+	double		score;
+	bool		failed;
+
+} candidate_t;
+
+static candidate_t	*compiling;
+static int		numcompiling;
+static int		nextjob;
+
+static double ObjectiveValue(const bspstats_t *s)
+{
+	switch (objective)
+	{
+		case OBJECTIVE_NODES:	return s->numnodes;
+		case OBJECTIVE_SPLITS:	return s->numsplitfaces;
+		case OBJECTIVE_PORTALS:	return s->numportals;
+		case OBJECTIVE_TIME:	return s->treetime + s->portaltime + s->areatime + s->modeltime;
+		default:		return s->treecost;
+	}
+}
+
+static void *CompileWorker(void *args)
+{
+	int worker = (int)(long)args;
+
+	char outputfilename[1024];
+	snprintf(outputfilename, sizeof(outputfilename), "%s/worker%i.bsp", tempdir, worker);
+
+	bspoptions_t options;
+	Bsp_DefaultOptions(&options);
+	options.verbose = verbose;
+
+	while (1)
+	{
+		int i = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED);
+		if (i >= numcompiling * nummaps)
+			break;
+
+		candidate_t *c = compiling + i / nummaps;
+		int map = i % nummaps;
+
+		memcpy(options.splitweights, c->weights, sizeof(options.splitweights));
+
+		bspcontext_t *context = Bsp_CreateContext(&options);
+		if (!context)
+			Fatal("Failed to create compile context\n");
+
+		bspstats_t stats;
+		bsperror_t result = Bsp_CompileMap(context, maps[map], outputfilename);
+		Bsp_GetStats(context, &stats);
+		Bsp_FreeContext(context);
+
+		c->values[map] = (result == BSP_OK ? ObjectiveValue(&stats) : -1.0);
+	}
+
+	return NULL;
+}
+
+// compile every map with every candidate of the round
+static void CompileRound(candidate_t *candidates, int numcandidates)
+{
+	compiling = candidates;
+	numcompiling = numcandidates;
+	nextjob = 0;
+
+	int workers = numworkers;
+	if (workers <= 0)
+		workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > numcandidates * nummaps)
+		workers = numcandidates * nummaps;
+	if (workers < 1)
+		workers = 1;
+
+	// the compiler's warnings would be printed for every candidate
+	int savedstderr = -1;
+	if (!verbose)
+	{
+		fflush(stderr);
+		savedstderr = dup(2);
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+		{
+			dup2(null, 2);
+			close(null);
+		}
+	}
+
+	pthread_t *threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	if (!threads)
+		Fatal("Failed to allocate workers\n");
+
+	for (int i = 0; i < workers; i++)
+	{
+		if (pthread_create(threads + i, NULL, CompileWorker, (void*)(long)i))
+			Fatal("Failed to create worker thread\n");
+	}
+
+	for (int i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	if (savedstderr >= 0)
+	{
+		fflush(stderr);
+		dup2(savedstderr, 2);
+		close(savedstderr);
+	}
+}
+
+static void RemoveTempDir()
+{
+	DIR *dir = opendir(tempdir);
+	if (!dir)
+		return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)))
+	{
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s/%s", tempdir, entry->d_name);
+		remove(filename);
+	}
+
+	closedir(dir);
+	rmdir(tempdir);
+}
+
+// ________________________________________________________________________________
+// search
+// each round tries random steps around the best weights, then a step up and
+// down on each weight in turn. The step is halved after a round that doesn't
+// find anything better, and the search ends when it's too small to matter
+
+static candidate_t AllocCandidate(const float *weights)
+{
+	candidate_t c;
+	memset(&c, 0, sizeof(c));
+	memcpy(c.weights, weights, sizeof(c.weights));
+
+	c.values = (double*)malloc(nummaps * sizeof(double));
+	if (!c.values)
+		Fatal("Failed to allocate candidate\n");
+
+	return c;
+}
+
+// the mean of each map's value over its value in the baseline. Lower is better
+static void ScoreCandidate(candidate_t *c, const candidate_t *baseline)
+{
+	c->failed = false;
+	c->score = 0.0;
+
+	for (int i = 0; i < nummaps; i++)
+	{
+		if (c->values[i] < 0.0)
+		{
+			c->failed = true;
+			return;
+		}
+
+		if (baseline->values[i] > 0.0)
+			c->score += c->values[i] / baseline->values[i];
+		else
+			c->score += (c->values[i] > 0.0 ? 2.0 : 1.0);
+	}
+
+	c->score /= nummaps;
+}
+
+static void PrintWeights(const char *label, const candidate_t *c)
+{
+	printf("%-10s", label);
+	for (int i = 0; i < NUM_SPLIT_WEIGHTS; i++)
+		printf(" %s %.3f", Bsp_SplitWeightName(i), c->weights[i]);
+	printf(" : %.4f\n", c->score);
+	fflush(stdout);
+}
+
+static void Search(candidate_t *best, const candidate_t *start)
+{
+	// every weight but the areahint has a step up and down, and the random ones
+	int maxcandidates = 2 * (NUM_SPLIT_WEIGHTS - 1) + RANDOM_CANDIDATES;
+	candidate_t *candidates = (candidate_t*)malloc(maxcandidates * sizeof(candidate_t));
+	if (!candidates)
+		Fatal("Failed to allocate candidates\n");
+	for (int i = 0; i < maxcandidates; i++)
+		candidates[i] = AllocCandidate(best->weights);
+
+	float step = FIRST_STEP;
+	for (int r = 0; r < numrounds && step >= MIN_STEP; r++)
+	{
+		int numcandidates = 0;
+
+		for (int i = 0; i < RANDOM_CANDIDATES; i++)
+		{
+			candidate_t *c = candidates + numcandidates++;
+			memcpy(c->weights, best->weights, sizeof(c->weights));
+			for (int j = SPLIT_WEIGHT_AREAHINT + 1; j < NUM_SPLIT_WEIGHTS; j++)
+				c->weights[j] += step * (2.0f * RandomFloat() - 1.0f);
+		}
+
+		for (int j = SPLIT_WEIGHT_AREAHINT + 1; j < NUM_SPLIT_WEIGHTS; j++)
+		{
+			for (int sign = -1; sign <= 1; sign += 2)
+			{
+				candidate_t *c = candidates + numcandidates++;
+				memcpy(c->weights, best->weights, sizeof(c->weights));
+				c->weights[j] += sign * step;
+			}
+		}
+
+		// the weights are all rewards, a negative one isn't tried
+		for (int i = 0; i < numcandidates; i++)
+		{
+			for (int j = 0; j < NUM_SPLIT_WEIGHTS; j++)
+			{
+				if (candidates[i].weights[j] < 0.0f)
+					candidates[i].weights[j] = 0.0f;
+			}
+		}
+
+		double time = Seconds();
+		CompileRound(candidates, numcandidates);
+
+		candidate_t *roundbest = NULL;
+		for (int i = 0; i < numcandidates; i++)
+		{
+			ScoreCandidate(candidates + i, start);
+
+			if (!candidates[i].failed && (!roundbest || candidates[i].score < roundbest->score))
+				roundbest = candidates + i;
+		}
+
+		printf("round %i: %i candidates, step %.3f, %.3fs\n", r + 1, numcandidates, step, Seconds() - time);
+
+		if (roundbest && roundbest->score < best->score)
+		{
+			memcpy(best->weights, roundbest->weights, sizeof(best->weights));
+			memcpy(best->values, roundbest->values, nummaps * sizeof(double));
+			best->score = roundbest->score;
+			PrintWeights("  better", best);
+		}
+		else
+		{
+			step *= 0.5f;
+		}
+	}
+
+	for (int i = 0; i < maxcandidates; i++)
+		free(candidates[i].values);
+	free(candidates);
+}
+
+// ________________________________________________________________________________
+
+static void PrintUsage()
+{
+	printf("bsptune [-v] [-j workers] [-o profile] [--objective nodes|splits|portals|time|cost]\n");
+	printf("        [--rounds n] [--seed n] [--start profile] mapfile ...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-v"))
+			verbose = true;
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			numworkers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			profilefilename = argv[++i];
+		else if (!strcmp(argv[i], "--rounds") && i + 1 < argc)
+			numrounds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = (unsigned int)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--start") && i + 1 < argc)
+			startfilename = argv[++i];
+		else if (!strcmp(argv[i], "--objective") && i + 1 < argc)
+		{
+			i++;
+			for (objective = 0; objective < NUM_OBJECTIVES; objective++)
+			{
+				if (!strcmp(argv[i], objectivenames[objective]))
+					break;
+			}
+			if (objective == NUM_OBJECTIVES)
+			{
+				PrintUsage();
+				exit(EXIT_FAILURE);
+			}
+		}
+		else
+			break;
+	}
+
+	if (i == argc || numrounds <= 0)
+	{
+		PrintUsage();
+		exit(EXIT_SUCCESS);
+	}
+
+	maps = (const char**)(argv + i);
+	nummaps = argc - i;
+	randstate = seed;
+
+	bspoptions_t options;
+	Bsp_DefaultOptions(&options);
+
+	float weights[NUM_SPLIT_WEIGHTS];
+	memcpy(weights, options.splitweights, sizeof(weights));
+	if (startfilename && !Bsp_ReadSplitProfile(startfilename, weights))
+	{
+		fprintf(stderr, "Failed to read split profile \"%s\"\n", startfilename);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!mkdtemp(tempdir))
+		Fatal("Failed to make a directory for the outputs\n");
+
+	// the maps that don't compile with the weights the search starts from
+	// are left out
+	candidate_t best = AllocCandidate(weights);
+	CompileRound(&best, 1);
+
+	int numkept = 0;
+	for (int j = 0; j < nummaps; j++)
+	{
+		if (best.values[j] < 0.0)
+		{
+			printf("%s: failed, left out\n", maps[j]);
+			continue;
+		}
+
+		best.values[numkept] = best.values[j];
+		maps[numkept++] = maps[j];
+	}
+	nummaps = numkept;
+
+	if (!nummaps)
+	{
+		RemoveTempDir();
+		Fatal("No maps compiled\n");
+	}
+
+	candidate_t start = AllocCandidate(weights);
+	memcpy(start.values, best.values, nummaps * sizeof(double));
+	best.score = 1.0;
+
+	printf("tuning %s over %i maps\n", objectivenames[objective], nummaps);
+	PrintWeights("start", &best);
+
+	Search(&best, &start);
+
+	RemoveTempDir();
+
+	PrintWeights("best", &best);
+
+	char comment[256];
+	snprintf(comment, sizeof(comment), "tuned for %s over %i maps, %.1f%% of the start", objectivenames[objective], nummaps, 100.0 * best.score);
+	if (!Bsp_WriteSplitProfile(profilefilename, best.weights, comment))
+	{
+		fprintf(stderr, "Failed to write split profile \"%s\"\n", profilefilename);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("wrote %s\n", profilefilename);
+
+	free(best.values);
+	free(start.values);
+
+	return 0;
+}
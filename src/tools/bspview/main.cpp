@@ -3,7 +3,13 @@
 #include <stdarg.h>
 #include <memory.h>
 #include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include <GL/freeglut.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 #include "vec3.h"
 #include "box3.h"
 #include "plane.h"
@@ -101,12 +107,21 @@ typedef struct surf_s
 {
 	struct surf_s*	next;
 
+	// the area this surface belongs to, NULL if it's always drawn
+	struct area_s*	area;
+
+	// the next surface of the same area, or of the ones always drawn
+	struct surf_s*	areanext;
+
 	int		numvertices;
 	surfvertex_t	*vertices;
 
 	int		numindicies;
 	int		*indicies;
 
+	// offset of the surface indicies in the retained index buffer
+	int		firstindex;
+
 } surf_t;
 
 typedef struct bspnode_s
@@ -151,20 +166,47 @@ typedef struct area_s
 	// used to test if we're flowing back into an area we've already been to
 	int		areavisited;
 
+	// set when a leaf of the area is inside the view frustum
+	int		areavisible;
+
 } area_t;
 
+// compact traversal nodes. Children with LEAF_BIT set are indices into tleafs
+#define LEAF_BIT	0x80000000
+
+typedef struct tnode_s
+{
+	int		planenum;
+	int		children[2];
+	int		nodenum;
+
+} tnode_t;
+
 // model data
 static int numareas;
 static area_t		*areas;
 static bspnode_t	*nodes;
+static int		numnodes;
 static portal_t		*portals;
+
+static int		headnode;
+static int		numtplanes;
+static plane_t		*tplanes;
+static int		numtnodes;
+static tnode_t		*tnodes;
+static int		numtleafs;
+static bspnode_t	**tleafs;
+static box3		*tboxes;	// node boxes then leaf boxes
 static area_t		*arealist;
 static area_t		*visibleareas;
 static surf_t		*surfaces;
+static surf_t		*unculledsurfaces;	// the surfaces without an area
 
-static void LoadNodes(FILE *fp)
+// the nodes of a packed model have a plane number into the shared planes
+// instead of the plane
+static void LoadNodes(FILE *fp, plane_t *sharedplanes, int numsharedplanes)
 {
-	int numnodes = ReadInt(fp);
+	numnodes = ReadInt(fp);
 	int numleafs = ReadInt(fp);
 	nodes = (bspnode_t*)Mem_Alloc(numnodes * sizeof(bspnode_t));
 
@@ -176,10 +218,21 @@ static void LoadNodes(FILE *fp)
 		childnum[0] = ReadInt(fp);
 		childnum[1] = ReadInt(fp);
 
-		n->plane[0] = ReadFloat(fp);
-		n->plane[1] = ReadFloat(fp);
-		n->plane[2] = ReadFloat(fp);
-		n->plane[3] = ReadFloat(fp);
+		if (sharedplanes)
+		{
+			int planenum = ReadInt(fp);
+			if (planenum < -1 || planenum >= numsharedplanes)
+				Error("Bad plane number %i\n", planenum);
+			if (planenum != -1)
+				n->plane = sharedplanes[planenum];
+		}
+		else
+		{
+			n->plane[0] = ReadFloat(fp);
+			n->plane[1] = ReadFloat(fp);
+			n->plane[2] = ReadFloat(fp);
+			n->plane[3] = ReadFloat(fp);
+		}
 
 		n->box.min[0] = ReadFloat(fp);
 		n->box.min[1] = ReadFloat(fp);
@@ -188,7 +241,7 @@ static void LoadNodes(FILE *fp)
 		n->box.max[1] = ReadFloat(fp);
 		n->box.max[2] = ReadFloat(fp);
 
-		n->empty = false;
+		n->empty = (ReadInt(fp) != 0);
 
 		// setup the child pointers
 		n->children[0] = nodes + childnum[0];
@@ -300,7 +353,28 @@ static void LoadRenderModel(FILE *fp)
 	{
 		char name[64];
 		int len = ReadInt(fp);
+		if (len < 0 || len >= (int)sizeof(name))
+			Error("Bad render model name length %i\n", len);
 		ReadBytes(name, len, fp);
+		name[len] = '\0';
+
+		// area models are culled with the area they belong to
+		int areanum;
+		if (sscanf(name, "area%d", &areanum) == 1)
+		{
+			if (areanum < 0 || areanum >= numareas)
+				Error("Render model \"%s\" has no area\n", name);
+
+			s->area = areas + areanum;
+			s->areanext = s->area->surfaces;
+			s->area->surfaces = s;
+			s->area->numsurfaces++;
+		}
+		else
+		{
+			s->areanext = unculledsurfaces;
+			unculledsurfaces = s;
+		}
 	}
 
 	// read the vertex block
@@ -327,23 +401,292 @@ static void LoadRenderModel(FILE *fp)
 	//CalculateNormals(s);
 }
 
-static void LoadData(FILE *fp)
+static void LoadPlanes(FILE *fp)
+{
+	numtplanes = ReadInt(fp);
+	tplanes = (plane_t*)Mem_Alloc(numtplanes * sizeof(plane_t));
+
+	for (int i = 0; i < numtplanes; i++)
+	{
+		tplanes[i].a = ReadFloat(fp);
+		tplanes[i].b = ReadFloat(fp);
+		tplanes[i].c = ReadFloat(fp);
+		tplanes[i].d = ReadFloat(fp);
+	}
+}
+
+static void LoadCompactNodes(FILE *fp)
+{
+	numtnodes = ReadInt(fp);
+	headnode = ReadInt(fp);
+	tnodes = (tnode_t*)Mem_Alloc(numtnodes * sizeof(tnode_t) + 1);
+
+	for (int i = 0; i < numtnodes; i++)
+	{
+		tnodes[i].planenum = ReadInt(fp);
+		tnodes[i].children[0] = ReadInt(fp);
+		tnodes[i].children[1] = ReadInt(fp);
+		tnodes[i].nodenum = ReadInt(fp);
+	}
+}
+
+static void LoadCompactLeafs(FILE *fp)
+{
+	numtleafs = ReadInt(fp);
+	tleafs = (bspnode_t**)Mem_Alloc(numtleafs * sizeof(bspnode_t*));
+
+	for (int i = 0; i < numtleafs; i++)
+	{
+		tleafs[i] = nodes + ReadInt(fp);
+		ReadInt(fp);
+	}
+}
+
+static void LoadCompactBoxes(FILE *fp)
+{
+	int numboxes = ReadInt(fp);
+	tboxes = (box3*)Mem_Alloc(numboxes * sizeof(box3));
+
+	for (int i = 0; i < numboxes; i++)
+	{
+		tboxes[i].min[0] = ReadFloat(fp);
+		tboxes[i].min[1] = ReadFloat(fp);
+		tboxes[i].min[2] = ReadFloat(fp);
+		tboxes[i].max[0] = ReadFloat(fp);
+		tboxes[i].max[1] = ReadFloat(fp);
+		tboxes[i].max[2] = ReadFloat(fp);
+	}
+}
+
+// flags of an implicit leaf record
+#define INODE_EMPTY	0x1
+
+// a child's box is its parent's cut down by the parent's plane where the plane
+// is along an axis, the same as the compiler makes them
+static box3 ClipBoxWithPlane(box3 box, plane_t plane)
+{
+	box3 clipped = box;
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (plane[i] == 1)
+			clipped.min[i] = -plane[3];
+		else if (plane[i] == -1)
+			clipped.max[i] = plane[3];
+	}
+
+	return clipped;
+}
+
+// the implicit pre-order records are written instead of the node block. The
+// front child of a node is the next record, and the boxes are made from the
+// root box. The planes lump comes first
+static void LoadImplicitNodes(FILE *fp)
 {
+	numnodes = ReadInt(fp);
+	nodes = (bspnode_t*)Mem_Alloc(numnodes * sizeof(bspnode_t));
+
+	box3 *box = &nodes[0].box;
+	box->min[0] = ReadFloat(fp);
+	box->min[1] = ReadFloat(fp);
+	box->min[2] = ReadFloat(fp);
+	box->max[0] = ReadFloat(fp);
+	box->max[1] = ReadFloat(fp);
+	box->max[2] = ReadFloat(fp);
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		bspnode_t *n = nodes + i;
+
+		int data0 = ReadInt(fp);
+		int data1 = ReadInt(fp);
+
+		if (data0 & LEAF_BIT)
+		{
+			n->empty = (data0 & INODE_EMPTY) != 0;
+			continue;
+		}
+
+		if (data0 >= numtplanes)
+			Error("Bad plane number %i\n", data0);
+		if (data1 < 2 || data1 >= numnodes - i)
+			Error("Bad back child offset %i\n", data1);
+
+		n->plane = tplanes[data0];
+		n->children[0] = n + 1;
+		n->children[1] = n + data1;
+
+		// children come after their parent
+		n->children[0]->box = ClipBoxWithPlane(n->box, n->plane);
+		n->children[1]->box = ClipBoxWithPlane(n->box, -n->plane);
+	}
+}
+
+// build the compact nodes in depth first order for files without them. The
+// node block is in pre-order, so numbering in file order does that
+static void BuildCompactNodes()
+{
+	int *index = (int*)Mem_Alloc(numnodes * sizeof(int));
+
+	numtnodes = numtleafs = 0;
+	for (int i = 0; i < numnodes; i++)
+	{
+		if (!nodes[i].children[0] && !nodes[i].children[1])
+			index[i] = numtleafs++ | LEAF_BIT;
+		else
+			index[i] = numtnodes++;
+	}
+
+	numtplanes = numtnodes;
+	tplanes = (plane_t*)Mem_Alloc(numtplanes * sizeof(plane_t) + 1);
+	tnodes = (tnode_t*)Mem_Alloc(numtnodes * sizeof(tnode_t) + 1);
+	tleafs = (bspnode_t**)Mem_Alloc(numtleafs * sizeof(bspnode_t*));
+	tboxes = (box3*)Mem_Alloc(numnodes * sizeof(box3));
+	headnode = index[0];
+
+	for (int i = 0; i < numnodes; i++)
+	{
+		bspnode_t *n = nodes + i;
+
+		if (index[i] & LEAF_BIT)
+		{
+			tleafs[index[i] & ~LEAF_BIT] = n;
+			tboxes[numtnodes + (index[i] & ~LEAF_BIT)] = n->box;
+			continue;
+		}
+
+		tnode_t *t = tnodes + index[i];
+		t->planenum = index[i];
+		t->children[0] = index[n->children[0] - nodes];
+		t->children[1] = index[n->children[1] - nodes];
+		t->nodenum = i;
+		tplanes[index[i]] = n->plane;
+		tboxes[index[i]] = n->box;
+	}
+}
+
+// link the portals between empty leafs in different areas into the source area
+static void LinkAreaPortals()
+{
+	for (portal_t *p = portals; p; p = p->next)
+	{
+		if (!p->srcleaf->empty || !p->dstleaf->empty)
+			continue;
+		if (!p->srcleaf->area || !p->dstleaf->area)
+			continue;
+		if (p->srcleaf->area == p->dstleaf->area)
+			continue;
+
+		area_t *a = p->srcleaf->area;
+		p->areanext = a->portals;
+		a->portals = p;
+		a->numportals++;
+	}
+}
+
+static void LoadLump(const char *header, FILE *fp);
+
+// the model of a packed file to view, the first if it's NULL
+static const char *viewmodel;
+
+// read the directory of a packed file, load the model's section then carry on
+// after the last section
+static void LoadPackedModel(FILE *fp)
+{
+	int nummodels = ReadInt(fp);
+	int offset = -1, numbytes = 0;
+	int sectionsend = 0;
+
+	for (int i = 0; i < nummodels; i++)
+	{
+		char name[64];
+		int len = ReadInt(fp);
+		if (len < 0 || len >= (int)sizeof(name))
+			Error("Bad model name length %i\n", len);
+		ReadBytes(name, len, fp);
+		name[len] = '\0';
+
+		for (int j = 0; j < 6 + 5; j++)
+			ReadInt(fp);
+		int modeloffset = ReadInt(fp);
+		int modelbytes = ReadInt(fp);
+
+		if (offset == -1 && (!viewmodel || !strcmp(viewmodel, name)))
+		{
+			offset = modeloffset;
+			numbytes = modelbytes;
+		}
+		if (modeloffset + modelbytes > sectionsend)
+			sectionsend = modeloffset + modelbytes;
+	}
+
+	if (offset == -1)
+		Error("No model \"%s\" in the file\n", (viewmodel ? viewmodel : ""));
+
 	char header[8];
-	while (ReadBytes(header, 8, fp) != 0)
+	ReadBytes(header, 8, fp);
+	if (strncmp(header, "planes", 8))
+		Error("Expected the shared planes after the model directory\n");
+
+	int numsharedplanes = ReadInt(fp);
+	plane_t *sharedplanes = (plane_t*)Mem_Alloc(numsharedplanes * sizeof(plane_t) + 1);
+	for (int i = 0; i < numsharedplanes; i++)
+	{
+		sharedplanes[i].a = ReadFloat(fp);
+		sharedplanes[i].b = ReadFloat(fp);
+		sharedplanes[i].c = ReadFloat(fp);
+		sharedplanes[i].d = ReadFloat(fp);
+	}
+
+	fseek(fp, offset, SEEK_SET);
+	while (ftell(fp) < offset + numbytes && ReadBytes(header, 8, fp) != 0)
 	{
-		//printf("processing header: %8s\n", header);
-		if (!strncmp(header, "nodes", 8))
-			LoadNodes(fp);
-		else if (!strncmp(header, "areas", 8))
-			LoadAreas(fp);
-		else if (!strncmp(header, "portals", 8))
-			LoadPortals(fp);
-		else if (!strncmp(header, "rmodel", 8))
-			LoadRenderModel(fp);
+		if (!strncmp(header, "mnodes", 8))
+			LoadNodes(fp, sharedplanes, numsharedplanes);
 		else
-			Error("Unknown header \"%8s\"\n", header);
+			LoadLump(header, fp);
 	}
+
+	fseek(fp, sectionsend, SEEK_SET);
+}
+
+static void LoadLump(const char *header, FILE *fp)
+{
+	//printf("processing header: %8s\n", header);
+	if (!strncmp(header, "nodes", 8))
+		LoadNodes(fp, NULL, 0);
+	else if (!strncmp(header, "areas", 8))
+		LoadAreas(fp);
+	else if (!strncmp(header, "portals", 8))
+		LoadPortals(fp);
+	else if (!strncmp(header, "rmodel", 8))
+		LoadRenderModel(fp);
+	else if (!strncmp(header, "planes", 8))
+		LoadPlanes(fp);
+	else if (!strncmp(header, "tnodes", 8))
+		LoadCompactNodes(fp);
+	else if (!strncmp(header, "tleafs", 8))
+		LoadCompactLeafs(fp);
+	else if (!strncmp(header, "tboxes", 8))
+		LoadCompactBoxes(fp);
+	else if (!strncmp(header, "inodes", 8))
+		LoadImplicitNodes(fp);
+	else if (!strncmp(header, "models", 8))
+		LoadPackedModel(fp);
+	else
+		Error("Unknown header \"%8s\"\n", header);
+}
+
+static void LoadData(FILE *fp)
+{
+	char header[8];
+	while (ReadBytes(header, 8, fp) != 0)
+		LoadLump(header, fp);
+
+	if (!tnodes)
+		BuildCompactNodes();
+
+	LinkAreaPortals();
 }
 
 //==============================================
@@ -533,6 +876,7 @@ typedef struct rs_s
 
 	// clipping planes
 	plane_t		planes[64];
+	int		numplanes;
 
 	bool		vis;
 	bool		showportals;
@@ -558,31 +902,51 @@ typedef struct drawvertex_s
 typedef struct drawbuffer_s
 {
 	int		numvertices;
+	int		maxvertices;
 	drawvertex_t	*vertices;
 
 	int		numindicies;
+	int		maxindicies;
 	int		*indicies;
 
 } drawbuffer_t;
 
 static drawbuffer_t drawbuffer;
 
+// grow the buffers to hold at least the requested number of elements
+static void DrawBufferReserve(drawbuffer_t *b, int numvertices, int numindicies)
+{
+	if (numvertices > b->maxvertices)
+	{
+		int max = (b->maxvertices ? b->maxvertices : 64 * 1024);
+		while (max < numvertices)
+			max *= 2;
+
+		b->vertices = (drawvertex_t*)realloc(b->vertices, max * sizeof(drawvertex_t));
+		if (!b->vertices)
+			Error("Out of vertex space\n");
+		b->maxvertices = max;
+	}
+
+	if (numindicies > b->maxindicies)
+	{
+		int max = (b->maxindicies ? b->maxindicies : 256 * 1024);
+		while (max < numindicies)
+			max *= 2;
+
+		b->indicies = (int*)realloc(b->indicies, max * sizeof(int));
+		if (!b->indicies)
+			Error("Out of index space\n");
+		b->maxindicies = max;
+	}
+}
+
 // copy the vertex data in to the drawbuffer
 static void CopySurface(drawbuffer_t *b, surf_t *s)
 {
 	int base;
 
-	// allocate the buffer on first call
-	if (!b->vertices)
-		b->vertices = (drawvertex_t*)malloc(1024 * 1024 * 2);
-	if (!b->indicies)
-		b->indicies = (int*)malloc(1024 * 1024 * 4);
-	
-	// check for overflow of the buffers
-	if ((b->numvertices + s->numvertices) * sizeof(drawvertex_t) > (1024 * 1024 * 2))
-		Error("Out of vertex space\n");
-	if ((b->numindicies + s->numindicies) * sizeof(int) > (1024 * 1024 * 4))
-		Error("Out of index space\n");
+	DrawBufferReserve(b, b->numvertices + s->numvertices, b->numindicies + s->numindicies);
 
 	base = b->numvertices;
 	for (int i = 0; i < s->numvertices; i++)
@@ -598,6 +962,7 @@ static void CopySurface(drawbuffer_t *b, surf_t *s)
 		b->vertices[base + i].color[0] = s->vertices[i].color[0];
 		b->vertices[base + i].color[1] = s->vertices[i].color[1];
 		b->vertices[base + i].color[2] = s->vertices[i].color[2];
+		b->vertices[base + i].color[3] = 1.0f;
 		b->numvertices++;
 	}
 
@@ -699,6 +1064,252 @@ static void DrawLit(drawbuffer_t *b)
 	glDisableClientState(GL_COLOR_ARRAY);
 }
 
+// ________________________________________________________________________________ 
+// retained world geometry
+//
+// the surfaces are uploaded once into a single vertex and index buffer object
+// and the lighting is done in a shader, so the per frame cost is a draw call for
+// each run of visible surfaces. Software GL implementations fall back to the
+// client array path above, where the buffer objects just add copies
+
+typedef struct drawlist_s
+{
+	int		numsurfaces;
+	int		maxsurfaces;
+	surf_t		**surfaces;
+
+} drawlist_t;
+
+typedef struct glstate_s
+{
+	bool		retained;
+
+	GLuint		vbo;
+	GLuint		ibo;
+
+	GLuint		program;
+	GLint		lightdir;
+	GLint		mode;
+
+} glstate_t;
+
+static glstate_t gls;
+static drawlist_t drawlist;
+
+static const char *worldvertexshader =
+	"#version 120\n"
+	"uniform vec3 lightdir;\n"
+	"uniform int mode;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 n = gl_Normal;\n"
+	"	if (mode == 1)\n"
+	"		gl_FrontColor = vec4(0.5 + 0.5 * n, 1.0);\n"
+	"	else\n"
+	"		gl_FrontColor = vec4(vec3(0.75 * (0.6 * max(dot(n, lightdir), 0.0) + 0.4)), 1.0);\n"
+	"	gl_BackColor = gl_FrontColor;\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+static const char *worldfragmentshader =
+	"#version 120\n"
+	"void main()\n"
+	"{\n"
+	"	gl_FragColor = gl_Color;\n"
+	"}\n";
+
+static GLuint CompileShader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		Warning("Shader compile failed: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static bool CreateWorldProgram()
+{
+	GLuint vs = CompileShader(GL_VERTEX_SHADER, worldvertexshader);
+	GLuint fs = CompileShader(GL_FRAGMENT_SHADER, worldfragmentshader);
+	if (!vs || !fs)
+		return false;
+
+	gls.program = glCreateProgram();
+	glAttachShader(gls.program, vs);
+	glAttachShader(gls.program, fs);
+	glLinkProgram(gls.program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint status;
+	glGetProgramiv(gls.program, GL_LINK_STATUS, &status);
+	if (!status)
+	{
+		char log[1024];
+		glGetProgramInfoLog(gls.program, sizeof(log), NULL, log);
+		Warning("Shader link failed: %s\n", log);
+		glDeleteProgram(gls.program);
+		gls.program = 0;
+		return false;
+	}
+
+	gls.lightdir = glGetUniformLocation(gls.program, "lightdir");
+	gls.mode = glGetUniformLocation(gls.program, "mode");
+
+	return true;
+}
+
+// software rasterizers and pre 2.0 implementations use client arrays
+static bool UseRetainedPath()
+{
+	const char *renderer = (const char*)glGetString(GL_RENDERER);
+	const char *version = (const char*)glGetString(GL_VERSION);
+
+	if (!renderer || !version)
+		return false;
+
+	if (strstr(renderer, "llvmpipe") || strstr(renderer, "softpipe") || strstr(renderer, "Software"))
+		return false;
+
+	if (atoi(version) < 2)
+		return false;
+
+	return true;
+}
+
+static void UploadSurfaces()
+{
+	drawbuffer_t b;
+	memset(&b, 0, sizeof(b));
+
+	// build the whole world in a temporary buffer keeping each surface's offset.
+	// The surfaces of an area are kept together so a visible area is one draw
+	for (int i = 0; i < numareas; i++)
+	{
+		for (surf_t *s = areas[i].surfaces; s; s = s->areanext)
+		{
+			s->firstindex = b.numindicies;
+			CopySurface(&b, s);
+		}
+	}
+
+	for (surf_t *s = unculledsurfaces; s; s = s->areanext)
+	{
+		s->firstindex = b.numindicies;
+		CopySurface(&b, s);
+	}
+
+	glGenBuffers(1, &gls.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, gls.vbo);
+	glBufferData(GL_ARRAY_BUFFER, b.numvertices * sizeof(drawvertex_t), b.vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &gls.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gls.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, b.numindicies * sizeof(int), b.indicies, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	free(b.vertices);
+	free(b.indicies);
+}
+
+static void InitRenderer()
+{
+	printf("renderer: %s\n", (const char*)glGetString(GL_RENDERER));
+
+	gls.retained = UseRetainedPath() && CreateWorldProgram();
+	if (gls.retained)
+		UploadSurfaces();
+
+	printf("retained: %s\n", (gls.retained ? "on" : "off"));
+}
+
+static void DrawListAdd(drawlist_t *l, surf_t *s)
+{
+	if (l->numsurfaces == l->maxsurfaces)
+	{
+		l->maxsurfaces = (l->maxsurfaces ? l->maxsurfaces * 2 : 1024);
+		l->surfaces = (surf_t**)realloc(l->surfaces, l->maxsurfaces * sizeof(surf_t*));
+		if (!l->surfaces)
+			Error("Out of draw list space\n");
+	}
+
+	l->surfaces[l->numsurfaces++] = s;
+}
+
+static void DrawList(drawlist_t *l)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, gls.vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gls.ibo);
+
+	glVertexPointer(3, GL_FLOAT, sizeof(drawvertex_t), (void*)offsetof(drawvertex_t, xyz));
+	glNormalPointer(GL_FLOAT, sizeof(drawvertex_t), (void*)offsetof(drawvertex_t, normal));
+
+	// merge surfaces that are adjacent in the index buffer into a single draw
+	for (int i = 0; i < l->numsurfaces;)
+	{
+		int first = l->surfaces[i]->firstindex;
+		int count = l->surfaces[i]->numindicies;
+
+		for (i++; i < l->numsurfaces && l->surfaces[i]->firstindex == first + count; i++)
+			count += l->surfaces[i]->numindicies;
+
+		glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (void*)(first * sizeof(int)));
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+static void DrawListShaded(drawlist_t *l, int mode)
+{
+	glUseProgram(gls.program);
+	glUniform3f(gls.lightdir, -rs.viewvectors[0][0], -rs.viewvectors[0][1], -rs.viewvectors[0][2]);
+	glUniform1i(gls.mode, mode);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+
+	DrawList(l);
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+
+	glUseProgram(0);
+}
+
+static void DrawListWireframe(drawlist_t *l)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+
+	// draw solid color
+	glColor3f(1, 1, 1);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	DrawList(l);
+
+	// draw wireframe outline
+	glColor3f(0, 0, 0);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(-1, -2);
+	DrawList(l);
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
 static void MatrixMultiply(float out[4][4], const float a[4][4], const float b[4][4])
 {
 	for( int i = 0; i < 4; i++ )
@@ -859,12 +1470,265 @@ static void SetupMatrices()
 
 	SetupProjectionMatrix();
 
-	SetupGLMatrixState();
-
 	// build the clip matrix
 	MatrixMultiply(rs.clip, rs.projection, rs.view);
 }
 
+// ________________________________________________________________________________ 
+// area visibility
+//
+// find the leaf the view is in and flood out from its area through the portals
+// that can be seen. If the view is in solid everything is drawn
+
+static int visframe;
+
+static bspnode_t *FindLeaf(float pos[3])
+{
+	int child = headnode;
+	vec3 p = Vec3FromFloat(pos);
+
+	while (!(child & LEAF_BIT))
+	{
+		tnode_t *n = tnodes + child;
+		int side = (Distance(tplanes[n->planenum], p) >= 0.0f ? 0 : 1);
+
+		child = n->children[side];
+	}
+
+	return tleafs[child & ~LEAF_BIT];
+}
+
+// reject the portal if all of its vertices are outside the same clip plane
+static bool PortalVisible(portal_t *p)
+{
+	int clipbits = 0x3f;
+
+	for (int i = 0; i < p->numvertices && clipbits; i++)
+	{
+		float v[4];
+		for (int j = 0; j < 4; j++)
+		{
+			v[j] = rs.clip[j][0] * p->vertices[i][0]
+				+ rs.clip[j][1] * p->vertices[i][1]
+				+ rs.clip[j][2] * p->vertices[i][2]
+				+ rs.clip[j][3];
+		}
+
+		int bits = 0;
+		bits |= (v[0] < -v[3] ? 0x01 : 0);
+		bits |= (v[0] >  v[3] ? 0x02 : 0);
+		bits |= (v[1] < -v[3] ? 0x04 : 0);
+		bits |= (v[1] >  v[3] ? 0x08 : 0);
+		bits |= (v[2] < -v[3] ? 0x10 : 0);
+		bits |= (v[2] >  v[3] ? 0x20 : 0);
+
+		clipbits &= bits;
+	}
+
+	return (clipbits == 0);
+}
+
+static void FloodAreasRecursive(area_t *a)
+{
+	a->areavisited = visframe;
+
+	for (portal_t *p = a->portals; p; p = p->areanext)
+	{
+		area_t *next = p->dstleaf->area;
+		if (next->areavisited == visframe)
+			continue;
+
+		if (!PortalVisible(p))
+			continue;
+
+		FloodAreasRecursive(next);
+	}
+}
+
+// ________________________________________________________________________________ 
+// frustum culling
+//
+// the frustum planes are extracted from the clip matrix and the node boxes are
+// tested against them from the root down. A node passes on a mask of the planes
+// its box still crosses, so once a box is fully inside the frustum its subtree
+// is walked without any further tests
+
+#define MAX_FRUSTUM_PLANES	8
+
+// the frustum planes in structure of arrays form for the box kernel. Unused
+// planes are set up to pass everything
+typedef struct frustum_s
+{
+	float	a[MAX_FRUSTUM_PLANES];
+	float	b[MAX_FRUSTUM_PLANES];
+	float	c[MAX_FRUSTUM_PLANES];
+	float	d[MAX_FRUSTUM_PLANES];
+
+	float	absa[MAX_FRUSTUM_PLANES];
+	float	absb[MAX_FRUSTUM_PLANES];
+	float	absc[MAX_FRUSTUM_PLANES];
+
+} frustum_t;
+
+static frustum_t frustum;
+
+static plane_t ClipPlane(int row, float sign)
+{
+	plane_t p;
+	p.a = rs.clip[3][0] + sign * rs.clip[row][0];
+	p.b = rs.clip[3][1] + sign * rs.clip[row][1];
+	p.c = rs.clip[3][2] + sign * rs.clip[row][2];
+	p.d = rs.clip[3][3] + sign * rs.clip[row][3];
+
+	float length = sqrtf(p.a * p.a + p.b * p.b + p.c * p.c);
+	p.a /= length;
+	p.b /= length;
+	p.c /= length;
+	p.d /= length;
+
+	return p;
+}
+
+// left, right, bottom, top, near and far planes, all facing into the frustum
+static void SetupFrustum()
+{
+	rs.numplanes = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		rs.planes[rs.numplanes++] = ClipPlane(i,  1.0f);
+		rs.planes[rs.numplanes++] = ClipPlane(i, -1.0f);
+	}
+
+	for (int i = 0; i < MAX_FRUSTUM_PLANES; i++)
+	{
+		plane_t p = (i < rs.numplanes ? rs.planes[i] : plane_t(0, 0, 0, 1));
+
+		frustum.a[i] = p.a;
+		frustum.b[i] = p.b;
+		frustum.c[i] = p.c;
+		frustum.d[i] = p.d;
+		frustum.absa[i] = fabsf(p.a);
+		frustum.absb[i] = fabsf(p.b);
+		frustum.absc[i] = fabsf(p.c);
+	}
+}
+
+// test the box against the planes in mask. Returns -1 if the box is outside
+// one of them, otherwise the mask of the planes the box crosses
+static int CullBox(const frustum_t *f, const box3 &box, int mask)
+{
+	float center[3], extents[3];
+	for (int i = 0; i < 3; i++)
+	{
+		center[i] = 0.5f * (box.min[i] + box.max[i]);
+		extents[i] = 0.5f * (box.max[i] - box.min[i]);
+	}
+
+	int outside = 0;
+	int inside = 0;
+
+#if defined(__SSE__)
+	// four planes at a time: the box center distance and the projected radius
+	__m128 cx = _mm_set1_ps(center[0]);
+	__m128 cy = _mm_set1_ps(center[1]);
+	__m128 cz = _mm_set1_ps(center[2]);
+	__m128 ex = _mm_set1_ps(extents[0]);
+	__m128 ey = _mm_set1_ps(extents[1]);
+	__m128 ez = _mm_set1_ps(extents[2]);
+	__m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < MAX_FRUSTUM_PLANES; i += 4)
+	{
+		__m128 dist = _mm_loadu_ps(f->d + i);
+		dist = _mm_add_ps(dist, _mm_mul_ps(_mm_loadu_ps(f->a + i), cx));
+		dist = _mm_add_ps(dist, _mm_mul_ps(_mm_loadu_ps(f->b + i), cy));
+		dist = _mm_add_ps(dist, _mm_mul_ps(_mm_loadu_ps(f->c + i), cz));
+
+		__m128 radius = _mm_mul_ps(_mm_loadu_ps(f->absa + i), ex);
+		radius = _mm_add_ps(radius, _mm_mul_ps(_mm_loadu_ps(f->absb + i), ey));
+		radius = _mm_add_ps(radius, _mm_mul_ps(_mm_loadu_ps(f->absc + i), ez));
+
+		outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, radius), zero)) << i;
+		inside |= _mm_movemask_ps(_mm_cmpge_ps(_mm_sub_ps(dist, radius), zero)) << i;
+	}
+#else
+	for (int i = 0; i < MAX_FRUSTUM_PLANES; i++)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+
+		float dist = f->a[i] * center[0] + f->b[i] * center[1] + f->c[i] * center[2] + f->d[i];
+		float radius = f->absa[i] * extents[0] + f->absb[i] * extents[1] + f->absc[i] * extents[2];
+
+		if (dist + radius < 0.0f)
+			outside |= (1 << i);
+		else if (dist - radius >= 0.0f)
+			inside |= (1 << i);
+	}
+#endif
+
+	if (outside & mask)
+		return -1;
+
+	return mask & ~inside;
+}
+
+static void AddVisibleLeaf(bspnode_t *n)
+{
+	area_t *a = n->area;
+
+	// only areas the flood reached are drawn
+	if (!a || a->areavisited != visframe || a->areavisible == visframe)
+		return;
+
+	a->areavisible = visframe;
+	a->visiblenext = visibleareas;
+	visibleareas = a;
+}
+
+static void CullNodesRecursive(int child, int mask)
+{
+	bool leaf = (child & LEAF_BIT) != 0;
+	int index = child & ~LEAF_BIT;
+
+	if (mask)
+	{
+		mask = CullBox(&frustum, tboxes[leaf ? numtnodes + index : index], mask);
+		if (mask == -1)
+			return;
+	}
+
+	if (leaf)
+	{
+		AddVisibleLeaf(tleafs[index]);
+		return;
+	}
+
+	CullNodesRecursive(tnodes[index].children[0], mask);
+	CullNodesRecursive(tnodes[index].children[1], mask);
+}
+
+static void FindVisibleAreas()
+{
+	visframe++;
+	visibleareas = NULL;
+
+	bspnode_t *leaf = FindLeaf(rs.pos);
+
+	// flood through the portals from the view area, or let everything through
+	if (rs.vis && leaf->empty && leaf->area)
+		FloodAreasRecursive(leaf->area);
+	else
+	{
+		for (area_t *a = arealist; a; a = a->next)
+			a->areavisited = visframe;
+	}
+
+	SetupFrustum();
+
+	CullNodesRecursive(headnode, (1 << rs.numplanes) - 1);
+}
+
 // ________________________________________________________________________________ 
 // top level drawing stuff
 
@@ -1006,25 +1870,51 @@ static void DrawPortals()
 		DrawPortal(p);
 }
 
-static void PresentSurfaces(drawbuffer_t *b)
+static void PresentSurface(surf_t *s)
 {
-	// flush the drawbuffer
-	b->numvertices = 0;
-	b->numindicies = 0;
+	// cull degenerate surfaces
+	if (!s->numvertices || !s->numindicies)
+		return;
 
-	// build the drawbuffer from visible areas
-	for (surf_t *s = surfaces; s; s = s->next)
-	{
-		// cull degenerate surfaces
-		if (!s->numvertices || !s->numindicies)
-			continue;
+	// the retained path only needs to know which surfaces to draw
+	if (gls.retained)
+		DrawListAdd(&drawlist, s);
+	else
+		CopySurface(&drawbuffer, s);
+}
 
-		CopySurface(b, s);
+static void PresentSurfaces()
+{
+	// flush the drawbuffer and draw list
+	drawbuffer.numvertices = 0;
+	drawbuffer.numindicies = 0;
+	drawlist.numsurfaces = 0;
+
+	// build the drawbuffer from the areas culling found, so the cost follows
+	// what can be seen rather than the size of the world
+	for (area_t *a = visibleareas; a; a = a->visiblenext)
+	{
+		for (surf_t *s = a->surfaces; s; s = s->areanext)
+			PresentSurface(s);
 	}
+
+	for (surf_t *s = unculledsurfaces; s; s = s->areanext)
+		PresentSurface(s);
 }
 
 static void DrawWorld()
 {
+	if (gls.retained)
+	{
+		if (rs.rendermode == 0)
+			DrawListShaded(&drawlist, 0);
+		else if (rs.rendermode == 1)
+			DrawListShaded(&drawlist, 1);
+		else if (rs.rendermode == 2)
+			DrawListWireframe(&drawlist);
+		return;
+	}
+
 	if (rs.rendermode == 0)
 		DrawLit(&drawbuffer);
 	else if (rs.rendermode == 1)
@@ -1090,7 +1980,11 @@ static void DrawFrame()
 
 	SetupMatrices();
 
-	PresentSurfaces(&drawbuffer);
+	SetupGLMatrixState();
+
+	FindVisibleAreas();
+
+	PresentSurfaces();
 
 	Draw();
 
@@ -1098,6 +1992,191 @@ static void DrawFrame()
 }
 
 
+//==============================================
+// camera paths and benchmarking
+//
+// a camera path is a text file with the view position and angles of each tick,
+// one tick per line. The benchmark replays a path without a window and times
+// the per frame cpu work: leaf lookup, area flood, surface setup and lighting
+
+typedef struct camerapath_s
+{
+	int		numticks;
+	int		maxticks;
+	viewstate_t	*ticks;
+
+} camerapath_t;
+
+typedef struct benchframe_s
+{
+	double		usec;
+	int		numtriangles;
+	int		numareas;
+
+} benchframe_t;
+
+static FILE *recordfp;
+
+static void ToggleRecording()
+{
+	if (recordfp)
+	{
+		FileClose(recordfp);
+		recordfp = NULL;
+		printf("recording: off\n");
+		return;
+	}
+
+	recordfp = FileOpenTextWrite("camera.path");
+	printf("recording: camera.path\n");
+}
+
+static void RecordTick()
+{
+	if (!recordfp)
+		return;
+
+	fprintf(recordfp, "%f %f %f %f %f %f\n",
+		viewstate.pos[0], viewstate.pos[1], viewstate.pos[2],
+		viewstate.angles[0], viewstate.angles[1], viewstate.angles[2]);
+}
+
+static void LoadCameraPath(camerapath_t *path, const char *filename)
+{
+	FILE *fp = FileOpenTextRead(filename);
+
+	memset(path, 0, sizeof(*path));
+
+	viewstate_t v = viewstate;
+	while (fscanf(fp, "%f %f %f %f %f %f", &v.pos[0], &v.pos[1], &v.pos[2], &v.angles[0], &v.angles[1], &v.angles[2]) == 6)
+	{
+		if (path->numticks == path->maxticks)
+		{
+			path->maxticks = (path->maxticks ? path->maxticks * 2 : 1024);
+			path->ticks = (viewstate_t*)realloc(path->ticks, path->maxticks * sizeof(viewstate_t));
+			if (!path->ticks)
+				Error("Out of camera path space\n");
+		}
+
+		path->ticks[path->numticks++] = v;
+	}
+
+	FileClose(fp);
+
+	if (!path->numticks)
+		Error("Camera path \"%s\" has no ticks\n", filename);
+}
+
+static double TimeMicroseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+// nearest rank percentile of sorted values
+static double Percentile(double *sorted, int count, double p)
+{
+	int rank = (int)ceil(p / 100.0 * count) - 1;
+	if (rank < 0)
+		rank = 0;
+	if (rank > count - 1)
+		rank = count - 1;
+
+	return sorted[rank];
+}
+
+static void PrintBenchmark(benchframe_t *frames, int numframes, const char *format)
+{
+	double *sorted = (double*)malloc(numframes * sizeof(double));
+	double total = 0.0;
+
+	for (int i = 0; i < numframes; i++)
+	{
+		sorted[i] = frames[i].usec;
+		total += frames[i].usec;
+	}
+	qsort(sorted, numframes, sizeof(double), CompareDouble);
+
+	double mean = total / numframes;
+	double p50 = Percentile(sorted, numframes, 50.0);
+	double p90 = Percentile(sorted, numframes, 90.0);
+	double p99 = Percentile(sorted, numframes, 99.0);
+
+	if (!strcmp(format, "json"))
+	{
+		printf("{\n\t\"frames\": [\n");
+		for (int i = 0; i < numframes; i++)
+		{
+			printf("\t\t{ \"frame\": %i, \"usec\": %.3f, \"triangles\": %i, \"areas\": %i }%s\n",
+				i, frames[i].usec, frames[i].numtriangles, frames[i].numareas, (i == numframes - 1 ? "" : ","));
+		}
+		printf("\t],\n");
+		printf("\t\"summary\": { \"frames\": %i, \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f }\n",
+			numframes, mean, sorted[0], p50, p90, p99, sorted[numframes - 1]);
+		printf("}\n");
+	}
+	else
+	{
+		// the summary goes in comment lines so the frame rows stay a single table
+		printf("frame,usec,triangles,areas\n");
+		for (int i = 0; i < numframes; i++)
+			printf("%i,%.3f,%i,%i\n", i, frames[i].usec, frames[i].numtriangles, frames[i].numareas);
+		printf("# frames %i mean %.3f min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+			numframes, mean, sorted[0], p50, p90, p99, sorted[numframes - 1]);
+	}
+
+	free(sorted);
+}
+
+static void RunBenchmark(const char *pathname, const char *format)
+{
+	camerapath_t path;
+
+	SetupDefaultViewState();
+	LoadCameraPath(&path, pathname);
+
+	// match the interactive defaults, but with area culling on
+	rs.renderwidth = 400;
+	rs.renderheight = 400;
+	rs.filterlevel = -1;
+	rs.vis = true;
+
+	benchframe_t *frames = (benchframe_t*)malloc(path.numticks * sizeof(benchframe_t));
+
+	for (int i = 0; i < path.numticks; i++)
+	{
+		viewstate = path.ticks[i];
+
+		double start = TimeMicroseconds();
+
+		SetupMatrices();
+		FindVisibleAreas();
+		PresentSurfaces();
+		CalculateLighting(&drawbuffer);
+
+		frames[i].usec = TimeMicroseconds() - start;
+		frames[i].numtriangles = drawbuffer.numindicies / 3;
+		frames[i].numareas = 0;
+		for (area_t *a = visibleareas; a; a = a->visiblenext)
+			frames[i].numareas++;
+	}
+
+	PrintBenchmark(frames, path.numticks, format);
+
+	free(frames);
+	free(path.ticks);
+}
+
 //==============================================
 // GLUT OS windowing code
 
@@ -1141,6 +2220,9 @@ static void KeyboardDownFunc(unsigned char key, int x, int y)
 		printf("showportals: %i\n", (rs.showportals ? 1 : 0));
 	}
 
+	if (input.keys['c'])
+		ToggleRecording();
+
 	if (input.keys['n'])
 	{
 		rs.shownodes = !rs.shownodes;
@@ -1194,6 +2276,8 @@ static void TimerFunc(int value)
 	// run the simulation code
 	SimulationTick();
 
+	RecordTick();
+
 	// kick a redraw
 	glutPostRedisplay();
 
@@ -1216,6 +2300,9 @@ int GLUTMain(int argc, char *argv[])
 	glutCreateWindow("test");
 	//glutHideWindow();
 
+	// the buffer objects can only be created once there's a context
+	InitRenderer();
+
 	glutReshapeFunc(ReshapeFunc);
 	glutDisplayFunc(DisplayFunc);
 	glutKeyboardFunc(KeyboardDownFunc);
@@ -1228,19 +2315,47 @@ int GLUTMain(int argc, char *argv[])
 	glutMainLoop();
 }
 
+static void PrintUsage()
+{
+	printf("bspview [--model name] [--bench camerapath] [--bench-out csv|json] bspfile\n");
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc == 1)
+	const char *filename = NULL;
+	const char *benchpath = NULL;
+	const char *benchformat = "csv";
+
+	for (int i = 1; i < argc; i++)
 	{
-		printf("bspview bspfile\n");
+		if (!strcmp(argv[i], "--bench") && i + 1 < argc)
+			benchpath = argv[++i];
+		else if (!strcmp(argv[i], "--bench-out") && i + 1 < argc)
+			benchformat = argv[++i];
+		else if (!strcmp(argv[i], "--model") && i + 1 < argc)
+			viewmodel = argv[++i];
+		else
+			filename = argv[i];
+	}
+
+	if (!filename)
+	{
+		PrintUsage();
 		exit(EXIT_SUCCESS);
 	}
 
 	// load the data
-	FILE *fp = FileOpenBinaryRead(argv[1]);
+	FILE *fp = FileOpenBinaryRead(filename);
 	LoadData(fp);
 	FileClose(fp);
 
+	// the benchmark doesn't need a window
+	if (benchpath)
+	{
+		RunBenchmark(benchpath, benchformat);
+		return 0;
+	}
+
 	GLUTMain(argc, argv);
 
 	return 0;
@@ -1,61 +1,149 @@
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include "glvis.h"
 
+// single producer / single consumer command ring
+//
+// the read thread writes commands at wpos and publishes whole commands by
+// moving cpos. The draw thread consumes committed commands and hands the space
+// back by moving rpos. The positions increase monotonically and are wrapped
+// with the mask when the data is accessed, so wpos - rpos is always the number
+// of bytes in use
+//
+// a read thread that runs out of space sleeps until the draw thread releases
+// some
+
+// smallest ring, big enough for any command but the vertex lists, which are
+// split to fit
+#define BUFFER_MIN_SIZE	(64 * 1024)
+
 struct buffer_t
 {
-	unsigned char *data;
-	int wpos;
-	int cpos;
+	unsigned char	*data;
+	unsigned int	size;
+	unsigned int	mask;
+
+	unsigned int	wpos;	// producer only
+	unsigned int	cpos;	// written by the producer, read by the consumer
+	unsigned int	rpos;	// written by the consumer, read by the producer
 };
 
-buffer_t buffer;
+static buffer_t buffer;
+
+static pthread_mutex_t	releaselock	= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	released	= PTHREAD_COND_INITIALIZER;
 
-void BufferFlush()
+static unsigned int LoadAcquire(unsigned int *p)
 {
-	buffer.wpos = buffer.cpos = 0;
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
 }
 
-void BufferCommit()
+static void StoreRelease(unsigned int *p, unsigned int value)
 {
-	buffer.cpos = buffer.wpos;
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
 }
 
-int BufferWriteAddr()
+// ________________________________________________________________________________
+// producer side
+
+void BufferCommit()
 {
-	return buffer.wpos;
+	StoreRelease(&buffer.cpos, buffer.wpos);
 }
 
-int BufferCommitAddr()
+// drops the command being written
+void BufferDiscard()
 {
-	return buffer.cpos;
+	buffer.wpos = buffer.cpos;
 }
 
 void BufferWriteBytes(void *data, int numbytes)
 {
 	unsigned char *src = (unsigned char*)data;
-	unsigned char *dst = (unsigned char*)(buffer.data + buffer.wpos);
 
-	for (int i = 0; i < numbytes; i++)
-		dst[i] = src[i];
+	// the command being written can't be consumed until it's committed
+	if (buffer.wpos + numbytes - buffer.cpos > buffer.size)
+		Error("Command is larger than the command buffer\n");
+
+	// wait for the draw thread to free up some space
+	if (buffer.wpos + numbytes - LoadAcquire(&buffer.rpos) > buffer.size)
+	{
+		pthread_mutex_lock(&releaselock);
+		while (buffer.wpos + numbytes - LoadAcquire(&buffer.rpos) > buffer.size)
+			pthread_cond_wait(&released, &releaselock);
+		pthread_mutex_unlock(&releaselock);
+	}
+
+	// copy up to the end of the ring, then wrap around to the start
+	unsigned int offset = buffer.wpos & buffer.mask;
+	unsigned int count = buffer.size - offset;
+	if (count > (unsigned int)numbytes)
+		count = numbytes;
+
+	memcpy(buffer.data + offset, src, count);
+	memcpy(buffer.data, src + count, numbytes - count);
 
 	buffer.wpos += numbytes;
 }
 
-// fixme: assert that the address is valid
+// ________________________________________________________________________________
+// consumer side
+
+unsigned int BufferReadAddr()
+{
+	return buffer.rpos;
+}
+
+unsigned int BufferCommitAddr()
+{
+	return LoadAcquire(&buffer.cpos);
+}
+
+// reads committed data, the address must be between the read and commit address
 void BufferReadBytes(unsigned int addr, void *data, int numbytes)
 {
-	unsigned char *src = (unsigned char*)(buffer.data + addr);
 	unsigned char *dst = (unsigned char*)data;
 
-	for (int i = 0; i < numbytes; i++)
-		dst[i] = src[i];
+	unsigned int offset = addr & buffer.mask;
+	unsigned int count = buffer.size - offset;
+	if (count > (unsigned int)numbytes)
+		count = numbytes;
+
+	memcpy(dst, buffer.data + offset, count);
+	memcpy(dst + count, buffer.data, numbytes - count);
 }
 
-void BufferInit(int numbytes)
+// hands everything before addr back to the producer
+void BufferRelease(unsigned int addr)
 {
-	buffer.data = (unsigned char*)malloc(numbytes);
+	// the position is moved under the lock so a producer that just found the
+	// ring full can't miss the wakeup
+	pthread_mutex_lock(&releaselock);
+	StoreRelease(&buffer.rpos, addr);
+	pthread_cond_signal(&released);
+	pthread_mutex_unlock(&releaselock);
+}
 
-	BufferFlush();
+// most bytes a single command can take
+int BufferSize()
+{
+	return buffer.size;
 }
 
+void BufferInit(int numbytes)
+{
+	// round the size up to a power of two so positions can be masked
+	unsigned int size = BUFFER_MIN_SIZE;
+	while (size < (unsigned int)numbytes)
+		size <<= 1;
+
+	buffer.data = (unsigned char*)malloc(size);
+	if (!buffer.data)
+		Error("Failed to allocate %u byte command buffer\n", size);
+
+	buffer.size = size;
+	buffer.mask = size - 1;
+	buffer.wpos = buffer.cpos = buffer.rpos = 0;
+}
 
@@ -343,49 +343,147 @@ static void SetPerspectiveMatrix()
 	GL_LoadMatrix(m);
 }
 
-static int readaddr = 0;
-static int endaddr = 0;
+// ________________________________________________________________________________ 
+// scene
+// commands are drained from the command buffer into a scene owned by the draw
+// thread so they can be replayed every frame. Once the stream sends frame
+// markers only complete frames are shown, otherwise everything received since
+// the last flush is drawn
+
+// limit how much of the stream is consumed each frame so rendering never stalls
+#define DRAIN_BYTES_PER_FRAME	(4 * 1024 * 1024)
+
+typedef struct scene_s
+{
+	unsigned char	*data;
+	int		numbytes;
+	int		maxbytes;
+
+} scene_t;
 
-static float ReadFloat()
+static scene_t	scenes[2];
+static scene_t	*building	= &scenes[0];
+static scene_t	*complete	= &scenes[1];
+static bool	framemarkers	= false;
+
+static void SceneReserve(scene_t *s, int numbytes)
 {
-	float f;
+	if (s->numbytes + numbytes <= s->maxbytes)
+		return;
 
-	BufferReadBytes(readaddr, &f, 4);
-	readaddr += 4;
+	int maxbytes = (s->maxbytes ? s->maxbytes : 64 * 1024);
+	while (s->numbytes + numbytes > maxbytes)
+		maxbytes *= 2;
 
-	return f;
+	s->data = (unsigned char*)realloc(s->data, maxbytes);
+	if (!s->data)
+		Error("Failed to grow the scene to %i bytes\n", maxbytes);
+
+	s->maxbytes = maxbytes;
 }
 
-static int ReadInt()
+// copy a command from the command buffer onto the end of the scene
+static void SceneAppend(scene_t *s, unsigned int addr, int numbytes)
 {
-	int i;
+	SceneReserve(s, numbytes);
+
+	BufferReadBytes(addr, s->data + s->numbytes, numbytes);
+	s->numbytes += numbytes;
+}
 
-	BufferReadBytes(readaddr, &i, 4);
-	readaddr += 4;
+static void EndSceneFrame()
+{
+	scene_t *t = complete;
+	complete = building;
+	building = t;
 
-	return i;
+	building->numbytes = 0;
+	framemarkers = true;
 }
 
-static cmdtype_t ReadCommand()
+// size of the command payload that follows the command type
+static int CommandSize(cmdtype_t cmdtype, unsigned int addr)
 {
-	cmdtype_t cmdtype;
+	int numvertices;
 
-	BufferReadBytes(readaddr, &cmdtype, 4);
-	readaddr += 4;
+	switch (cmdtype)
+	{
+		case CMD_FLUSH:
+		case CMD_END:
+			return 0;
+		case CMD_COLOR:
+			return 4 * sizeof(float);
+		case CMD_CULL:
+		case CMD_FILL:
+			return sizeof(int);
+		case CMD_LINES:
+		case CMD_TRIANGLES:
+			BufferReadBytes(addr, &numvertices, sizeof(int));
+			return sizeof(int) + (numvertices * 3 * sizeof(float));
+		default:
+			Error("unhandled command %i\n", cmdtype);
+			return 0;
+	}
+}
+
+static void DrainCommandBuffer()
+{
+	unsigned int addr	= BufferReadAddr();
+	unsigned int endaddr	= BufferCommitAddr();
+	int budget		= DRAIN_BYTES_PER_FRAME;
+
+	while (addr != endaddr && budget > 0)
+	{
+		cmdtype_t cmdtype;
+		BufferReadBytes(addr, &cmdtype, 4);
+
+		int numbytes = 4 + CommandSize(cmdtype, addr + 4);
 
-	return cmdtype;
+		if (cmdtype == CMD_FLUSH)
+			building->numbytes = 0;
+		else if (cmdtype == CMD_END)
+			EndSceneFrame();
+		else
+			SceneAppend(building, addr, numbytes);
+
+		addr += numbytes;
+		budget -= numbytes;
+	}
+
+	// hand the consumed space back to the read thread
+	BufferRelease(addr);
 }
 
-static void ProcessColor()
+static unsigned char *scenedata = NULL;
+static int readaddr = 0;
+static int endaddr = 0;
+
+// returns a pointer to the next numbytes of the scene and moves past them
+// every command and payload is a multiple of 4 bytes and the scene comes from
+// malloc, so the spans are always aligned for int and float access
+static const void *ReadSpan(int numbytes)
 {
-	float r, g, b, a;
+	const void *span = scenedata + readaddr;
+	readaddr += numbytes;
 
-	r = ReadFloat();
-	g = ReadFloat();
-	b = ReadFloat();
-	a = ReadFloat();
+	return span;
+}
+
+static int ReadInt()
+{
+	return *(const int*)ReadSpan(sizeof(int));
+}
 
-	glColor4f(r, g, b, a);
+static cmdtype_t ReadCommand()
+{
+	return *(const cmdtype_t*)ReadSpan(sizeof(cmdtype_t));
+}
+
+static void ProcessColor()
+{
+	const float *rgba = (const float*)ReadSpan(4 * sizeof(float));
+
+	glColor4fv(rgba);
 }
 
 static void ProcessCull()
@@ -418,44 +516,23 @@ static void ProcessFill()
 		glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
 }
 
+// the vertex data is drawn straight out of the scene
 static void ProcessLines()
 {
-	int numvertices;
-	float x, y, z;
-
-	numvertices = ReadInt();
-
-	glBegin(GL_LINES);
-	while (numvertices)
-	{
-		x = ReadFloat();
-		y = ReadFloat();
-		z = ReadFloat();
+	int numvertices = ReadInt();
+	const float *xyz = (const float*)ReadSpan(numvertices * 3 * sizeof(float));
 
-		glVertex3f(x, y, z);
-		numvertices--;
-	}
-	glEnd();
+	glVertexPointer(3, GL_FLOAT, 0, xyz);
+	glDrawArrays(GL_LINES, 0, numvertices);
 }
 
 static void ProcessTriangles()
 {
-	int numvertices;
-	float x, y, z;
-
-	numvertices = ReadInt();
-
-	glBegin(GL_TRIANGLES);
-	while (numvertices)
-	{
-		x = ReadFloat();
-		y = ReadFloat();
-		z = ReadFloat();
+	int numvertices = ReadInt();
+	const float *xyz = (const float*)ReadSpan(numvertices * 3 * sizeof(float));
 
-		glVertex3f(x, y, z);
-		numvertices--;
-	}
-	glEnd();
+	glVertexPointer(3, GL_FLOAT, 0, xyz);
+	glDrawArrays(GL_TRIANGLES, 0, numvertices);
 }
 
 static void DispatchCommand(cmdtype_t cmdtype)
@@ -475,12 +552,14 @@ static void DispatchCommand(cmdtype_t cmdtype)
 		{ CMD_TRIANGLES,	ProcessTriangles }
 	};
 
+	int numcmds = sizeof(cmdtab) / sizeof(cmdtab[0]);
+
 	int i = 0;
-	for(; i < CMD_NUM_COMMANDS; i++)
+	for(; i < numcmds; i++)
 		if(cmdtab[i].type == cmdtype)
 			break;
 
-	if(i == CMD_NUM_COMMANDS)
+	if(i == numcmds)
 	{
 		Error("unhandled command\n");
 		return;
@@ -506,12 +585,21 @@ static bool ProcessNextCommand()
 
 static void ProcessCommands()
 {
+	DrainCommandBuffer();
+
+	scene_t *scene = (framemarkers ? complete : building);
+
+	scenedata	= scene->data;
 	readaddr	= 0;
-	endaddr		= BufferCommitAddr();
+	endaddr		= scene->numbytes;
+
+	glEnableClientState(GL_VERTEX_ARRAY);
 
 	bool done = false;
 	while (readaddr < endaddr)
 		done = ProcessNextCommand();
+
+	glDisableClientState(GL_VERTEX_ARRAY);
 }
 
 static void BeginFrame()
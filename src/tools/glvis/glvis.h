@@ -3,32 +3,37 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include "gldfile.h"
 
+// the binary wire format maps directly onto the command buffer
 enum cmdtype_t
 {
-	CMD_FLUSH,
-	CMD_END,
-	CMD_COLOR,
-	CMD_CULL,
-	CMD_FILL,
-	CMD_LINES,
-	CMD_TRIANGLES,
-	CMD_NUM_COMMANDS
+	CMD_FLUSH		= GLD_CMD_FLUSH,
+	CMD_END			= GLD_CMD_END,
+	CMD_COLOR		= GLD_CMD_COLOR,
+	CMD_CULL		= GLD_CMD_CULL,
+	CMD_FILL		= GLD_CMD_FILL,
+	CMD_LINES		= GLD_CMD_LINES,
+	CMD_TRIANGLES		= GLD_CMD_TRIANGLES,
+	CMD_NUM_COMMANDS	= GLD_CMD_NUM_COMMANDS
 };
 
 void Error(const char *error, ...);
 void Warning(const char *warning, ...);
 
 // command buffer
+// CMD_FLUSH clears the scene and CMD_END marks the end of a frame
 void BufferInit(int numbytes);
+int BufferSize();
 void BufferWriteBytes(void *data, int numbytes);
-void BufferReadBytes(unsigned int addr, void *data, int numbytes);
-void BufferFlush();
 void BufferCommit();
-int BufferWriteAddr();
-int BufferCommitAddr();
+void BufferDiscard();
+unsigned int BufferReadAddr();
+unsigned int BufferCommitAddr();
+void BufferReadBytes(unsigned int addr, void *data, int numbytes);
+void BufferRelease(unsigned int addr);
 
-// file parsing
+// file parsing, the text and binary formats are detected from the stream
 void Read(FILE *fp);
 
 // rendering
@@ -48,6 +48,8 @@ static void ProcessCommandLine(int argc, char *argv[])
 static void PrintUsage()
 {
 	printf("--fifo read from a fifo instead of stdin or input files\n");
+	printf("--net listen for connections on port 1234\n");
+	printf("inputs can be text or the binary format written by bsp --debug-out\n");
 }
 
 #if 0
@@ -228,6 +230,8 @@ static void FifoReadLoop()
 			Error("couldn't open fifo \"%s\"\n", fifoname);
 
 		Read(fp);
+
+		fclose(fp);
 	}
 	while(readkeepalive);
 }
@@ -250,7 +254,7 @@ static void *ReadThread(void *args)
 			FifoReadLoop();
 			return EXIT_SUCCESS;
 		}
-		else if (!strcmp(argv[1], "--net"))
+		else if (!strcmp(argv[i], "--net"))
 		{
 			NetReadLoop();	
 			return EXIT_SUCCESS;
@@ -302,8 +306,6 @@ static void SetupBuffer(int argc, char *argv[])
 	}
 
 	BufferInit(numbytes);
-
-	BufferFlush();
 }
 
 int main(int argc, char *argv[])
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include "glvis.h"
 
@@ -23,6 +24,63 @@ static void EmitUnsignedInt(unsigned int ui)
 	BufferWriteBytes(&ui, 4);
 }
 
+// ________________________________________________________________________________ 
+// vertex lists
+// a list of lines or triangles too big for the command buffer is written as
+// several commands of whole primitives. Each one is committed once it's full so
+// the draw thread can take it while the next is written
+
+static cmdtype_t	vertexcmd;
+static int		vertexsleft;		// in the whole list
+static int		piecevertexsleft;	// in the command being written
+
+// most vertices of the list that fit in one command
+static int PieceVertices(cmdtype_t cmdtype)
+{
+	int primitive = (cmdtype == CMD_LINES ? 2 : 3);
+	int numvertices = (BufferSize() - 2 * sizeof(int)) / (3 * sizeof(float));
+
+	return numvertices - (numvertices % primitive);
+}
+
+static void BeginPiece()
+{
+	int numvertices = PieceVertices(vertexcmd);
+	if (numvertices > vertexsleft)
+		numvertices = vertexsleft;
+
+	EmitCommand(vertexcmd);
+	EmitInt(numvertices);
+	piecevertexsleft = numvertices;
+}
+
+static void BeginVertices(cmdtype_t cmdtype, int numvertices)
+{
+	vertexcmd = cmdtype;
+	vertexsleft = (numvertices > 0 ? numvertices : 0);
+
+	BeginPiece();
+}
+
+static void EmitVertex(float x, float y, float z)
+{
+	if (!vertexsleft)
+		return;
+
+	if (!piecevertexsleft)
+	{
+		BufferCommit();
+		BeginPiece();
+	}
+
+	EmitFloat(x);
+	EmitFloat(y);
+	EmitFloat(z);
+
+	piecevertexsleft--;
+	vertexsleft--;
+}
+
 #if 0
 // fixme: replace with this?
 static char *ReadToken(FILE *fp)
@@ -126,33 +184,28 @@ static void ReadLine(FILE *fp)
 {
 	float x, y, z;
 
-	EmitCommand(CMD_LINES);
-	EmitInt(2);
+	BeginVertices(CMD_LINES, 2);
 
 	x = ReadFloat(fp);
 	y = ReadFloat(fp);
 	z = ReadFloat(fp);
-	EmitFloat(x);
-	EmitFloat(y);
-	EmitFloat(z);
+	EmitVertex(x, y, z);
 
 	x = ReadFloat(fp);
 	y = ReadFloat(fp);
 	z = ReadFloat(fp);
-	EmitFloat(x);
-	EmitFloat(y);
-	EmitFloat(z);
+	EmitVertex(x, y, z);
+
+	BufferCommit();
 }
 
 static void ReadLineList(FILE *fp)
 {
 	int numlines, numvertices;
 
-	EmitCommand(CMD_LINES);
-
 	numlines = ReadInt(fp);
 	numvertices = numlines * 2;
-	EmitInt(numvertices);
+	BeginVertices(CMD_LINES, numvertices);
 
 	while (numvertices)
 	{
@@ -162,9 +215,7 @@ static void ReadLineList(FILE *fp)
 		x = ReadFloat(fp);
 		y = ReadFloat(fp);
 		z = ReadFloat(fp);
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 
 		numvertices--;
 	}
@@ -174,8 +225,7 @@ static void ReadLineList(FILE *fp)
 
 static void ReadTriangle(FILE *fp)
 {
-	EmitCommand(CMD_TRIANGLES);
-	EmitInt(3);
+	BeginVertices(CMD_TRIANGLES, 3);
 
 	for(int i = 0; i < 3; i++)
 	{
@@ -185,9 +235,7 @@ static void ReadTriangle(FILE *fp)
 		x = ReadFloat(fp);
 		y = ReadFloat(fp);
 		z = ReadFloat(fp);
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 	}
 
 	BufferCommit();
@@ -197,11 +245,9 @@ static void ReadTriangleList(FILE *fp)
 {
 	int numtris, numvertices;
 
-	EmitCommand(CMD_TRIANGLES);
-
 	numtris = ReadInt(fp);
 	numvertices = numtris * 3;
-	EmitInt(numvertices);
+	BeginVertices(CMD_TRIANGLES, numvertices);
 
 	while (numvertices)
 	{
@@ -211,9 +257,7 @@ static void ReadTriangleList(FILE *fp)
 		x = ReadFloat(fp);
 		y = ReadFloat(fp);
 		z = ReadFloat(fp);
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 
 		numvertices--;
 	}
@@ -226,12 +270,10 @@ static void ReadPolyline(FILE *fp)
 	int numvertices, numlines;
 	float x, y, z;
 	
-	EmitCommand(CMD_LINES);
-
 	// read numvertices
 	numvertices = ReadInt(fp);
 	numlines = numvertices - 1;
-	EmitInt(numlines * 2);
+	BeginVertices(CMD_LINES, numlines * 2);
 
 	// read the first vertex
 	x = ReadFloat(fp);
@@ -242,17 +284,13 @@ static void ReadPolyline(FILE *fp)
 	for(int i = 0; i < numlines; i++)
 	{
 		// emit the previous vertex
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 
 		// read and emit the next vertex
 		x = ReadFloat(fp);
 		y = ReadFloat(fp);
 		z = ReadFloat(fp);
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 	}
 
 	BufferCommit();
@@ -264,12 +302,10 @@ static void ReadPolygon(FILE *fp)
 	float x0, y0, z0;
 	float x, y, z;
 	
-	EmitCommand(CMD_TRIANGLES);
-
 	// read numvertices
 	numvertices = ReadInt(fp);
 	numtris = numvertices - 2;
-	EmitInt(numtris * 3);
+	BeginVertices(CMD_TRIANGLES, numtris * 3);
 
 	// read the first vertex
 	x0 = ReadFloat(fp);
@@ -284,31 +320,178 @@ static void ReadPolygon(FILE *fp)
 	for(int i = 0; i < numtris; i++)
 	{
 		// emit the pivot vertex
-		EmitFloat(x0);
-		EmitFloat(y0);
-		EmitFloat(z0);
+		EmitVertex(x0, y0, z0);
 
 		// emit the previous vertex
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 
 		// read and emit the next vertex
 		x = ReadFloat(fp);
 		y = ReadFloat(fp);
 		z = ReadFloat(fp);
-		EmitFloat(x);
-		EmitFloat(y);
-		EmitFloat(z);
+		EmitVertex(x, y, z);
 	}
 
 	BufferCommit();
 }
 
-//
-// read entry point
-//
-void Read(FILE *fp)
+static void ReadFlush(FILE *fp)
+{
+	EmitCommand(CMD_FLUSH);
+
+	BufferCommit();
+}
+
+static void ReadEnd(FILE *fp)
+{
+	EmitCommand(CMD_END);
+
+	BufferCommit();
+}
+
+// ________________________________________________________________________________ 
+// binary format
+
+// payloads are copied through in chunks so large commands don't need a big
+// buffer. Returns false if the stream ends first
+static bool CopyPayload(FILE *fp, int numbytes)
+{
+	static unsigned char chunk[64 * 1024];
+
+	while (numbytes)
+	{
+		int count = (numbytes < (int)sizeof(chunk) ? numbytes : (int)sizeof(chunk));
+
+		if (fread(chunk, count, 1, fp) != 1)
+			return false;
+
+		BufferWriteBytes(chunk, count);
+		numbytes -= count;
+	}
+
+	return true;
+}
+
+// the vertices are copied into as many commands as they need, see BeginVertices
+static bool CopyVertices(FILE *fp, cmdtype_t cmdtype, int numvertices)
+{
+	BeginVertices(cmdtype, numvertices);
+
+	while (1)
+	{
+		int count = piecevertexsleft;
+		if (!CopyPayload(fp, count * 3 * sizeof(float)))
+			return false;
+
+		vertexsleft -= count;
+		if (!vertexsleft)
+			return true;
+
+		BufferCommit();
+		BeginPiece();
+	}
+}
+
+static void SkipPayload(FILE *fp, int numbytes)
+{
+	for (; numbytes; numbytes--)
+		if (fgetc(fp) == EOF)
+			return;
+}
+
+// returns false if the payload size doesn't match the command or the stream
+// ends partway through it
+static bool ReadPacket(FILE *fp, gldpacket_t packet)
+{
+	int numvertices;
+
+	switch (packet.cmd)
+	{
+		case CMD_FLUSH:
+		case CMD_END:
+			if (packet.numbytes != 0)
+				return false;
+			EmitCommand((cmdtype_t)packet.cmd);
+			break;
+
+		case CMD_COLOR:
+		case CMD_CULL:
+		case CMD_FILL:
+			if (packet.numbytes != (packet.cmd == CMD_COLOR ? 16 : 4))
+				return false;
+			EmitCommand((cmdtype_t)packet.cmd);
+			if (!CopyPayload(fp, packet.numbytes))
+				return false;
+			break;
+
+		case CMD_LINES:
+		case CMD_TRIANGLES:
+			if (fread(&numvertices, sizeof(int), 1, fp) != 1)
+				return false;
+			// a count from the stream is checked before it can overflow the size
+			if (numvertices < 0 || numvertices > (INT_MAX - (int)sizeof(int)) / (3 * (int)sizeof(float)))
+				return false;
+			if (packet.numbytes != (int)sizeof(int) + (numvertices * 3 * (int)sizeof(float)))
+				return false;
+			if (!CopyVertices(fp, (cmdtype_t)packet.cmd, numvertices))
+				return false;
+			break;
+
+		default:
+			// skip commands from newer writers
+			Warning("Skipping unknown command %i\n", packet.cmd);
+			SkipPayload(fp, packet.numbytes);
+			return true;
+	}
+
+	BufferCommit();
+
+	return true;
+}
+
+// the first byte of the magic has already been read
+static void ReadBinary(FILE *fp)
+{
+	gldheader_t header;
+
+	header.magic[0] = GLD_MAGIC[0];
+	if (fread(header.magic + 1, sizeof(header) - 1, 1, fp) != 1)
+	{
+		Warning("Truncated binary stream header\n");
+		return;
+	}
+
+	if (memcmp(header.magic, GLD_MAGIC, 4))
+	{
+		Warning("Bad binary stream magic\n");
+		return;
+	}
+
+	if (header.version != GLD_VERSION)
+	{
+		Warning("Unsupported binary stream version %i\n", header.version);
+		return;
+	}
+
+	gldpacket_t packet;
+	while (fread(&packet, sizeof(packet), 1, fp) == 1)
+	{
+		// a live stream can end partway through a command when the compiler
+		// is stopped, the part that was read is dropped and the rest of the
+		// scene is left as it is
+		if (packet.numbytes < 0 || !ReadPacket(fp, packet))
+		{
+			BufferDiscard();
+			Warning("Corrupt or truncated packet in binary stream\n");
+			return;
+		}
+	}
+}
+
+// ________________________________________________________________________________ 
+// text format
+
+static void ReadText(FILE *fp)
 {
 	char *token;
 
@@ -322,7 +505,9 @@ void Read(FILE *fp)
 		}
 
 		if (!strcmp("flush", token))
-			BufferFlush();
+			ReadFlush(fp);
+		else if (!strcmp("end", token))
+			ReadEnd(fp);
 		else if (!strcmp("color", token))
 			ReadColor(fp);
 		else if (!strcmp("cull", token))
@@ -348,3 +533,23 @@ void Read(FILE *fp)
 	}
 }
 
+//
+// read entry point
+//
+void Read(FILE *fp)
+{
+	int c = fgetc(fp);
+
+	if (c == EOF)
+		return;
+
+	if (c == GLD_MAGIC[0])
+	{
+		ReadBinary(fp);
+		return;
+	}
+
+	ungetc(c, fp);
+	ReadText(fp);
+}
+
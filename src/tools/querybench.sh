@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# compile the test maps and measure query throughput on each
+
+BSP=./bsp/bsp
+QUERYBENCH=./querybench/querybench
+OUTDIR=${OUTDIR:-/tmp/querybench}
+
+mkdir -p $OUTDIR
+for SRCFILE in "$@"; do
+	BASENAME=$(basename ${SRCFILE%.*})
+	$BSP -o $OUTDIR/$BASENAME.bsp $SRCFILE > /dev/null || exit 1
+	$QUERYBENCH $OUTDIR/$BASENAME.bsp
+done
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bspquery.h"
+
+// measures query throughput over the node block of compiled bsp files. The
+// query inputs are random but seeded, so runs are repeatable
+
+static int numqueries = 1000000;
+static unsigned int seed = 1;
+
+// ________________________________________________________________________________
+// random inputs
+
+static unsigned int randstate;
+
+static float RandomFloat()
+{
+	randstate = randstate * 1664525u + 1013904223u;
+	return (randstate >> 8) * (1.0f / 16777216.0f);
+}
+
+// points in the root box, grown a little so some queries start outside the map
+static void RandomPoint(const qtree_t *tree, float p[3])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		float size = tree->maxs[i] - tree->mins[i];
+		float min = tree->mins[i] - 0.1f * size;
+		p[i] = min + 1.2f * size * RandomFloat();
+	}
+}
+
+// groups of segments that start and end close together, like the lines of
+// sight from a group of agents to a target
+static void CoherentSegments(const qtree_t *tree, float (*starts)[3], float (*ends)[3])
+{
+	float start[3], end[3];
+
+	for (int i = 0; i < numqueries; i++)
+	{
+		if (!(i % QUERY_PACKET_SIZE))
+		{
+			RandomPoint(tree, start);
+			RandomPoint(tree, end);
+		}
+
+		for (int j = 0; j < 3; j++)
+		{
+			starts[i][j] = start[j] + 32.0f * (RandomFloat() - 0.5f);
+			ends[i][j] = end[j] + 32.0f * (RandomFloat() - 0.5f);
+		}
+	}
+}
+
+static double Seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ________________________________________________________________________________
+// benchmarks
+
+static void BenchPointLeaf(const qtree_t *tree, float (*points)[3])
+{
+	int sum = 0;
+
+	double start = Seconds();
+	for (int i = 0; i < numqueries; i++)
+		sum += Query_PointLeaf(tree, points[i]);
+	double time = Seconds() - start;
+
+	printf("  pointleaf:  %12.0f queries/s (checksum %i)\n", numqueries / time, sum);
+}
+
+static void BenchTraceSegment(const qtree_t *tree, float (*points)[3])
+{
+	int numhits = 0;
+	int numstartsolid = 0;
+
+	double start = Seconds();
+	for (int i = 0; i < numqueries; i++)
+	{
+		qtrace_t trace;
+		Query_TraceSegment(tree, points[i], points[(i + 1) % numqueries], &trace);
+
+		numhits += (trace.hit ? 1 : 0);
+		numstartsolid += (trace.startsolid ? 1 : 0);
+	}
+	double time = Seconds() - start;
+
+	printf("  trace:      %12.0f queries/s (%.1f%% hit, %.1f%% start solid)\n", numqueries / time,
+		100.0 * numhits / numqueries, 100.0 * numstartsolid / numqueries);
+}
+
+static void BenchTracePackets(const qtree_t *tree)
+{
+	float (*starts)[3] = (float(*)[3])malloc(numqueries * sizeof(float[3]));
+	float (*ends)[3] = (float(*)[3])malloc(numqueries * sizeof(float[3]));
+	qtrace_t *traces = (qtrace_t*)malloc(numqueries * sizeof(qtrace_t));
+
+	CoherentSegments(tree, starts, ends);
+
+	double start = Seconds();
+	for (int i = 0; i < numqueries; i++)
+		Query_TraceSegment(tree, starts[i], ends[i], traces + i);
+	double singletime = Seconds() - start;
+
+	start = Seconds();
+	Query_TraceSegments(tree, starts, ends, numqueries, traces);
+	double packettime = Seconds() - start;
+
+	printf("  coherent:   %12.0f queries/s single, %12.0f queries/s in packets of %i (%.2fx)\n",
+		numqueries / singletime, numqueries / packettime, QUERY_PACKET_SIZE, singletime / packettime);
+
+	free(starts);
+	free(ends);
+	free(traces);
+}
+
+static void BenchBoxLeafs(const qtree_t *tree, float (*points)[3])
+{
+	int leafs[256];
+	long numleafs = 0;
+
+	double start = Seconds();
+	for (int i = 0; i < numqueries; i++)
+	{
+		float mins[3], maxs[3];
+		for (int j = 0; j < 3; j++)
+		{
+			mins[j] = points[i][j] - 16.0f;
+			maxs[j] = points[i][j] + 16.0f;
+		}
+
+		numleafs += Query_BoxLeafs(tree, mins, maxs, leafs, 256);
+	}
+	double time = Seconds() - start;
+
+	printf("  boxleafs:   %12.0f queries/s (%.2f leafs per query)\n", numqueries / time, (double)numleafs / numqueries);
+}
+
+static void BenchFile(const char *filename)
+{
+	qtree_t *tree = Query_LoadTree(filename);
+	if (!tree)
+	{
+		fprintf(stderr, "Failed to load tree from \"%s\"\n", filename);
+		exit(1);
+	}
+
+	if (tree->inodes)
+		printf("%s: %i implicit records\n", filename, tree->numinodes);
+	else
+		printf("%s: %i nodes, %i leafs\n", filename, tree->numnodes, tree->numleafs);
+
+	float (*points)[3] = (float(*)[3])malloc(numqueries * sizeof(float[3]));
+
+	randstate = seed;
+	for (int i = 0; i < numqueries; i++)
+		RandomPoint(tree, points[i]);
+
+	BenchPointLeaf(tree, points);
+	BenchTraceSegment(tree, points);
+	BenchTracePackets(tree);
+	BenchBoxLeafs(tree, points);
+
+	free(points);
+	Query_FreeTree(tree);
+}
+
+static void PrintUsage()
+{
+	printf("querybench [-n numqueries] [-seed n] bspfile ...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			numqueries = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+			seed = (unsigned int)atoi(argv[++i]);
+		else
+			break;
+	}
+
+	if (i == argc || numqueries <= 0)
+	{
+		PrintUsage();
+		exit(EXIT_SUCCESS);
+	}
+
+	for (; i < argc; i++)
+		BenchFile(argv[i]);
+
+	return 0;
+}